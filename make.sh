@@ -5,8 +5,16 @@ BUILD_DIR=build
 
 [ -d $BUILD_DIR ] || mkdir BUILD_DIR
 
+# The io_uring event backend is built if the kernel headers have what it
+# needs (IO_URING=no leaves it out)
+CFLAGS=
+if [ "$IO_URING" != "no" ] && echo '#include <linux/io_uring.h>
+int x = IORING_RECV_MULTISHOT | IORING_REGISTER_PBUF_RING;' \
+		| gcc -x c -c -o /dev/null - 2>/dev/null ; then
+	CFLAGS="$CFLAGS -DDME_IO_URING"
+fi
+
 for fx in $SRC ; do
 	bfx=$(basename $fx)
-	gcc -g -o build/${bfx/.c/} -Isrc $fx -lrt src/common/*.c
+	gcc -g $CFLAGS -o build/${bfx/.c/} -Isrc $fx -lrt src/common/*.c -lm
 done
-
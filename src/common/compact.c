@@ -0,0 +1,299 @@
+/*
+ * src/common/compact.c
+ *
+ * Compact wire format for the DME and supervisor messages.
+ *
+ * -------------------------------------------------------------------------
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+
+#include <common/compact.h>
+#include <common/net.h>
+#include <common/init.h>
+
+/* Global variables from main process */
+extern const link_info_t * const nodes;
+extern const size_t nodes_count;
+extern const proc_id_t proc_id;
+
+/*
+ * The messages are built in the full format, with fixed size big endian
+ * fields. With COMPACT_ENV set they are re-encoded when sent (see the
+ * format in net.h): a one byte magic, varints for the header fields and
+ * the data without the copy of the sender's id most algorithms carry.
+ * The receiver expands them back before dispatching, so the handlers only
+ * ever see the full format.
+ *
+ * The format is negotiated per peer. Until a peer is known to read it a
+ * process sends the full format with DME_FLAG_COMPACT set, and it starts
+ * sending the compact one once it gets a message with the flag, or a
+ * compact message, from that peer. Every process reads both formats.
+ *
+ * The varints carry their length in the first byte, so they are read and
+ * written with a single 8 byte load or store; the buffers have slack for it.
+ */
+
+#define CMSG_FLAGS_OFFSET   (offsetof(dme_message_hdr_t, flags))
+#define CMSG_PID_OFFSET     (offsetof(dme_message_hdr_t, process_id))
+#define CMSG_MAX_HDR_LEN    (1 + 5 * 9)         /* magic and five varints */
+#define CMSG_SLACK          (sizeof(uint64))
+
+static uint8 * cm_peers = NULL;         /* indexed by proc id, TRUE if compact */
+static int cm_active = -1;              /* not decided yet */
+
+/* Counters, to see what the format saves */
+static uint64 cm_sent_count = 0;
+static uint64 cm_saved_bytes = 0;
+
+bool_t compact_active(void)
+{
+    const char * env = NULL;
+
+    if (cm_active < 0) {
+        env = getenv(COMPACT_ENV);
+        cm_active = env && 0 != strcmp(env, "0");
+        if (cm_active && !(cm_peers = calloc(nodes_count + 1, sizeof(uint8)))) {
+            dbg_err("Could not allocate the compact format peers");
+            cm_active = FALSE;
+        }
+        dbg_msg("Compact wire format is %s", cm_active ? "on" : "off");
+    }
+    return cm_active;
+}
+
+/*
+ * Writes v as a varint at p, returns the position after it.
+ * Up to 8 bytes past the varint may be overwritten.
+ */
+static inline uint8 * cm_put(uint8 * p, uint64 v)
+{
+    unsigned int n = (64 - __builtin_clzll(v | 1) + 6) / 7;
+    uint64 word;
+
+    if (n > 8) {
+        *p = 0;
+        word = htole64(v);
+        memcpy(p + 1, &word, sizeof(word));
+        return p + 9;
+    }
+    word = htole64(((v << 1) | 1) << (n - 1));
+    memcpy(p, &word, sizeof(word));
+    return p + n;
+}
+
+/*
+ * Reads a varint at p into v, returns the position after it.
+ * Reads 9 bytes whatever its length.
+ */
+static inline const uint8 * cm_get(const uint8 * p, uint64 * v)
+{
+    unsigned int n = __builtin_ctz(p[0] | 0x100) + 1;
+    unsigned int k = n < 9 ? n : 8;
+    uint64 word;
+    uint64 word9;
+
+    memcpy(&word, p, sizeof(word));
+    memcpy(&word9, p + 1, sizeof(word9));
+    word = (le64toh(word) & (~0ULL >> (64 - 8 * k))) >> k;
+    *v = n < 9 ? word : le64toh(word9);
+    return p + n;
+}
+
+static inline void cm_mark(uint64 pid)
+{
+    if (compact_active() && pid <= nodes_count) {
+        cm_peers[pid] = TRUE;
+    }
+}
+
+static size_t cm_encode_dme(const uint8 * buff, size_t len, uint8 * out_buff)
+{
+    const dme_message_hdr_t * hdr = (const dme_message_hdr_t *)buff;
+    size_t data_len = len - DME_MESSAGE_HEADER_LEN;
+    const uint8 * dup = memmem(hdr->data, data_len,
+                               &hdr->process_id, sizeof(hdr->process_id));
+    size_t head_len = dup ? (size_t)(dup - hdr->data) : data_len;
+    size_t dup_len = dup ? sizeof(hdr->process_id) : 0;
+    uint8 * p = out_buff;
+
+    *p++ = DME_CMSG_MAGIC;
+    p = cm_put(p, ntohq(hdr->process_id));
+    p = cm_put(p, ntohs(hdr->msg_type));
+    p = cm_put(p, ntohs(hdr->flags) & ~DME_FLAG_COMPACT);
+    p = cm_put(p, (uint16)(len - ntohs(hdr->length)));
+    p = cm_put(p, dup ? head_len + 1 : 0);
+
+    memcpy(p, hdr->data, head_len);
+    p += head_len;
+    memcpy(p, hdr->data + head_len + dup_len, data_len - head_len - dup_len);
+    p += data_len - head_len - dup_len;
+
+    return p - out_buff;
+}
+
+static size_t cm_encode_sup(const uint8 * buff, uint8 * out_buff)
+{
+    const sup_message_t * msg = (const sup_message_t *)buff;
+    uint8 * p = out_buff;
+
+    *p++ = SUP_CMSG_MAGIC;
+    p = cm_put(p, ntohq(msg->process_id));
+    p = cm_put(p, ntohs(msg->msg_type));
+    p = cm_put(p, ntohs(msg->flags) & ~DME_FLAG_COMPACT);
+    p = cm_put(p, ntohl(msg->sec_tdelta));
+    p = cm_put(p, ntohl(msg->nsec_tdelta));
+
+    return p - out_buff;
+}
+
+/*
+ * Encodes the message in buff for dest into out_buff, which must have room
+ * for COMPACT_BUFF_LEN(len) bytes. Returns the encoded length, or 0 if the
+ * message is to be sent as it is (possibly with DME_FLAG_COMPACT set).
+ */
+size_t compact_encode(proc_id_t dest, uint8 * buff, size_t len,
+                      uint8 * out_buff)
+{
+    uint32 magic;
+    size_t out_len = 0;
+
+    if (!compact_active() || dest > nodes_count
+        || len < DME_MESSAGE_HEADER_LEN) {
+        return 0;
+    }
+    if (!cm_peers[dest]) {
+        compact_announce(buff, len);
+        return 0;
+    }
+
+    memcpy(&magic, buff, sizeof(magic));
+    magic = ntohl(magic);
+    if (magic == DME_MSG_MAGIC) {
+        out_len = cm_encode_dme(buff, len, out_buff);
+    } else if (magic == SUP_MSG_MAGIC && len == SUPERVISOR_MESSAGE_LENGTH) {
+        out_len = cm_encode_sup(buff, out_buff);
+    }
+
+    if (out_len == 0 || out_len >= len) {
+        return 0;
+    }
+    cm_sent_count++;
+    cm_saved_bytes += len - out_len;
+    return out_len;
+}
+
+/*
+ * Sets DME_FLAG_COMPACT on a full format message, if the format is on.
+ */
+void compact_announce(uint8 * buff, size_t len)
+{
+    uint32 magic;
+
+    if (!compact_active() || len < DME_MESSAGE_HEADER_LEN) {
+        return;
+    }
+    memcpy(&magic, buff, sizeof(magic));
+    magic = ntohl(magic);
+    if (magic == DME_MSG_MAGIC || magic == SUP_MSG_MAGIC) {
+        buff[CMSG_FLAGS_OFFSET] |= DME_FLAG_COMPACT >> 8;
+    }
+}
+
+/*
+ * Notes the sender of a full format message reads the compact one, if the
+ * message says so.
+ */
+void compact_learn(buff_t buff)
+{
+    uint64 pid;
+
+    if (!compact_active() || buff.len < DME_MESSAGE_HEADER_LEN
+        || !(buff.data[CMSG_FLAGS_OFFSET] & (DME_FLAG_COMPACT >> 8))) {
+        return;
+    }
+    memcpy(&pid, buff.data + CMSG_PID_OFFSET, sizeof(pid));
+    cm_mark(ntohq(pid));
+}
+
+/*
+ * Expands a compact message into a new buffer, holding one reference.
+ */
+int compact_decode(buff_t buff, buff_t * out_buff)
+{
+    uint8 head[CMSG_MAX_HDR_LEN + CMSG_SLACK];
+    const uint8 * p = head + 1;
+    uint64 pid, type, flags, delta, pos, sec, nsec;
+    size_t hdr_len, data_len, head_len, dup_len;
+    dme_message_hdr_t * hdr = NULL;
+    sup_message_t * msg = NULL;
+
+    memset(head, 0, sizeof(head));
+    memcpy(head, buff.data,
+           buff.len < CMSG_MAX_HDR_LEN ? buff.len : CMSG_MAX_HDR_LEN);
+
+    p = cm_get(p, &pid);
+    p = cm_get(p, &type);
+    p = cm_get(p, &flags);
+
+    if (head[0] == SUP_CMSG_MAGIC) {
+        p = cm_get(p, &sec);
+        p = cm_get(p, &nsec);
+        if (p - head != buff.len) {
+            return ERR_SUP_HDR;
+        }
+        if (!dme_buff_alloc(out_buff, SUPERVISOR_MESSAGE_LENGTH)) {
+            return ERR_MALLOC;
+        }
+        msg = (sup_message_t *)out_buff->data;
+        msg->sup_magic = htonl(SUP_MSG_MAGIC);
+        msg->process_id = htonq(pid);
+        msg->msg_type = htons((uint16)type);
+        msg->flags = htons((uint16)flags);
+        msg->sec_tdelta = htonl((uint32)sec);
+        msg->nsec_tdelta = htonl((uint32)nsec);
+        cm_mark(pid);
+        return 0;
+    }
+
+    p = cm_get(p, &delta);
+    p = cm_get(p, &pos);
+    hdr_len = p - head;
+    if (hdr_len > buff.len || pos > buff.len - hdr_len + 1) {
+        return ERR_DME_HDR;
+    }
+
+    dup_len = pos ? sizeof(hdr->process_id) : 0;
+    head_len = pos ? pos - 1 : buff.len - hdr_len;
+    data_len = buff.len - hdr_len + dup_len;
+    if (!dme_buff_alloc(out_buff, DME_MESSAGE_HEADER_LEN + data_len)) {
+        return ERR_MALLOC;
+    }
+
+    hdr = (dme_message_hdr_t *)out_buff->data;
+    hdr->dme_magic = htonl(DME_MSG_MAGIC);
+    hdr->process_id = htonq(pid);
+    hdr->msg_type = htons((uint16)type);
+    hdr->flags = htons((uint16)flags);
+    hdr->length = htons((uint16)(out_buff->len - delta));
+
+    memcpy(hdr->data, buff.data + hdr_len, head_len);
+    memcpy(hdr->data + head_len, &hdr->process_id, dup_len);
+    memcpy(hdr->data + head_len + dup_len, buff.data + hdr_len + head_len,
+           buff.len - hdr_len - head_len);
+    cm_mark(pid);
+    return 0;
+}
+
+void compact_deinit(void)
+{
+    if (cm_active > 0) {
+        dbg_msg("Sent %llu compact messages, %llu bytes less",
+                cm_sent_count, cm_saved_bytes);
+    }
+    safe_free(cm_peers);
+}
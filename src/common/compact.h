@@ -0,0 +1,28 @@
+/*
+ * src/common/compact.h
+ *
+ * Compact wire format for the DME and supervisor messages.
+ *
+ * -------------------------------------------------------------------------
+ */
+
+#ifndef COMPACT_H_
+#define COMPACT_H_
+
+#include <common/defs.h>
+
+/* Set (to anything but "0") to send compact messages to the peers that can */
+#define COMPACT_ENV     "DME_COMPACT"
+
+/* Room needed for an encoded message of len bytes */
+#define COMPACT_BUFF_LEN(len)   ((len) + 32)
+
+extern bool_t compact_active(void);
+extern size_t compact_encode(proc_id_t dest, uint8 * buff, size_t len,
+                             uint8 * out_buff);
+extern void   compact_announce(uint8 * buff, size_t len);
+extern void   compact_learn(buff_t buff);
+extern int    compact_decode(buff_t buff, buff_t * out_buff);
+extern void   compact_deinit(void);
+
+#endif /* COMPACT_H_ */
@@ -27,6 +27,8 @@
 #define ERR_RECV_MSG        0x1006
 #define ERR_DME_HDR         0x1007
 #define ERR_SUP_HDR         0x1008
+#define ERR_EVQ_FULL        0x1009
+#define ERR_TIMER           0x100A
 
 /* Errors above ERR_FATAL force quitting the program */
 #define ERR_FATAL       0x2000
@@ -72,6 +74,15 @@ typedef enum dme_evt_e {
 #define DME_SEV_MSG_IN DME_EV_SUP_MSG_IN   /* the supervisor uses only SUP messages */
     DME_SEV_PERIODIC_WORK,
     DME_SEV_SYNCRO,
+    DME_SEV_STARTUP_TICK,       /* ask again the sites that did not answer */
+    DME_SEV_ARRIVAL,            /* open loop: a new CS request arrives */
+
+    /* Message types of the startup handshake (no handlers) */
+    DME_SEV_READY,              /* a site is up / supervisor: are you up ? */
+    DME_SEV_SYNCRO_ACK,         /* a site got SYNCRO */
+
+    /* A site requests the CS on its own (see localload.c) */
+    DME_EV_LOCAL_REQUEST,
     
     /* 
      * Events greater than are DME_INTERNAL_EV_START registered statically.
@@ -81,6 +92,8 @@ typedef enum dme_evt_e {
     
     /* Internal events. Must not be used by the user */
     DME_IEV_PACK_IN,            /* Used by peer processes */
+    DME_IEV_LINK_EMU,           /* A held message is due (see linkemu.c) */
+    DME_IEV_REL_TIMEOUT,        /* Retransmission timeout (see reliable.c) */
     
     /* This means the event id is invalid */
     DME_EV_INVALID,
@@ -91,8 +104,15 @@ typedef enum dme_evt_e {
 /* Info to be included in adjacency matrix cells */
 typedef struct link_info_s {
     uint64 link_speeds[50];             /* Link speeds in bps to other nodes */
+    uint32 link_latency[50];            /* Link latencies in usec to other nodes */
     struct sockaddr_in listen_addr;     /* Address on which current process listens */
     int sock_fd;                        /* The socket bound to the listen address */
+    struct sockaddr_in mcast_addr;      /* Cluster multicast group (sin_family 0 if none) */
+    int mcast_fd;                       /* The socket joined to the multicast group */
+    struct sockaddr_in ctl_addr;        /* Supervisor messages address (sin_family 0 if none) */
+    int ctl_fd;                         /* The socket bound to the control address */
+    uint8 shm_link;                     /* Co-located site, reached through shared memory */
+    uint8 tcp_link;                     /* Site reached over TCP instead of UDP */
     proc_id_t proc_id;                  /* Process ID */
     process_state_t state;              /* Current process state */
 } link_info_t;
@@ -0,0 +1,91 @@
+/*
+ * src/common/dist.c
+ *
+ * Random distributions of the workload times (arrivals, think times,
+ * critical region durations).
+ *
+ * -------------------------------------------------------------------------
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <common/dist.h>
+#include <common/util.h>
+
+static const struct {
+    const char *    name;
+    dist_kind_t     kind;
+} dist_kinds[] = {
+    { "fixed",      DIST_FIXED },
+    { "exp",        DIST_EXP },
+    { "poisson",    DIST_EXP },
+    { "uniform",    DIST_UNIFORM },
+};
+
+#define DIST_KINDS_COUNT (sizeof(dist_kinds) / sizeof(dist_kinds[0]))
+
+int dist_kind_parse(const char * str, dist_kind_t * out_kind)
+{
+    int ix;
+
+    for (ix = 0; ix < DIST_KINDS_COUNT; ix++) {
+        if (0 == strcmp(str, dist_kinds[ix].name)) {
+            *out_kind = dist_kinds[ix].kind;
+            return 0;
+        }
+    }
+    return ERR_BADARGS;
+}
+
+int dist_parse(const char * str, dist_t * out_dist)
+{
+    const char * colon = strchr(str, ':');
+    char kind[16];
+    timespec_t mean;
+
+    out_dist->d_kind = DIST_FIXED;
+    if (colon) {
+        if (colon - str >= sizeof(kind)) {
+            return ERR_BADARGS;
+        }
+        memcpy(kind, str, colon - str);
+        kind[colon - str] = '\0';
+        if (dist_kind_parse(kind, &out_dist->d_kind)) {
+            return ERR_BADARGS;
+        }
+        str = colon + 1;
+    }
+    if (parse_duration(str, &mean)) {
+        return ERR_BADARGS;
+    }
+    out_dist->d_mean = mean.tv_sec + mean.tv_nsec / 1e9;
+    return 0;
+}
+
+timespec_t dist_sample(const dist_t * dist)
+{
+    /* in (0, 1), so that log() is finite */
+    double u = (random() + 1.0) / (RAND_MAX + 2.0);
+    double secs = dist->d_mean;
+    timespec_t ts;
+
+    switch (dist->d_kind) {
+    case DIST_EXP:
+        secs = -dist->d_mean * log(u);
+        break;
+    case DIST_UNIFORM:
+        secs = 2 * dist->d_mean * u;
+        break;
+    default:
+        break;
+    }
+
+    if (secs >= (uint32)-1) {
+        secs = (uint32)-1;
+    }
+    ts.tv_sec = (time_t)secs;
+    ts.tv_nsec = (long)((secs - ts.tv_sec) * 1e9);
+    return ts;
+}
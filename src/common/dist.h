@@ -0,0 +1,36 @@
+/*
+ * src/common/dist.h
+ *
+ * Random distributions of the workload times (arrivals, think times,
+ * critical region durations).
+ *
+ * -------------------------------------------------------------------------
+ */
+
+#ifndef DIST_H_
+#define DIST_H_
+
+#include <time.h>
+
+#include <common/defs.h>
+
+typedef enum dist_kind_e {
+    DIST_FIXED,         /* always the mean */
+    DIST_EXP,           /* exponential: the gaps of a Poisson process */
+    DIST_UNIFORM,       /* uniform in [0, 2 * mean] */
+} dist_kind_t;
+
+typedef struct dist_s {
+    dist_kind_t d_kind;
+    double      d_mean;                 /* seconds */
+} dist_t;
+
+/* "fixed", "exp" (or "poisson") and "uniform" */
+extern int dist_kind_parse(const char * str, dist_kind_t * out_kind);
+
+/* "[<kind>:]<duration>", e.g. "exp:10ms" (see parse_duration()) */
+extern int dist_parse(const char * str, dist_t * out_dist);
+
+extern struct timespec dist_sample(const dist_t * dist);
+
+#endif /* DIST_H_ */
@@ -11,37 +11,58 @@
 #define _GNU_SOURCE
 
 #include <stdio.h>
+#include <string.h>
 #include <signal.h>
 #include <time.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
 #include <common/init.h>
 #include <common/net.h>
+#include <common/twheel.h>
+#include <common/shmlink.h>
+#include <common/tcplink.h>
+#include <common/linkemu.h>
+#include <common/reliable.h>
+#include <common/compact.h>
+#include <common/trace.h>
+#include <common/uring.h>
+#include <common/udplink.h>
 
 
 /* error handling for the main program */
 extern int    err_code;
 extern bool_t exit_request;
+extern const link_info_t * const nodes;
+extern const proc_id_t proc_id;
 
 /* Forward declaration */
 static int net_demux(void * cookie);
+static int net_unbatch(buff_t * buff);
+static int net_unwrap(buff_t * buff);
+static int net_expand(buff_t * buff);
+
+/*
+ * The registry is indexed directly by the event id.
+ * Each event has a main handler and up to MAX_EV_HOOKS extra subscribers
+ * (e.g. metrics) which are called after it, in registration order.
+ */
+#define MAX_EV_HOOKS    (4)
 
 typedef struct dme_ev_reg_s {
-    dme_ev_t           der_event;
     ev_handler_fnct_t *der_funcp;
+    ev_handler_fnct_t *der_hooks[MAX_EV_HOOKS];
+    uint32             der_hooks_count;
 } dme_ev_reg_t;
 
-#define get_count(array) (sizeof(array) / sizeof(array[0]))
-
-typedef struct sig_cookie_s {
-    int         sc_evt;
-    void       *sc_cookie;
-} sig_cookie_t;
-
-typedef struct sig_timer_cookie_s {
-    int         stc_timer_idx;
-    int         stc_evt;
-    void       *stc_cookie;
-} sig_timer_cookie_t;
+typedef struct ev_cookie_s {
+    dme_ev_t    ec_evt;
+    void       *ec_cookie;
+    dme_timer_t ec_timer;       /* set for expired timers, claimed on dispatch */
+} ev_cookie_t;
 
 
 static int null_func(void * cookie) {
@@ -50,25 +71,32 @@ static int null_func(void * cookie) {
     return ERR_INIT;
 }
 
-static dme_ev_reg_t func_registry[] = {
-    { DME_EV_PEER_MSG_IN, null_func },
-    { DME_EV_SUP_MSG_IN, null_func },
-    { DME_EV_WANT_CRITICAL_REG, null_func },
-    { DME_EV_ENTERED_CRITICAL_REG, null_func },
-    { DME_EV_EXITED_CRITICAL_REG, null_func },
+static dme_ev_reg_t func_registry[DME_EV_INVALID + 1] = {
+    [DME_EV_PEER_MSG_IN]            = { null_func },
+    [DME_EV_SUP_MSG_IN]             = { null_func },  /* also DME_SEV_MSG_IN */
+    [DME_EV_WANT_CRITICAL_REG]      = { null_func },
+    [DME_EV_ENTERED_CRITICAL_REG]   = { null_func },
+    [DME_EV_EXITED_CRITICAL_REG]    = { null_func },
     
     /* Supervisor events */
-    { DME_SEV_MSG_IN, null_func },
-    { DME_SEV_PERIODIC_WORK, null_func },
-    { DME_SEV_SYNCRO, null_func },
+    [DME_SEV_PERIODIC_WORK]         = { null_func },
+    [DME_SEV_SYNCRO]                = { null_func },
+    [DME_SEV_STARTUP_TICK]          = { null_func },
+    [DME_SEV_ARRIVAL]               = { null_func },
+    [DME_SEV_READY]                 = { null_func },
+    [DME_SEV_SYNCRO_ACK]            = { null_func },
+    [DME_EV_LOCAL_REQUEST]          = { null_func },
+
+    [DME_INTERNAL_EV_START]         = { null_func },
 
     /* Iternal events are registered statically */
-    { DME_IEV_PACK_IN, net_demux },
+    [DME_IEV_PACK_IN]               = { net_demux },
+    [DME_IEV_LINK_EMU]              = { link_emu_release },
+    [DME_IEV_REL_TIMEOUT]           = { rel_link_timeout },
     
     /* invalid events */
-    { DME_EV_INVALID, null_func}
+    [DME_EV_INVALID]                = { null_func },
 };
-static func_registry_count = get_count(func_registry);
 
 const char * evtostr (dme_ev_t event) {
 	switch(event) {
@@ -80,15 +108,21 @@ const char * evtostr (dme_ev_t event) {
 
 	case DME_SEV_PERIODIC_WORK: return "DME_SEV_PERIODIC_WORK";
 	case DME_SEV_SYNCRO: return "DME_SEV_SYNCRO";
+	case DME_SEV_STARTUP_TICK: return "DME_SEV_STARTUP_TICK";
+	case DME_SEV_ARRIVAL: return "DME_SEV_ARRIVAL";
+	case DME_SEV_READY: return "DME_SEV_READY";
+	case DME_SEV_SYNCRO_ACK: return "DME_SEV_SYNCRO_ACK";
+	case DME_EV_LOCAL_REQUEST: return "DME_EV_LOCAL_REQUEST";
 
 	case DME_IEV_PACK_IN: return "DME_IEV_PACK_IN";
+	case DME_IEV_LINK_EMU: return "DME_IEV_LINK_EMU";
+	case DME_IEV_REL_TIMEOUT: return "DME_IEV_REL_TIMEOUT";
 	}
 	return "DME_EV_INVALID";
 }
 
 #define SIGRT_NETWORK  (SIGRTMIN)
 #define SIGRT_TIMEREXP (SIGRTMIN + 1)
-#define SIGRT_DELIVER  (SIGRTMIN + 2)
 static unsigned int tick_count = 0;
 
 const char * sigrttostr (unsigned int signo) {
@@ -96,106 +130,267 @@ const char * sigrttostr (unsigned int signo) {
 		return "SIGRT_NETWORK";
 	} else if (signo == SIGRT_TIMEREXP) {
 		return "SIGRT_TIMEREXP";
-	} else if (signo == SIGRT_DELIVER) {
-		return "SIGRT_DELIVER";
 	}
 	return "OTHER_SIGNAL";
 }
 /* 
- * Timers pool
+ * Timers.
+ * All the scheduled events live in a timing wheel (see twheel.c) which is
+ * driven by a single kernel timer, armed for the next wheel expiry.
+ * Wheel times are CLOCK_MONOTONIC microseconds and the dme_timer_t handles
+ * are the wheel's timer handles.
+ */
+static timer_t wheel_timer;                     /* signal backend */
+static bool_t wheel_timer_created = FALSE;
+static int wheel_timer_fd = -1;                 /* epoll backend */
+static uint32 wheel_timer_gen = 0;              /* io_uring backend */
+static uint64 wheel_timer_armed = 0;            /* 0 if disarmed */
+
+/*
+ * Event queue.
+ * A fixed size ring of (event, cookie) pairs filled by deliver_event() and
+ * drained in FIFO order by wait_events() before waiting for new events.
+ * The head and tail are free running counters (EV_QUEUE_LEN is a power of 2).
+ */
+#define EV_QUEUE_LEN    (4096)
+#define EV_QUEUE_MASK   (EV_QUEUE_LEN - 1)
+
+static ev_cookie_t ev_queue[EV_QUEUE_LEN];
+static uint32 ev_queue_head = 0;                /* next element to dispatch */
+static uint32 ev_queue_tail = 0;                /* next free slot */
+
+/*
+ * Event loop backends.
+ * The backend is chosen at startup from the DME_EVENT_BACKEND environment
+ * variable ("signal", "epoll" or "io_uring"). The default is the signal
+ * backend, which is also used when io_uring is not built in or unavailable.
  */
-#define MAX_TIMERS      (64)
+#define EV_BACKEND_ENV  "DME_EVENT_BACKEND"
 
-typedef enum timer_state {
-    TIMER_UNUSED = 0,
-    TIMER_DISARMED,
-    TIMER_ARMED,
-    TIMER_EXPIRED,
-} timer_state_t;
+typedef enum ev_backend_e {
+    EV_BACKEND_SIGNAL,          /* real-time signals + sigwaitinfo() */
+    EV_BACKEND_EPOLL,           /* epoll + timerfd + signalfd */
+    EV_BACKEND_URING,           /* io_uring requests for everything */
+} ev_backend_t;
 
-static timer_t timers_pool[MAX_TIMERS] = {};
-static timer_state_t timers_state[MAX_TIMERS] = {TIMER_UNUSED};
+static ev_backend_t ev_backend = EV_BACKEND_SIGNAL;
 
 /*
- * Helper functions for events registry and timers pool.
+ * epoll backend state.
+ * The epoll data of each source is a tag.
  */
+#define EPOLL_TAG_STOP      (1)
+#define EPOLL_TAG_TIMER     (2)
+#define EPOLL_TAG_NETWORK   (8)                 /* + the socket's fd */
+#define EPOLL_MAX_EVENTS    (32)
+
+static int epoll_fd = -1;
+static int stop_fd = -1;                        /* signalfd for SIGTSTP */
 
 /*
- * Gets a pointer to a certain's event handler function.
- * It can also be used to modify these functions in the registry.
+ * io_uring backend state.
+ * Datagram sockets have a multishot receive into the provided buffers (see
+ * net.c), the other inputs a multishot poll. The wheel timer is a timeout
+ * request, replaced with the next submission when the expiry changes.
  */
-static ev_handler_fnct_t ** get_registry_funcp (dme_ev_t event)
-{   
-    int ix = 0;
-    
-    while (ix < func_registry_count && func_registry[ix].der_event != event) {
-        ix++;
+#define URING_ENTRIES       (256)
+#define URING_REAP_LEN      (64)                /* completions handled at once */
+
+#ifdef DME_IO_URING
+static struct __kernel_timespec wheel_timer_ts;
+#endif
+
+/*
+ * The sockets messages are received on: the listening socket and, if the
+ * cluster has one, the multicast group socket, and the connected UDP
+ * sockets to the peers (see udplink.c). The shared memory links
+ * add their doorbell and an eventfd per peer (see shmlink.c), the TCP
+ * transport its listening socket and connections (see tcplink.c).
+ */
+#define MAX_INPUT_SOCKS     (256)
+
+static int input_socks[MAX_INPUT_SOCKS];
+static int input_socks_count = 0;
+
+/* The DME_IEV_PACK_IN cookie names the ready socket (NULL: all of them) */
+#define sock_to_cookie(sock)    ((void *)(long)((sock) + 1))
+#define cookie_to_sock(cookie)  ((int)(long)(cookie) - 1)
+
+/*
+ * Helper functions for events registry and timers.
+ */
+
+/*
+ * Gets a certain event's registry entry. Out of range events map to
+ * DME_EV_INVALID.
+ */
+static inline dme_ev_reg_t * get_registry_entry (dme_ev_t event)
+{
+    if ((unsigned int)event < DME_EV_INVALID) {
+        return &func_registry[event];
     }
-    
-    if (ix < func_registry_count) {
-        return &(func_registry[ix].der_funcp);
+    return &func_registry[DME_EV_INVALID];
+}
+
+/*
+ * Calls the extra subscribers of an event. A fatal error from any of them
+ * overrides the main handler's status.
+ */
+static int call_event_hooks (const dme_ev_reg_t * reg, void * cookie, int err)
+{
+    uint32 ix;
+    int hook_err;
+
+    for (ix = 0; ix < reg->der_hooks_count; ix++) {
+        hook_err = reg->der_hooks[ix](cookie);
+        if (hook_err >= ERR_FATAL) {
+            err = hook_err;
+        }
+    }
+    return err;
+}
+
+/*
+ * Calls all the handlers registered to an event.
+ * With a single handler this is just one indirect call.
+ */
+static inline int dispatch_event (dme_ev_t event, void * cookie)
+{
+    const dme_ev_reg_t * reg = get_registry_entry(event);
+    int err = reg->der_funcp(cookie);
+
+    if (reg->der_hooks_count) {
+        err = call_event_hooks(reg, cookie, err);
     }
+    return err;
+}
+
+static uint64 wheel_time_now(void)
+{
+    struct timespec ts;
 
-    return &(func_registry[DME_EV_INVALID].der_funcp);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
 /*
- * Returns the index of the first free timer in the pool or -1 otherwise. 
+ * Appends an event to the event queue.
  */
-static int get_free_timer(void) {
-    static int last_timer = 0;
-    int ix;
-    
-    ix = last_timer;
-    do {
-        if (timers_state[ix] == TIMER_UNUSED) {
-            last_timer = ix;
-            return last_timer;
-        }
-        
-        /* wrap ix around MAX_TIMERS */
-        ix = (++ix < MAX_TIMERS) ? ix : 0;
-    } while (ix != last_timer);
-    
-    /* We got to last_timer, meaning that no free slot was found */
-    return -1;
+static int ev_queue_push(dme_ev_t event, void * cookie, dme_timer_t timer)
+{
+    ev_cookie_t * pec = NULL;
+
+    if (ev_queue_tail - ev_queue_head >= EV_QUEUE_LEN) {
+        dbg_err("Event queue overflow! Dropping event %s (%d)",
+                evtostr(event), event);
+        return ERR_EVQ_FULL;
+    }
+
+    /* store the event and cookie inline */
+    pec = &ev_queue[ev_queue_tail & EV_QUEUE_MASK];
+    pec->ec_evt    = event;
+    pec->ec_cookie = cookie;
+    pec->ec_timer  = timer;
+    ev_queue_tail++;
+
+    return 0;
 }
 
 /*
- * Signal handling functions ( ... sending the right signals :) )
+ * Queue an expired timer. Its event and cookie are only looked up when it
+ * is dispatched, so cancel_event() still works until then.
  */
+static bool_t wheel_fire(tw_handle_t timer)
+{
+    return (0 == ev_queue_push(DME_EV_INVALID, NULL, timer));
+}
 
+#ifdef DME_IO_URING
 /*
- * Event delivery handler. This function dispaches the functions in func_registry.
+ * Replaces the timeout request of the io_uring backend if the next wheel
+ * expiry changed. The requests are told apart by a generation number, so
+ * the expiry of a replaced one is ignored. This is called right before each
+ * wait, so the timeout request is submitted with the rest.
  */
-static void queued_event_handler(int sig, siginfo_t *siginfo, void * context)
+static void wheel_timer_submit(void)
 {
-	dbg_msg();
-    int err;
-    /* This function should only be registered to SIGRT_DELIVER */
-    if (siginfo->si_signo != SIGRT_DELIVER) {
+    struct io_uring_sqe * sqe = NULL;
+    uint64 next = 0;
+
+    if (!twheel_next_expiry(&next)) {
+        next = 0;
+    }
+    if (next == wheel_timer_armed) {
         return;
     }
-    
-    /* save data from inside the container */
-    sig_cookie_t * sc = siginfo->si_ptr;
-    int   evt    = sc->sc_evt;
-    void *cookie = sc->sc_cookie;
-    
-    /* Discard the container after recieving the data */
-    safe_free(sc);
-    
-    /* Call the function registered to the sc->sc_evt event */
-    dbg_msg("Handling event %s (%d)", evtostr(evt), evt);
-    err = (*get_registry_funcp(evt))(cookie);
-    
-    /* If there was a fata error terminate the program */
-    if (err >= ERR_FATAL) {
-        err_code = err;
-        exit_request = TRUE;
+
+    if (wheel_timer_armed && (sqe = uring_sqe())) {
+        sqe->opcode = IORING_OP_TIMEOUT_REMOVE;
+        sqe->addr = uring_tag(URING_KIND_TIMER, wheel_timer_gen);
+        sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+        sqe->user_data = uring_tag(URING_KIND_CANCEL, 0);
+    }
+    wheel_timer_gen++;
+
+    if (next && (sqe = uring_sqe())) {
+        wheel_timer_ts.tv_sec = next / 1000000;
+        wheel_timer_ts.tv_nsec = (next % 1000000) * 1000;
+        sqe->opcode = IORING_OP_TIMEOUT;
+        sqe->addr = (unsigned long)&wheel_timer_ts;
+        sqe->len = 1;
+        sqe->timeout_flags = IORING_TIMEOUT_ABS;
+        sqe->user_data = uring_tag(URING_KIND_TIMER, wheel_timer_gen);
+    }
+    wheel_timer_armed = next;
+}
+#endif
+
+/*
+ * (Re)arms the kernel timer for the next wheel expiry if it changed.
+ * With io_uring this is left to the event loop (see wheel_timer_submit()).
+ */
+static void wheel_timer_update(void)
+{
+    struct itimerspec tspec = {};
+    uint64 next = 0;
+
+    if (ev_backend == EV_BACKEND_URING) {
+        return;
+    }
+
+    if (!twheel_next_expiry(&next)) {
+        next = 0;
+    }
+
+    if (next == wheel_timer_armed) {
+        return;
+    }
+
+    /* An absolute time in the past fires immediately, zero disarms */
+    tspec.it_value.tv_sec = next / 1000000;
+    tspec.it_value.tv_nsec = (next % 1000000) * 1000;
+
+    if (ev_backend == EV_BACKEND_EPOLL) {
+        timerfd_settime(wheel_timer_fd, TFD_TIMER_ABSTIME, &tspec, NULL);
+    } else {
+        timer_settime(wheel_timer, TIMER_ABSTIME, &tspec, NULL);
     }
+    wheel_timer_armed = next;
+}
+
+/*
+ * The kernel timer expired: deliver all the due events and rearm it.
+ */
+static void wheel_timer_expired(void)
+{
+    wheel_timer_armed = 0;
+    twheel_expire(wheel_time_now(), wheel_fire);
+    wheel_timer_update();
 }
 
+/*
+ * Signal handling functions ( ... sending the right signals :) )
+ */
 
 /*
  * SIGRT_TIMEREXP handler
@@ -208,12 +403,7 @@ static void timer_expire_handler(int sig, siginfo_t *siginfo, void * context)
         return;
     }
     
-    sig_timer_cookie_t * stc = siginfo->si_ptr;
-    dbg_msg("timer_idx=%d", stc->stc_timer_idx);
-    timers_state[stc->stc_timer_idx] = TIMER_UNUSED;
-    timer_delete(timers_pool[stc->stc_timer_idx]);
-    deliver_event(stc->stc_evt, stc->stc_cookie);
-    safe_free(stc);
+    wheel_timer_expired();
     
     return;
 }
@@ -221,51 +411,246 @@ static void timer_expire_handler(int sig, siginfo_t *siginfo, void * context)
 static void networkio_handler (int sig, siginfo_t *siginfo, void * context)
 {
     dbg_msg("");
-    /* Just queue a DME_IEV_PACK_IN event */
+    int ix;
+
+    /* Just queue a DME_IEV_PACK_IN event for the socket that is ready */
+    for (ix = 0; ix < input_socks_count; ix++) {
+        if (siginfo && siginfo->si_fd == input_socks[ix]) {
+            deliver_event(DME_IEV_PACK_IN, sock_to_cookie(input_socks[ix]));
+            return;
+        }
+    }
     deliver_event(DME_IEV_PACK_IN, NULL);
 }
 
 /*
- * net_demux()
- * 
- * Checks the source(magic) of the message (peer/supervisor) and calls the
- * DME_IEV_PACK_IN registered processing routine.
- * The cookie is ignored.
+ * Dispatches a received message by its magic.
  */
-static int net_demux(void * cookie)
+static int net_dispatch(buff_t * buff)
 {
-    dbg_msg("");
-    int err = 0;
     uint32 magic;
-    buff_t buff = {NULL, 0};
-    
-    /* get the contents of the message */
-    if (0 != (err = dme_recv_msg(&buff.data, &buff.len))) {
-        return err;
+
+    /* compact messages have a one byte magic */
+    if (buff->len > 0 && is_compact_magic(buff->data[0])) {
+        return net_expand(buff);
     }
 
     /* check the magic of the mesage */
-    magic = ntohl(*(uint32 *)buff.data);
-    
+    if (buff->len < sizeof(magic)) {
+        dbg_err("Recieved a truncated packet. Ignoring it.");
+        return 0;
+    }
+    magic = ntohl(*(uint32 *)buff->data);
+
     if (magic == SUP_MSG_MAGIC) {
-        err = (*get_registry_funcp(DME_EV_SUP_MSG_IN))(&buff);
+        compact_learn(*buff);
+        return dispatch_event(DME_EV_SUP_MSG_IN, buff);
     } else if (magic == DME_MSG_MAGIC) {
-        err = (*get_registry_funcp(DME_EV_PEER_MSG_IN))(&buff);
-    } else {
-        dbg_err("Recieved possibly malformed messge:"\
-                " MAGIC=0X%08X . Ignoring packet.", magic);
-        err = ERR_BAD_MAGIC;
+        compact_learn(*buff);
+        return dispatch_event(DME_EV_PEER_MSG_IN, buff);
+    } else if (magic == DME_BATCH_MAGIC) {
+        return net_unbatch(buff);
+    } else if (magic == DME_REL_MAGIC) {
+        return net_unwrap(buff);
     }
-    
-    /* Free the allocated buffer data (if any) */ 
-    safe_free(buff.data);
-    
-    /* If there was a fatal error terminate the program */
-    if (err >= ERR_FATAL) {
-        err_code = err;
-        exit_request = TRUE;
+
+    dbg_err("Recieved possibly malformed messge:"\
+            " MAGIC=0X%08X . Ignoring packet.", magic);
+    return ERR_BAD_MAGIC;
+}
+
+/*
+ * Dispatches the messages of a batch (see dme_batch_hdr_t) in order.
+ * Each one gets a buffer of its own, so that handlers can reference it.
+ */
+static int net_unbatch(buff_t * buff)
+{
+    dme_batch_hdr_t hdr;
+    buff_t msg;
+    uint16 msg_len;
+    size_t pos = DME_BATCH_HEADER_LEN;
+    unsigned int ix;
+    int err = 0;
+
+    if (buff->len < DME_BATCH_HEADER_LEN) {
+        dbg_err("Recieved a truncated batch. Ignoring it.");
+        return 0;
+    }
+    memcpy(&hdr, buff->data, DME_BATCH_HEADER_LEN);
+
+    for (ix = 0; ix < ntohs(hdr.count) && err < ERR_FATAL && !exit_request; ix++) {
+        if (pos + DME_BATCH_ITEM_LEN > buff->len) {
+            break;
+        }
+        memcpy(&msg_len, buff->data + pos, DME_BATCH_ITEM_LEN);
+        msg_len = ntohs(msg_len);
+        pos += DME_BATCH_ITEM_LEN;
+        if (pos + msg_len > buff->len) {
+            break;
+        }
+
+        if (!dme_buff_alloc(&msg, msg_len)) {
+            return ERR_MALLOC;
+        }
+        memcpy(msg.data, buff->data + pos, msg_len);
+        pos += msg_len;
+
+        /* batches are not nested */
+        if (msg_len >= sizeof(uint32)
+            && ntohl(*(uint32 *)msg.data) == DME_BATCH_MAGIC) {
+            dbg_err("Recieved a nested batch. Ignoring it.");
+        } else {
+            err = net_dispatch(&msg);
+        }
+        dme_buff_unref(msg);
+    }
+
+    if (ix < ntohs(hdr.count)) {
+        dbg_err("Recieved a truncated batch (%u of %u messages).",
+                ix, ntohs(hdr.count));
+    }
+    return err;
+}
+
+/*
+ * Dispatches a compact message (see compact.c) in the full format.
+ */
+static int net_expand(buff_t * buff)
+{
+    buff_t msg;
+    int err = 0;
+
+    if ((err = compact_decode(*buff, &msg))) {
+        dbg_err("Recieved a malformed compact message. Ignoring it.");
+        return err >= ERR_FATAL ? err : 0;
+    }
+
+    err = net_dispatch(&msg);
+    dme_buff_unref(msg);
+    return err;
+}
+
+/*
+ * Dispatches the messages a reliable delivery envelope makes deliverable.
+ */
+static int net_unwrap(buff_t * buff)
+{
+    buff_t msgs[REL_WINDOW + 1];
+    unsigned int count = 0;
+    unsigned int ix;
+    int err = 0;
+
+    if ((err = rel_link_recv(*buff, msgs, &count))) {
+        return err;
+    }
+
+    for (ix = 0; ix < count; ix++) {
+        if (err < ERR_FATAL && !exit_request) {
+            err = net_dispatch(&msgs[ix]);
+        }
+        dme_buff_unref(msgs[ix]);
+    }
+    return err;
+}
+
+/*
+ * Receives and dispatches a batch of the messages waiting on a socket.
+ */
+static int net_demux_batch(int sock, unsigned int * out_count)
+{
+    int err = 0;
+    buff_t buffs[RECV_BATCH_LEN];
+    unsigned int ix;
+
+    *out_count = 0;
+
+    /* get the contents of the ready messages */
+    if (0 != (err = dme_recv_batch(sock, buffs, out_count))) {
+        return err;
+    }
+
+    for (ix = 0; ix < *out_count && !exit_request; ix++) {
+        /* dropped by the receive path */
+        if (buffs[ix].len == 0) {
+            continue;
+        }
+
+        err = net_dispatch(&buffs[ix]);
+
+        /* If there was a fatal error terminate the program */
+        if (err >= ERR_FATAL) {
+            err_code = err;
+            exit_request = TRUE;
+        }
+    }
+
+    /* Release our references (handlers may still hold their own) */
+    for (ix = 0; ix < *out_count; ix++) {
+        dme_buff_unref(buffs[ix]);
+    }
+    return err;
+}
+
+/*
+ * Receives and dispatches all the messages waiting on a socket.
+ * An error of the control socket is returned unless the socket has one.
+ */
+static int net_demux_sock(int sock)
+{
+    int ctl_fd = nodes[proc_id].ctl_fd;
+    int ctl_err = 0;
+    int err = 0;
+    unsigned int count = 0;
+
+    do {
+        /* the supervisor messages don't wait behind a backlog of the others */
+        if (ctl_fd > 0 && sock != ctl_fd) {
+            do {
+                if ((err = net_demux_batch(ctl_fd, &count))) {
+                    ctl_err = err;
+                }
+            } while (count == RECV_BATCH_LEN && !exit_request);
+        }
+
+        if (0 != (err = net_demux_batch(sock, &count)) && count == 0) {
+            return err;
+        }
+    /* a full batch means there may be more waiting */
+    } while (count == RECV_BATCH_LEN && !exit_request);
+
+    return err ? err : ctl_err;
+}
+
+/*
+ * net_demux()
+ * 
+ * Receives all the messages waiting on a socket, in batches, and for each
+ * of them checks the source(magic) of the message (peer/supervisor) and
+ * calls the registered processing routine, in the order they arrived.
+ * The handlers get a buff_t view of the received data and must take a
+ * reference (dme_buff_ref()) to keep it after they return.
+ * The cookie names the ready socket; if NULL all the sockets are read.
+ * The control socket, if any, is read before each batch of the others.
+ */
+static int net_demux(void * cookie)
+{
+    dbg_msg("");
+    int err = 0;
+    int ix;
+
+    if (cookie) {
+        /* the socket may have been removed since the event was queued */
+        for (ix = 0; ix < input_socks_count; ix++) {
+            if (input_socks[ix] == cookie_to_sock(cookie)) {
+                return net_demux_sock(input_socks[ix]);
+            }
+        }
+        return 0;
     }
 
+    for (ix = 0; ix < input_socks_count && !exit_request; ix++) {
+        err = net_demux_sock(input_socks[ix]);
+    }
     return err;
 }
 
@@ -289,38 +674,96 @@ register_event_handler_ (dme_ev_t event, ev_handler_fnct_t func,
         dbg_err("Can not register handler for internal events!");
     } else {
         dbg_msg("ev_handler(%s) <- %s()", evtostr(event), funcname);
-        dbg_msg("before: regfp=%-10p *regfp=%-10p | func=%-10p *func=%-10p",
-                get_registry_funcp(event), *get_registry_funcp(event),
-                func, *func);
+        dbg_msg("before: regfp=%-10p | func=%-10p",
+                func_registry[event].der_funcp, func);
         
-        *(get_registry_funcp(event)) = func;
+        func_registry[event].der_funcp = func;
         
-        dbg_msg("after:  regfp=%-10p *regfp=%-10p | func=%-10p *func=%-10p",
-                get_registry_funcp(event), *get_registry_funcp(event),
-                func, *func);
+        dbg_msg("after:  regfp=%-10p | func=%-10p",
+                func_registry[event].der_funcp, func);
+    }
+}
+
+/*
+ * Subscribes an extra function to an event, besides its main handler.
+ */
+int
+add_event_handler_ (dme_ev_t event, ev_handler_fnct_t func, char * funcname)
+{
+    dme_ev_reg_t * reg = NULL;
+
+    if (event >= DME_EV_INVALID || event < 0) {
+        dbg_err("Invalid event!");
+        return ERR_BADARGS;
+    } else if(event >= DME_INTERNAL_EV_START) {
+        dbg_err("Can not register handler for internal events!");
+        return ERR_BADARGS;
+    }
+
+    reg = &func_registry[event];
+    if (reg->der_hooks_count >= MAX_EV_HOOKS) {
+        dbg_err("Too many handlers for event %s", evtostr(event));
+        return ERR_BADARGS;
+    }
+
+    dbg_msg("ev_handler(%s) += %s()", evtostr(event), funcname);
+    reg->der_hooks[reg->der_hooks_count++] = func;
+    return 0;
+}
+
+/*
+ * Unsubscribes an extra function from an event.
+ */
+int
+remove_event_handler (dme_ev_t event, ev_handler_fnct_t func)
+{
+    dme_ev_reg_t * reg = get_registry_entry(event);
+    uint32 ix;
+
+    for (ix = 0; ix < reg->der_hooks_count; ix++) {
+        if (reg->der_hooks[ix] == func) {
+            /* keep the registration order */
+            reg->der_hooks_count--;
+            memmove(&reg->der_hooks[ix], &reg->der_hooks[ix + 1],
+                    (reg->der_hooks_count - ix) * sizeof(reg->der_hooks[0]));
+            return 0;
+        }
     }
+    return ERR_BADARGS;
 }
 
 /*
  * Delivers (queues) an event.
+ * Returns ERR_EVQ_FULL if the event queue has no room left.
  */
 int
 deliver_event (dme_ev_t event, void * cookie)
 {
     dbg_msg("++ Queuing event %s (%d), cookie@%p", evtostr(event), event, cookie);
-    /*
-     * sigqueue the stuff
-     */
-    int res = 0;
-    
-    /* create container to transport the event and cookie */
-    sig_cookie_t * psc = malloc(sizeof(sig_cookie_t));
-    psc->sc_evt    = event;
-    psc->sc_cookie = cookie;
     
-    res = sigqueue(getpid(), SIGRT_DELIVER, (sigval_t)(void *)psc);
-    
-    return res;
+    return ev_queue_push(event, cookie, DME_TIMER_NONE);
+}
+
+/*
+ * Dispatch the queued events in FIFO order (including the ones queued
+ * by the handlers while draining).
+ */
+static void ev_queue_drain(void)
+{
+    ev_cookie_t ec;
+
+    while (ev_queue_head != ev_queue_tail && !exit_request) {
+        ec = ev_queue[ev_queue_head & EV_QUEUE_MASK];
+        ev_queue_head++;
+
+        /* Skip timers cancelled or rescheduled after they expired */
+        if (ec.ec_timer != DME_TIMER_NONE &&
+            !twheel_claim(ec.ec_timer, &ec.ec_evt, &ec.ec_cookie)) {
+            continue;
+        }
+
+        handle_event(ec.ec_evt, ec.ec_cookie);
+    }
 }
 
 /*
@@ -333,82 +776,113 @@ handle_event(dme_ev_t event, void * cookie) {
 
     /* Call the function registered to the sc->sc_evt event */
     dbg_msg("Handling event %s (%d)", evtostr(event), event);
-    err = (*get_registry_funcp(event))(cookie);
+    err = dispatch_event(event, cookie);
 
     /* If there was a fata error terminate the program */
     if (err >= ERR_FATAL) {
         err_code = err;
         exit_request = TRUE;
     }
+
+    return err;
+}
+
+/*
+ * Gets the wheel expire time of a delay starting now, bringing the wheel
+ * up to date so the delay is relative to now.
+ */
+static uint64 wheel_expires_after(uint32 secs, uint32 nsecs)
+{
+    uint64 now = wheel_time_now();
+
+    twheel_expire(now, wheel_fire);
+    return now + (uint64)secs * 1000000 + (nsecs + 999) / 1000;
 }
 
 /*
  * Deliver an event after tdelta.
+ * Returns a handle for cancel_event()/reschedule_event() or DME_TIMER_NONE
+ * on error.
  */
-int
+dme_timer_t
 schedule_event (dme_ev_t event, uint32 secs, uint32 nsecs,void * cookie) {
     dbg_msg("Schedule event=%s(%d) in %u.%u with cookie@0x%p",
     		evtostr(event), event, secs, nsecs, cookie);
-    int res = 0;
-    sigevent_t timer_expire_ev = {};
-    timer_t * tp = NULL;
-    int16 tidx = -1;
-    struct itimerspec tspec = {};
-    sig_timer_cookie_t * pstc = NULL;
+    dme_timer_t timer;
     
-    if ((tidx = get_free_timer()) >= 0) {
-        /* create container to transport the timer_idx, event and cookie */
-        sig_timer_cookie_t * pstc = malloc(sizeof(sig_timer_cookie_t));
-        pstc->stc_timer_idx = tidx;
-        pstc->stc_evt    = event;
-        pstc->stc_cookie = cookie;
-        
-        timer_expire_ev.sigev_notify = SIGEV_SIGNAL;
-        timer_expire_ev.sigev_signo = SIGRT_TIMEREXP;
-        timer_expire_ev.sigev_value.sival_ptr = pstc;
-        
-        tp = &timers_pool[tidx];
-        timer_create(CLOCK_MONOTONIC, &timer_expire_ev, tp);
-        tspec.it_value.tv_sec = secs;
-        tspec.it_value.tv_nsec = nsecs;
-        timer_settime(*tp, 0, &tspec, NULL);
-        timers_state[tidx] = TIMER_ARMED;
-    } else {
-        res = 1;
-    }
+    timer = twheel_add(wheel_expires_after(secs, nsecs), event, cookie);
+    wheel_timer_update();
     
-    dbg_msg("INFO: %s", res ? "Error scheduling event" : "Event scheduled");
-    return res;
+    dbg_msg("INFO: %s", timer == DME_TIMER_NONE ?
+            "Error scheduling event" : "Event scheduled");
+    return timer;
+}
+
+/*
+ * Cancel a scheduled event. This works until the event is dispatched, even
+ * if its timer already expired.
+ * Returns ERR_TIMER if the event was already dispatched or cancelled.
+ */
+int
+cancel_event (dme_timer_t timer) {
+    dbg_msg("Cancel timer 0x%llx", timer);
+
+    if (!twheel_del(timer)) {
+        return ERR_TIMER;
+    }
+    wheel_timer_update();
+    return 0;
+}
+
+/*
+ * Deliver a scheduled event after a new tdelta (starting now) instead.
+ * The handle stays valid. Returns ERR_TIMER if the event was already
+ * dispatched or cancelled.
+ */
+int
+reschedule_event (dme_timer_t timer, uint32 secs, uint32 nsecs) {
+    dbg_msg("Reschedule timer 0x%llx in %u.%u", timer, secs, nsecs);
+
+    if (!twheel_mod(timer, wheel_expires_after(secs, nsecs))) {
+        return ERR_TIMER;
+    }
+    wheel_timer_update();
+    return 0;
 }
 
 /*
  * Wait for events (mapped on SIGRTMIN).
- * This should be used in a loop.
  */
-void wait_events(void)
+static void wait_events_signal(void)
 {	
 	siginfo_t sinfo;
 	sigset_t waitset;
 	int signo;
 	sigemptyset(&waitset);
 
-	sigprocmask(SIG_BLOCK, &waitset, NULL);
-
-    sigaddset(&waitset, SIGRT_DELIVER);
     sigaddset(&waitset, SIGRT_TIMEREXP);
     sigaddset(&waitset, SIGRT_NETWORK);
 
     /* Forced exit (^Z) */
     sigaddset(&waitset, SIGTSTP);
+
+    /* only taken by sigwaitinfo(): a ^Z in between must not stop us */
+    sigprocmask(SIG_BLOCK, &waitset, NULL);
 	
     while(!exit_request) {
+        ev_queue_drain();
+        if (exit_request) {
+            break;
+        }
+        rel_link_flush();
+        dme_send_flush();
+        trace_flush();
+
         signo = sigwaitinfo(&waitset, &sinfo);
         dbg_msg("-----------------------------------------------------------");
         dbg_msg("TICK = %-4d : signal %s (%d) occured ",
         		tick_count++, sigrttostr(signo), signo);
-        if (signo == SIGRT_DELIVER) {
-        	queued_event_handler(signo, &sinfo, NULL);
-        } else if (signo == SIGRT_NETWORK) {
+        if (signo == SIGRT_NETWORK) {
         	networkio_handler(signo, &sinfo, NULL);
         } else if (signo == SIGRT_TIMEREXP) {
         	timer_expire_handler(signo, &sinfo, NULL);
@@ -419,56 +893,248 @@ void wait_events(void)
         	/* Ignore */
         }
     };
+}
+
+/*
+ * Wait for events on the epoll set.
+ */
+static void wait_events_epoll(void)
+{
+    struct epoll_event evs[EPOLL_MAX_EVENTS];
+    struct signalfd_siginfo ssi;
+    uint64 expirations;
+    int nev;
+    int ix;
+    uint64 tag;
+
+    while(!exit_request) {
+        ev_queue_drain();
+        if (exit_request) {
+            break;
+        }
+        rel_link_flush();
+        dme_send_flush();
+        trace_flush();
+
+        nev = epoll_wait(epoll_fd, evs, EPOLL_MAX_EVENTS, -1);
+        dbg_msg("-----------------------------------------------------------");
+        dbg_msg("TICK = %-4d : %d epoll events occured ", tick_count++, nev);
+
+        for (ix = 0; ix < nev && !exit_request; ix++) {
+            tag = evs[ix].data.u64;
+            if (tag >= EPOLL_TAG_NETWORK) {
+                handle_event(DME_IEV_PACK_IN,
+                             sock_to_cookie(tag - EPOLL_TAG_NETWORK));
+            } else if (tag == EPOLL_TAG_TIMER) {
+                read(wheel_timer_fd, &expirations, sizeof(expirations));
+                wheel_timer_expired();
+            } else if (tag == EPOLL_TAG_STOP) {
+                read(stop_fd, &ssi, sizeof(ssi));
+                dbg_msg("Forced exit!");
+                exit_request = TRUE;
+            }
+        }
+    }
+}
+
+#ifdef DME_IO_URING
+/*
+ * Dispatches the datagram of a receive completion.
+ */
+static void net_demux_ring(int sock, const struct io_uring_cqe * cqe)
+{
+    buff_t buff;
+    int err = 0;
+
+    if (!dme_recv_ring_take(sock, cqe->res, cqe->flags, &buff)) {
+        return;
+    }
+
+    if (buff.len > 0 && !exit_request) {
+        err = net_dispatch(&buff);
+
+        /* If there was a fatal error terminate the program */
+        if (err >= ERR_FATAL) {
+            err_code = err;
+            exit_request = TRUE;
+        }
+    }
+    dme_buff_unref(buff);
+}
+
+/*
+ * Checks a socket is still an input, after its multishot request ended.
+ */
+static bool_t is_input_socket(int sock)
+{
+    int ix;
+
+    for (ix = 0; ix < input_socks_count; ix++) {
+        if (input_socks[ix] == sock) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static int watch_socket_uring(int sock);
+
+/*
+ * Handles a completion.
+ */
+static void uring_complete(const struct io_uring_cqe * cqe)
+{
+    struct signalfd_siginfo ssi;
+    int sock = uring_tag_val(cqe->user_data);
+
+    switch (uring_tag_kind(cqe->user_data)) {
+    case URING_KIND_RECV:
+        net_demux_ring(sock, cqe);
+        break;
+    case URING_KIND_POLL:
+        if (cqe->res > 0) {
+            handle_event(DME_IEV_PACK_IN, sock_to_cookie(sock));
+        }
+        break;
+    case URING_KIND_POLLOUT:
+        if (cqe->res > 0) {
+            handle_event(DME_IEV_PACK_IN, sock_to_cookie(sock));
+        }
+        return;
+    case URING_KIND_TIMER:
+        if (cqe->res == -ETIME && sock == wheel_timer_gen) {
+            wheel_timer_expired();
+        }
+        return;
+    case URING_KIND_STOP:
+        read(stop_fd, &ssi, sizeof(ssi));
+        dbg_msg("Forced exit!");
+        exit_request = TRUE;
+        return;
+    case URING_KIND_SEND:
+        dbg_err("Could not send a batch: %s", strerror(-cqe->res));
+        return;
+    default:
+        if (cqe->res < 0 && cqe->res != -ENOENT && cqe->res != -EALREADY) {
+            dbg_err("io_uring request failed: %s", strerror(-cqe->res));
+        }
+        return;
+    }
+
+    /* a multishot request ended (e.g. out of buffers): restart it */
+    if (!(cqe->flags & IORING_CQE_F_MORE) && cqe->res != -ECANCELED
+        && is_input_socket(sock)) {
+        if (cqe->res < 0) {
+            dbg_err("Receiving on socket %d stopped: %s", sock,
+                    strerror(-cqe->res));
+        }
+        watch_socket_uring(sock);
+    }
+}
+
+/* Is it a completion of the control socket ? */
+#define is_ctl_cqe(cqe)                                                     \
+    (nodes[proc_id].ctl_fd > 0                                              \
+     && uring_tag_val((cqe)->user_data) == nodes[proc_id].ctl_fd            \
+     && (uring_tag_kind((cqe)->user_data) == URING_KIND_RECV                \
+         || uring_tag_kind((cqe)->user_data) == URING_KIND_POLL))
+
+/*
+ * Wait for io_uring completions. The pending sends, the timer update and
+ * the wait are a single io_uring_enter() call.
+ * The completions are handled URING_REAP_LEN at a time, those of the
+ * control socket first.
+ */
+static void wait_events_uring(void)
+{
+    struct io_uring_cqe cqes[URING_REAP_LEN];
+    unsigned int count;
+    unsigned int ix;
+
+    while(!exit_request) {
+        ev_queue_drain();
+        if (exit_request) {
+            break;
+        }
+        rel_link_flush();
+        dme_send_flush();
+        trace_flush();
+        wheel_timer_submit();
+
+        uring_enter(1);
+        dbg_msg("-----------------------------------------------------------");
+        dbg_msg("TICK = %-4d : io_uring completions", tick_count++);
+
+        do {
+            for (count = 0; count < URING_REAP_LEN && uring_cqe(&cqes[count]);
+                 count++);
+
+            for (ix = 0; ix < count && !exit_request; ix++) {
+                if (is_ctl_cqe(&cqes[ix])) {
+                    uring_complete(&cqes[ix]);
+                }
+            }
+            for (ix = 0; ix < count && !exit_request; ix++) {
+                if (!is_ctl_cqe(&cqes[ix])) {
+                    uring_complete(&cqes[ix]);
+                }
+            }
+        } while (count == URING_REAP_LEN && !exit_request);
+    }
+}
+#endif /* DME_IO_URING */
+
+/*
+ * Wait for events on the selected backend.
+ * This should be used in a loop.
+ */
+void wait_events(void)
+{
+    if (ev_backend == EV_BACKEND_EPOLL) {
+        wait_events_epoll();
+#ifdef DME_IO_URING
+    } else if (ev_backend == EV_BACKEND_URING) {
+        wait_events_uring();
+#endif
+    } else {
+        wait_events_signal();
+    }
     dbg_msg("Exit requested >>>>>>>>>>>>>> EXIT stage right!");
 }
 
 /*
  * events module initialization.
  */
-static sigset_t SIGRT_DELIVER_block_set;
 static sigset_t SIGRT_TIMEREXP_block_set;
 static sigset_t SIGRT_NETWORK_block_set;
 
 /* 
  * Does initial signal handling.
  */
-int
-init_handlers (int sock)
+static int
+init_handlers_signal (int sock)
 {
     int res = 0;
     
-    /* init signal masks (block SIGRT_DELIVER but allow others) */
-    sigemptyset(&SIGRT_DELIVER_block_set);
-    sigaddset(&SIGRT_DELIVER_block_set, SIGRT_DELIVER);
+    /*
+     * init signal masks.
+     * Delivered events don't use signals, they go through the event queue.
+     */
     
     /* Sequentialize timer expirations */
     sigemptyset(&SIGRT_TIMEREXP_block_set);
-    sigaddset(&SIGRT_TIMEREXP_block_set, SIGRT_DELIVER);
     sigaddset(&SIGRT_TIMEREXP_block_set, SIGRT_TIMEREXP);
     sigaddset(&SIGRT_TIMEREXP_block_set, SIGRT_NETWORK);
 
 
     /* Sequentialize network I/O */
     sigemptyset(&SIGRT_NETWORK_block_set);
-    sigaddset(&SIGRT_NETWORK_block_set, SIGRT_DELIVER);
     sigaddset(&SIGRT_NETWORK_block_set, SIGRT_TIMEREXP);
     sigaddset(&SIGRT_NETWORK_block_set, SIGRT_NETWORK);
 
-    sigprocmask(SIG_BLOCK, &SIGRT_DELIVER_block_set, NULL);
     sigprocmask(SIG_BLOCK, &SIGRT_TIMEREXP_block_set, NULL);
     sigprocmask(SIG_BLOCK, &SIGRT_NETWORK_block_set, NULL);
 
-    /* Register the SIGRT_DELIVER handler (used for event delivery) */
-    struct sigaction deliver_ev_sa;
-    deliver_ev_sa.sa_sigaction = queued_event_handler;
-    deliver_ev_sa.sa_flags = SA_SIGINFO;
-    deliver_ev_sa.sa_mask = SIGRT_DELIVER_block_set;
-    
-    if (res = sigaction(SIGRT_DELIVER, &deliver_ev_sa, NULL) < 0) {
-        dbg_err("Cound not register handler for SIGRT_DELIVER!");
-        goto out;
-    }
-    
     /* init timers */
     /* Register the SIGRT_TIMEREXP handler (used for timer expiration) */
     struct sigaction timer_sa;
@@ -481,6 +1147,17 @@ init_handlers (int sock)
         goto out;
     }
 
+    /* The single timer that drives the timing wheel */
+    struct sigevent timer_expire_ev = {};
+    timer_expire_ev.sigev_notify = SIGEV_SIGNAL;
+    timer_expire_ev.sigev_signo = SIGRT_TIMEREXP;
+
+    if (res = timer_create(CLOCK_MONOTONIC, &timer_expire_ev, &wheel_timer) < 0) {
+        dbg_err("Could not create the wheel timer!");
+        goto out;
+    }
+    wheel_timer_created = TRUE;
+
     
     /* Register handler for Network IO */
     dbg_msg("The current socket is %d", sock);
@@ -494,6 +1171,20 @@ init_handlers (int sock)
         goto out;
     }
 
+    res = add_input_socket(sock);
+    
+out:
+    return res;
+}
+
+/*
+ * Makes a socket raise SIGRT_NETWORK when it becomes readable.
+ */
+static int
+watch_socket_signal (int sock)
+{
+    int res = 0;
+
     if (res = fcntl(sock, F_SETOWN, getpid()) < 0) {
         dbg_err("Could not set ownership of socket!");
         goto out;
@@ -509,13 +1200,399 @@ init_handlers (int sock)
         goto out;
     }
     
-    
 out:
     return res;
 }
 
+/*
+ * Sets up the epoll set: network socket, the wheel timerfd and a signalfd
+ * for the forced exit signal.
+ */
+static int
+init_handlers_epoll (int sock)
+{
+    struct epoll_event eev = {};
+    sigset_t stopset;
+    int res = 0;
+
+    if (0 > (epoll_fd = epoll_create1(EPOLL_CLOEXEC))) {
+        dbg_err("Could not create the epoll set!");
+        res = -1;
+        goto out;
+    }
+
+    /* The single timer that drives the timing wheel */
+    if (0 > (wheel_timer_fd = timerfd_create(CLOCK_MONOTONIC,
+                                             TFD_NONBLOCK | TFD_CLOEXEC))) {
+        dbg_err("Could not create the wheel timerfd!");
+        res = -1;
+        goto out;
+    }
+
+    /* Forced exit (^Z) */
+    sigemptyset(&stopset);
+    sigaddset(&stopset, SIGTSTP);
+    sigprocmask(SIG_BLOCK, &stopset, NULL);
+
+    if (0 > (stop_fd = signalfd(-1, &stopset, SFD_NONBLOCK | SFD_CLOEXEC))) {
+        dbg_err("Could not create the signalfd!");
+        res = -1;
+        goto out;
+    }
+
+    dbg_msg("The current socket is %d", sock);
+    if (res = add_input_socket(sock)) {
+        goto out;
+    }
+
+    eev.events = EPOLLIN;
+    eev.data.u64 = EPOLL_TAG_TIMER;
+    if (res = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wheel_timer_fd, &eev) < 0) {
+        dbg_err("Could not add timerfd to the epoll set!");
+        goto out;
+    }
+
+    eev.data.u64 = EPOLL_TAG_STOP;
+    if (res = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, stop_fd, &eev) < 0) {
+        dbg_err("Could not add signalfd to the epoll set!");
+        goto out;
+    }
+
+out:
+    return res;
+}
+
+/*
+ * Adds a socket to the epoll set, tagged with its fd.
+ */
+static int
+watch_socket_epoll (int sock)
+{
+    struct epoll_event eev = {};
+    int res = 0;
+
+    if (res = fcntl(sock, F_SETFL, O_NONBLOCK) < 0) {
+        dbg_err("Could not set socket in non blocking mode!");
+        return res;
+    }
+
+    eev.events = EPOLLIN;
+    eev.data.u64 = EPOLL_TAG_NETWORK + sock;
+    if (res = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &eev) < 0) {
+        dbg_err("Could not add socket to the epoll set!");
+    }
+    return res;
+}
+
+#ifdef DME_IO_URING
+/*
+ * Sets up the io_uring: the provided buffers ring, a signalfd for the forced
+ * exit signal and the network socket. The wheel timer needs no setup.
+ */
+static int
+init_handlers_uring (int sock)
+{
+    struct io_uring_sqe * sqe = NULL;
+    sigset_t stopset;
+    int res = 0;
+
+    if (!uring_init(URING_ENTRIES)) {
+        return ERR_INIT;
+    }
+    if (res = dme_recv_ring_init()) {
+        goto out;
+    }
+
+    /* Forced exit (^Z) */
+    sigemptyset(&stopset);
+    sigaddset(&stopset, SIGTSTP);
+    sigprocmask(SIG_BLOCK, &stopset, NULL);
+
+    if (0 > (stop_fd = signalfd(-1, &stopset, SFD_NONBLOCK | SFD_CLOEXEC))) {
+        dbg_err("Could not create the signalfd!");
+        res = ERR_INIT;
+        goto out;
+    }
+    if (!(sqe = uring_sqe())) {
+        res = ERR_INIT;
+        goto out;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = stop_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = uring_tag(URING_KIND_STOP, 0);
+
+    dbg_msg("The current socket is %d", sock);
+    res = add_input_socket(sock);
+
+out:
+    return res;
+}
+
+/*
+ * Starts the multishot request that receives from a socket (or tells when
+ * it is readable, for the link fds).
+ */
+static int
+watch_socket_uring (int sock)
+{
+    struct io_uring_sqe * sqe = NULL;
+    int res = 0;
+
+    if (res = fcntl(sock, F_SETFL, O_NONBLOCK) < 0) {
+        dbg_err("Could not set socket in non blocking mode!");
+        return res;
+    }
+
+    /*
+     * The UDP sockets; the links read their own fds and the listening socket
+     * needs the source addresses with connected sockets (see dme_recv_batch())
+     */
+    if (!shm_link_owns(sock) && !tcp_link_owns(sock)
+        && !(sock == nodes[proc_id].sock_fd && udp_link_active())) {
+        return dme_recv_ring_arm(sock, uring_tag(URING_KIND_RECV, sock));
+    }
+
+    if (!(sqe = uring_sqe())) {
+        return ERR_INIT;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = sock;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = uring_tag(URING_KIND_POLL, sock);
+    return 0;
+}
+#endif /* DME_IO_URING */
+
+/*
+ * Adds another socket to receive messages from, after init_handlers().
+ * Its messages are dispatched like those on the listening socket.
+ */
+int
+add_input_socket (int sock)
+{
+    int res = 0;
+
+    if (input_socks_count >= MAX_INPUT_SOCKS) {
+        dbg_err("Too many input sockets!");
+        return ERR_INIT;
+    }
+
+    if (ev_backend == EV_BACKEND_EPOLL) {
+        res = watch_socket_epoll(sock);
+#ifdef DME_IO_URING
+    } else if (ev_backend == EV_BACKEND_URING) {
+        res = watch_socket_uring(sock);
+#endif
+    } else {
+        res = watch_socket_signal(sock);
+    }
+
+    if (!res) {
+        input_socks[input_socks_count++] = sock;
+    }
+    return res;
+}
+
+/*
+ * Stops receiving from a socket added with add_input_socket(), before it
+ * is closed.
+ */
+int
+remove_input_socket (int sock)
+{
+    int ix;
+
+    for (ix = 0; ix < input_socks_count; ix++) {
+        if (input_socks[ix] == sock) {
+            break;
+        }
+    }
+    if (ix == input_socks_count) {
+        return ERR_BADARGS;
+    }
+
+    if (ev_backend == EV_BACKEND_EPOLL) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, sock, NULL);
+#ifdef DME_IO_URING
+    } else if (ev_backend == EV_BACKEND_URING) {
+        /* its requests must be gone before the fd number is reused */
+        struct io_uring_sqe * sqe = uring_sqe();
+        if (sqe) {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = sock;
+            sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+            sqe->user_data = uring_tag(URING_KIND_CANCEL, sock);
+            uring_enter(0);
+        }
+#endif
+    } else {
+        fcntl(sock, F_SETFL, O_NONBLOCK);
+    }
+
+    input_socks[ix] = input_socks[--input_socks_count];
+    return 0;
+}
+
+/*
+ * Makes an input socket also wake up the event loop when it can be written
+ * to (or its connect() completed), as an input event; until called with
+ * 'on' FALSE, or once with io_uring. Signals are raised for it anyway.
+ */
+int
+watch_output_socket (int sock, bool_t on)
+{
+    struct epoll_event eev = {};
+    int res = 0;
+
+    if (ev_backend == EV_BACKEND_EPOLL) {
+        eev.events = on ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+        eev.data.u64 = EPOLL_TAG_NETWORK + sock;
+        if (res = epoll_ctl(epoll_fd, EPOLL_CTL_MOD, sock, &eev) < 0) {
+            dbg_err("Could not change the events of socket %d!", sock);
+        }
+#ifdef DME_IO_URING
+    } else if (ev_backend == EV_BACKEND_URING && on) {
+        struct io_uring_sqe * sqe = uring_sqe();
+        if (!sqe) {
+            return ERR_INIT;
+        }
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = sock;
+        sqe->poll32_events = POLLOUT;
+        sqe->user_data = uring_tag(URING_KIND_POLLOUT, sock);
+#endif
+    }
+    return res;
+}
+
+/*
+ * Selects the event loop backend and initializes it.
+ */
+int
+init_handlers (int sock)
+{
+    const char * backend = getenv(EV_BACKEND_ENV);
+    int res = 0;
+    int shm_fd = -1;
+    int tcp_fd = -1;
+
+    if (backend && 0 == strcmp(backend, "epoll")) {
+        ev_backend = EV_BACKEND_EPOLL;
+    } else if (backend && 0 == strcmp(backend, "io_uring")) {
+#ifdef DME_IO_URING
+        ev_backend = EV_BACKEND_URING;
+#else
+        dbg_err("Built without io_uring support. Using signals.");
+#endif
+    } else if (backend && 0 != strcmp(backend, "signal")) {
+        dbg_err("Unknown event backend '%s'. Using signals.", backend);
+    }
+
+    twheel_init(wheel_time_now());
+
+#ifdef DME_IO_URING
+    if (ev_backend == EV_BACKEND_URING && (res = init_handlers_uring(sock))) {
+        dbg_err("Could not set up io_uring. Using signals.");
+        dme_recv_ring_deinit();
+        uring_deinit();
+        if (stop_fd >= 0) {
+            close(stop_fd);
+            stop_fd = -1;
+        }
+        input_socks_count = 0;
+        ev_backend = EV_BACKEND_SIGNAL;
+    }
+#endif
+
+    dbg_msg("Using the %s event backend",
+            ev_backend == EV_BACKEND_EPOLL ? "epoll" :
+            ev_backend == EV_BACKEND_URING ? "io_uring" : "signal");
+
+    if (ev_backend == EV_BACKEND_EPOLL) {
+        res = init_handlers_epoll(sock);
+    } else if (ev_backend == EV_BACKEND_SIGNAL) {
+        res = init_handlers_signal(sock);
+    }
+
+    /* The supervisor messages arrive on the control socket */
+    if (!res && nodes[proc_id].ctl_fd > 0) {
+        res = add_input_socket(nodes[proc_id].ctl_fd);
+    }
+
+    /* Broadcasts from the other sites arrive on the multicast socket */
+    if (!res && nodes[proc_id].mcast_fd > 0) {
+        res = add_input_socket(nodes[proc_id].mcast_fd);
+    }
+
+    /* Shared memory links are woken by eventfds, which signals can't watch */
+    if (!res && nodes[proc_id].shm_link) {
+        if (ev_backend == EV_BACKEND_SIGNAL) {
+            dbg_msg("Shared memory links need the epoll or io_uring backend. "
+                    "Using UDP.");
+        } else if (!(res = shm_link_init(&shm_fd))) {
+            res = add_input_socket(shm_fd);
+        }
+    }
+
+    if (!res && nodes[proc_id].tcp_link && !(res = tcp_link_init(&tcp_fd))) {
+        res = add_input_socket(tcp_fd);
+    }
+
+    if (!res) {
+        res = udp_link_init();
+    }
+    return res;
+}
+
 int
 deinit_handlers(void) {
+    /* drop undelivered events */
+    ev_queue_head = ev_queue_tail = 0;
+    input_socks_count = 0;
+    rel_link_deinit();
+    link_emu_deinit();
+    dme_send_deinit();
+    udp_link_deinit();
+    shm_link_deinit();
+    tcp_link_deinit();
+    compact_deinit();
+    trace_deinit();
+
     /* deinit timers */
+    twheel_deinit();
+    wheel_timer_armed = 0;
+
+    if (wheel_timer_created) {
+        timer_delete(wheel_timer);
+        wheel_timer_created = FALSE;
+    }
+
+    if (ev_backend == EV_BACKEND_EPOLL) {
+        if (wheel_timer_fd >= 0) {
+            close(wheel_timer_fd);
+        }
+        if (stop_fd >= 0) {
+            close(stop_fd);
+        }
+        if (epoll_fd >= 0) {
+            close(epoll_fd);
+        }
+        wheel_timer_fd = stop_fd = epoll_fd = -1;
+    }
+
+#ifdef DME_IO_URING
+    if (ev_backend == EV_BACKEND_URING) {
+        dme_recv_ring_deinit();
+        uring_deinit();
+        if (stop_fd >= 0) {
+            close(stop_fd);
+        }
+        stop_fd = -1;
+        wheel_timer_gen = 0;
+    }
+#endif
+
     return 0;
 }
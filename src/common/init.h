@@ -17,19 +17,34 @@
 
 typedef int (ev_handler_fnct_t)(void * cookie);
 
+/* Opaque handle of a scheduled event */
+typedef uint64 dme_timer_t;
+#define DME_TIMER_NONE  ((dme_timer_t)0)
+
 extern const char * evtostr(dme_ev_t event);
 extern const char * sigrttostr(unsigned int signo);
 
 extern int  init_handlers(int sock);
+extern int  add_input_socket(int sock);
+extern int  remove_input_socket(int sock);
+extern int  watch_output_socket(int sock, bool_t on);
 extern int  deinit_handlers(void);
 
 extern void register_event_handler_(dme_ev_t event, ev_handler_fnct_t func,
                                     char * funcname);
 #define register_event_handler(ev, fn) register_event_handler_(ev, fn, #fn)
 
+extern int  add_event_handler_(dme_ev_t event, ev_handler_fnct_t func,
+                               char * funcname);
+#define add_event_handler(ev, fn) add_event_handler_(ev, fn, #fn)
+extern int  remove_event_handler(dme_ev_t event, ev_handler_fnct_t func);
+
 extern int  deliver_event(dme_ev_t event, void * cookie);
 extern int  handle_event(dme_ev_t event, void * cookie);
-extern int  schedule_event (dme_ev_t event, uint32 secs, uint32 nsecs,void * cookie);
+extern dme_timer_t schedule_event (dme_ev_t event, uint32 secs, uint32 nsecs,
+                                   void * cookie);
+extern int  cancel_event (dme_timer_t timer);
+extern int  reschedule_event (dme_timer_t timer, uint32 secs, uint32 nsecs);
 
 void wait_events(void);
 
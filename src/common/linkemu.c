@@ -0,0 +1,212 @@
+/*
+ * src/common/linkemu.c
+ *
+ * Emulation of the link speeds and latencies from the config file.
+ *
+ * -------------------------------------------------------------------------
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <common/linkemu.h>
+#include <common/net.h>
+#include <common/init.h>
+#include <common/util.h>
+
+/* Global variables from main process */
+extern const link_info_t * const nodes;
+extern const size_t nodes_count;
+extern const proc_id_t proc_id;
+
+/*
+ * With LINK_EMU_ENV set, a message from a site to another site is held
+ * back as long as it would take on the link between them: the time it
+ * waits for the link, its serialization delay at the link speed and the
+ * propagation latency of the link. The supervisor's links are not emulated.
+ *
+ * Each link has a token bucket of bits, filled at the link speed, which
+ * holds at most one full packet. A message that finds enough tokens goes
+ * on the link right away, otherwise it waits until the bucket would have
+ * them; the tokens may go negative, which queues the following messages.
+ *
+ * Held messages wait in a FIFO queue per link, with a single timer for the
+ * head of the queue (DME_IEV_LINK_EMU). So they arrive in the order they
+ * were sent, as on a real link.
+ */
+
+#define LINK_EMU_OVERHEAD   (28)        /* IPv4 and UDP headers */
+#define LINK_EMU_BURST      ((int64)(MAX_PACK_LEN + LINK_EMU_OVERHEAD) * 8)
+
+typedef struct le_msg_s le_msg_t;
+struct le_msg_s {
+    le_msg_t   *lm_next;
+    uint64      lm_due;                 /* when it arrives (usec) */
+    size_t      lm_len;
+    uint8       lm_data[];
+};
+
+typedef struct le_link_s {
+    le_msg_t   *ll_head;
+    le_msg_t   *ll_tail;
+    dme_timer_t ll_timer;               /* for the head of the queue */
+    int64       ll_tokens;              /* bits */
+    uint64      ll_filled;              /* when the tokens were counted */
+    uint64      ll_last_due;            /* due time of the last message */
+} le_link_t;
+
+static le_link_t * le_links = NULL;     /* indexed by proc id */
+static int le_active = -1;              /* not decided yet */
+
+static uint64 le_time_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static inline void le_schedule(proc_id_t dest, uint64 due, uint64 now)
+{
+    uint64 delay = due > now ? due - now : 0;
+
+    le_links[dest].ll_timer = schedule_event(DME_IEV_LINK_EMU,
+                                             delay / 1000000,
+                                             (delay % 1000000) * 1000,
+                                             (void *)(long)dest);
+}
+
+bool_t link_emu_active(void)
+{
+    const char * env = NULL;
+
+    if (le_active < 0) {
+        env = getenv(LINK_EMU_ENV);
+        le_active = env && 0 != strcmp(env, "0") && proc_id != SUPERVISOR_PID;
+        dbg_msg("Link emulation is %s", le_active ? "on" : "off");
+    }
+    return le_active;
+}
+
+/*
+ * Holds back a message to dest for as long as the link would take.
+ * Returns FALSE if the link is not emulated; the caller sends it right away.
+ */
+bool_t link_emu_hold(proc_id_t dest, const uint8 * buff, size_t len)
+{
+    le_link_t * link = NULL;
+    le_msg_t * msg = NULL;
+    uint64 speed;
+    uint64 now;
+    uint64 wait = 0;
+    int64 bits = (int64)(len + LINK_EMU_OVERHEAD) * 8;
+
+    if (!link_emu_active() || dest == SUPERVISOR_PID || dest > nodes_count
+        || 0 == (speed = nodes[proc_id].link_speeds[dest - 1])) {
+        return FALSE;
+    }
+
+    if (!le_links && !(le_links = calloc(nodes_count + 1, sizeof(le_link_t)))) {
+        dbg_err("Could not allocate the emulated links");
+        return FALSE;
+    }
+    if (!(msg = malloc(sizeof(le_msg_t) + len))) {
+        dbg_err("Could not hold a message of %u bytes", len);
+        return FALSE;
+    }
+
+    link = &le_links[dest];
+    now = le_time_now();
+
+    /* refill the bucket (a full one for the first message) */
+    if (link->ll_filled == 0 || now - link->ll_filled >= 1000000) {
+        link->ll_tokens = LINK_EMU_BURST;
+    } else {
+        link->ll_tokens += (int64)((now - link->ll_filled) * speed / 1000000);
+        if (link->ll_tokens > LINK_EMU_BURST) {
+            link->ll_tokens = LINK_EMU_BURST;
+        }
+    }
+    link->ll_filled = now;
+
+    if (link->ll_tokens < bits) {
+        wait = (uint64)(bits - link->ll_tokens) * 1000000 / speed;
+    }
+    link->ll_tokens -= bits;
+
+    msg->lm_next = NULL;
+    msg->lm_len = len;
+    msg->lm_due = now + wait + get_msg_delay_usec(speed, len + LINK_EMU_OVERHEAD)
+                  + nodes[proc_id].link_latency[dest - 1];
+    memcpy(msg->lm_data, buff, len);
+
+    /* never overtake the message before */
+    if (msg->lm_due < link->ll_last_due) {
+        msg->lm_due = link->ll_last_due;
+    }
+    link->ll_last_due = msg->lm_due;
+
+    if (link->ll_tail) {
+        link->ll_tail->lm_next = msg;
+    } else {
+        link->ll_head = msg;
+        le_schedule(dest, msg->lm_due, now);
+    }
+    link->ll_tail = msg;
+
+    return TRUE;
+}
+
+/*
+ * DME_IEV_LINK_EMU handler: sends the messages of a link that are due.
+ */
+int link_emu_release(void * cookie)
+{
+    proc_id_t dest = (proc_id_t)(long)cookie;
+    le_link_t * link = NULL;
+    le_msg_t * msg = NULL;
+    uint64 now = le_time_now();
+    int err = 0;
+
+    if (!le_links || dest == SUPERVISOR_PID || dest > nodes_count) {
+        return 0;
+    }
+
+    link = &le_links[dest];
+    link->ll_timer = DME_TIMER_NONE;
+
+    while ((msg = link->ll_head) && msg->lm_due <= now) {
+        if (!(link->ll_head = msg->lm_next)) {
+            link->ll_tail = NULL;
+        }
+        err = dme_send_direct(dest, msg->lm_data, msg->lm_len);
+        free(msg);
+    }
+
+    if (link->ll_head) {
+        le_schedule(dest, link->ll_head->lm_due, now);
+    }
+    return err;
+}
+
+/*
+ * Drops the messages still held.
+ */
+void link_emu_deinit(void)
+{
+    le_msg_t * msg = NULL;
+    size_t ix;
+
+    if (!le_links) {
+        return;
+    }
+
+    for (ix = 0; ix <= nodes_count; ix++) {
+        while ((msg = le_links[ix].ll_head)) {
+            le_links[ix].ll_head = msg->lm_next;
+            free(msg);
+        }
+    }
+    safe_free(le_links);
+}
@@ -0,0 +1,22 @@
+/*
+ * src/common/linkemu.h
+ *
+ * Emulation of the link speeds and latencies from the config file.
+ *
+ * -------------------------------------------------------------------------
+ */
+
+#ifndef LINKEMU_H_
+#define LINKEMU_H_
+
+#include <common/defs.h>
+
+/* Set (to anything but "0") to delay the messages between sites */
+#define LINK_EMU_ENV    "DME_LINK_EMU"
+
+extern bool_t link_emu_active(void);
+extern bool_t link_emu_hold(proc_id_t dest, const uint8 * buff, size_t len);
+extern int    link_emu_release(void * cookie);
+extern void   link_emu_deinit(void);
+
+#endif /* LINKEMU_H_ */
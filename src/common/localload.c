@@ -0,0 +1,104 @@
+/*
+ * src/common/localload.c
+ *
+ * Closed loop workload generated by each site on its own.
+ *
+ * -------------------------------------------------------------------------
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <common/localload.h>
+#include <common/dist.h>
+#include <common/init.h>
+
+/* Global variables from main process */
+extern const proc_id_t proc_id;
+
+/*
+ * With LOCAL_THINK_ENV set the sites do not wait for the supervisor to
+ * send them requests: once synchronized each one thinks, requests the CS,
+ * stays in it, exits and thinks again, like the clients of a lock service.
+ * The think time is over with a DME_EV_LOCAL_REQUEST event; the algorithms
+ * handle it as a request from the supervisor, for a CS time drawn from
+ * LOCAL_CS_ENV (none by default). The supervisor only collects the ENTERED
+ * and EXITED messages.
+ * The variables are meant for the whole cluster, supervisor included (as
+ * dme-launch passes them on).
+ */
+
+static dist_t think_time;
+static dist_t cs_time = { DIST_FIXED, 0 };
+static int local_active = -1;           /* not decided yet */
+static bool_t local_started = FALSE;
+
+/*
+ * Parses a distribution from the environment; bad values end the program,
+ * as bad command line arguments do.
+ */
+static bool_t local_load_env(const char * name, dist_t * out_dist)
+{
+    const char * env = getenv(name);
+
+    if (!env || !*env) {
+        return FALSE;
+    }
+    if (dist_parse(env, out_dist)) {
+        fprintf(stderr, "Bad %s '%s': [fixed|exp|uniform:]<duration>\n",
+                name, env);
+        exit(ERR_BADARGS);
+    }
+    return TRUE;
+}
+
+bool_t local_load_active(void)
+{
+    if (local_active < 0) {
+        local_active = local_load_env(LOCAL_THINK_ENV, &think_time);
+        local_load_env(LOCAL_CS_ENV, &cs_time);
+        dbg_msg("Site local requests are %s", local_active ? "on" : "off");
+    }
+    return local_active;
+}
+
+/*
+ * Starts the loop, once (SYNCRO may come again).
+ */
+void local_load_start(void)
+{
+    timespec_t tnow;
+
+    if (!local_load_active() || local_started) {
+        return;
+    }
+    local_started = TRUE;
+
+    /* the sites must not think alike */
+    clock_gettime(CLOCK_REALTIME, &tnow);
+    srandom(tnow.tv_nsec ^ (proc_id << 16));
+
+    local_load_think();
+}
+
+/*
+ * Requests the CS again after a think time.
+ */
+void local_load_think(void)
+{
+    timespec_t ts;
+
+    if (!local_started) {
+        return;
+    }
+    ts = dist_sample(&think_time);
+    if (DME_TIMER_NONE == schedule_event(DME_EV_LOCAL_REQUEST,
+                                         ts.tv_sec, ts.tv_nsec, NULL)) {
+        dbg_err("Could not schedule the next request");
+    }
+}
+
+timespec_t local_load_cs_time(void)
+{
+    return dist_sample(&cs_time);
+}
@@ -0,0 +1,26 @@
+/*
+ * src/common/localload.h
+ *
+ * Closed loop workload generated by each site on its own.
+ *
+ * -------------------------------------------------------------------------
+ */
+
+#ifndef LOCALLOAD_H_
+#define LOCALLOAD_H_
+
+#include <common/defs.h>
+#include <common/util.h>
+
+/* Distributions (see dist_parse()) of the time between two requests of a
+ * site and of the time it stays in the CS. Setting the first one starts the
+ * closed loop. */
+#define LOCAL_THINK_ENV "DME_THINK_TIME"
+#define LOCAL_CS_ENV    "DME_CS_TIME"
+
+extern bool_t     local_load_active(void);
+extern void       local_load_start(void);
+extern void       local_load_think(void);
+extern timespec_t local_load_cs_time(void);
+
+#endif /* LOCALLOAD_H_ */
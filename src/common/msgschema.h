@@ -0,0 +1,86 @@
+/*
+ * src/common/msgschema.h
+ *
+ * Declarative layouts for the algorithm messages.
+ *
+ * -------------------------------------------------------------------------
+ */
+
+#ifndef MSGSCHEMA_H_
+#define MSGSCHEMA_H_
+
+#include <common/defs.h>
+#include <common/net.h>
+
+/*
+ * An algorithm lists the fields of its message once, as an X-macro that
+ * applies F(type, name, word) to each of them in order:
+ *
+ *   #define LAMPORT_MSG_FIELDS(F)           \
+ *       F(uint32,    type,   uint32)       \
+ *       F(proc_id_t, pid,    uint64)
+ *
+ * 'word' is the type the field is byte swapped as: a scalar is its own
+ * word, an array or a structure (e.g. F(struct token_s, token, uint32))
+ * is a run of words, and uint8 means no swapping.
+ *
+ *   DME_MSG_SCHEMA(lamport, MSGT_LAMPORT, LAMPORT_MSG_FIELDS)
+ *
+ * then declares the packed lamport_message_t (the DME header followed by
+ * the fields) and:
+ *
+ *   int lamport_msg_encode(lamport_message_t * msg)
+ *      sets the header and turns the fields, filled in host order, to
+ *      network order in place;
+ *   int lamport_msg_decode(buff_t buff, lamport_message_t * msg)
+ *      checks the length and type of a received message and copies it in
+ *      host order.
+ *
+ * The fields follow each other without padding, so the codecs swap each
+ * one as a whole run of words (nothing at all on big endian hosts).
+ */
+
+typedef struct dme_msg_field_s {
+    uint16      mf_size;                /* bytes */
+    uint16      mf_word;                /* bytes swapped as a unit */
+} dme_msg_field_t;
+
+#define DME_MSG_FIELD_DECL(type, name, word)    type name;
+/* a field that is not a whole number of words does not compile */
+#define DME_MSG_FIELD_DESC(type, name, word)                                \
+    { sizeof(type) + 0 * sizeof(char[sizeof(type) % sizeof(word) ? -1 : 1]), \
+      sizeof(word) },
+
+#define DME_MSG_SCHEMA(alg, msgt, FIELDS)                                   \
+    struct alg##_message_s {                                                \
+        dme_message_hdr_t lm_hdr;                                           \
+        FIELDS(DME_MSG_FIELD_DECL)                                          \
+    } PACKED;                                                               \
+    typedef struct alg##_message_s alg##_message_t;                         \
+                                                                            \
+    static const dme_msg_field_t alg##_msg_fields[] = {                     \
+        FIELDS(DME_MSG_FIELD_DESC)                                          \
+    };                                                                      \
+                                                                            \
+    static inline int alg##_msg_encode(alg##_message_t * const msg)         \
+    {                                                                       \
+        return dme_msg_encode(&msg->lm_hdr, msgt, sizeof(*msg),             \
+                              alg##_msg_fields,                             \
+                              sizeof(alg##_msg_fields) / sizeof(dme_msg_field_t)); \
+    }                                                                       \
+                                                                            \
+    static inline int alg##_msg_decode(buff_t buff, alg##_message_t * const msg) \
+    {                                                                       \
+        return dme_msg_decode(buff, &msg->lm_hdr, msgt, sizeof(*msg),       \
+                              alg##_msg_fields,                             \
+                              sizeof(alg##_msg_fields) / sizeof(dme_msg_field_t)); \
+    }
+
+extern int dme_msg_encode(dme_message_hdr_t * const hdr, unsigned int msgtype,
+                          size_t msglen, const dme_msg_field_t * fields,
+                          size_t count);
+extern int dme_msg_decode(buff_t buff, dme_message_hdr_t * const hdr,
+                          unsigned int msgtype, size_t msglen,
+                          const dme_msg_field_t * fields, size_t count);
+
+#endif /* MSGSCHEMA_H_ */
@@ -8,83 +8,388 @@
  * -------------------------------------------------------------------------
  */
 
+#define _GNU_SOURCE
 
 #include <stdio.h>
 #include <unistd.h>
 #include <time.h>
 #include <string.h>
+#include <errno.h>
 
 #include <sys/socket.h>
+#include <arpa/inet.h>
 #include <common/net.h>
 #include <common/init.h>
+#include <common/shmlink.h>
+#include <common/tcplink.h>
+#include <common/linkemu.h>
+#include <common/reliable.h>
+#include <common/compact.h>
+#include <common/uring.h>
+#include <common/udplink.h>
+#include <common/trace.h>
 
 /* Global variables from main process */
 extern const link_info_t * const nodes;
 extern const size_t nodes_count;
 extern const proc_id_t proc_id;
 
-#define MSC_SEP '|'
+/*
+ * Outbound batching.
+ * Messages to UDP peers are not sent right away: each destination has a
+ * batch that collects them until the event loop calls dme_send_flush()
+ * before it waits. A batch holding several messages goes out as a single
+ * datagram (see dme_batch_hdr_t), one holding a single message as the
+ * plain message. All the batches go out with one sendmmsg() call, or one
+ * per socket with connected UDP sockets (see udplink.c).
+ *
+ * Messages queued for TCP are also written on flush, while those for
+ * shared memory and the multicast group are sent right away. Switching
+ * between these flushes what is queued first, so messages leave in the
+ * order they were sent and a peer never hears of a message's effects
+ * before its destination gets it.
+ */
+typedef struct tx_batch_s {
+    int         tb_fd;                  /* the socket to send on */
+    struct sockaddr_in *tb_addr;        /* NULL if tb_fd is connected */
+    uint16      tb_count;               /* messages in the batch */
+    uint16      tb_len;                 /* bytes used, batch header included */
+    uint8       tb_data[MAX_PACK_LEN];
+} tx_batch_t;
+
+typedef enum tx_path_e {
+    TX_NONE = 0,                        /* nothing queued */
+    TX_UDP,
+    TX_TCP,
+    TX_NOW,                             /* sent right away */
+} tx_path_t;
+
+static tx_batch_t * tx_batches = NULL;  /* indexed by proc id */
+static struct mmsghdr * send_msgs = NULL;
+static struct iovec * send_iovs = NULL;
+static int * send_fds = NULL;
+static tx_path_t tx_queued = TX_NONE;
+
+/* Message and datagram counters, to see what batching saves */
+static uint64 tx_msgs_count = 0;
+static uint64 tx_packs_count = 0;
+
+#define both_marked(link, dest) (nodes[proc_id].link && nodes[dest].link)
+
+/* Messages between the supervisor and a site with a control socket */
+#define ctl_link(dest)  (nodes[dest].ctl_addr.sin_family == AF_INET        \
+                         && ((dest) == SUPERVISOR_PID || proc_id == SUPERVISOR_PID))
+
+#ifdef DME_IO_URING
+/*
+ * With the io_uring backend the datagrams are sent by SENDMSG requests,
+ * submitted by the event loop together with its wait (or right away when
+ * 'now'). MSG_DONTWAIT makes the kernel send them while they are
+ * submitted, or fail, instead of retrying later, so the batches can be
+ * reused as soon as they are submitted. Only failures complete.
+ */
+static int dme_batch_submit(size_t count, bool_t now)
+{
+    struct io_uring_sqe * sqe = NULL;
+    size_t ix;
+
+    for (ix = 0; ix < count; ix++) {
+        if (!(sqe = uring_sqe())) {
+            return ERR_SEND_MSG;
+        }
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = send_fds[ix];
+        sqe->addr = (unsigned long)&send_msgs[ix].msg_hdr;
+        sqe->len = 1;
+        sqe->msg_flags = MSG_DONTWAIT;
+        sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+        sqe->user_data = uring_tag(URING_KIND_SEND, ix);
+    }
+    if (now) {
+        return uring_enter(0);
+    }
+    return 0;
+}
+#endif
+
+/*
+ * Sends the batches. Unless 'now' the io_uring backend leaves them to be
+ * submitted by the event loop.
+ */
+static int dme_batch_flush(bool_t now)
+{
+    tx_batch_t * batch = NULL;
+    dme_batch_hdr_t * hdr = NULL;
+    size_t count = 0;
+    size_t sent = 0;
+    size_t run = 0;
+    proc_id_t ix;
+    int ret;
+    int err = 0;
+
+    for (ix = 0; ix <= nodes_count; ix++) {
+        batch = &tx_batches[ix];
+        if (batch->tb_count == 0) {
+            continue;
+        }
 
-static int msc_msg(proc_id_t srcid, proc_id_t dstid, char * const msctext) {
-    struct timespec ts;
-    const char * px = NULL;
-    const char * sx = msctext;
-    char linebuf[MAX_MSC_TEXT];
-    int linesize;
-    int linecnt = 0;
+        if (batch->tb_count == 1) {
+            /* no need for the batch header */
+            send_iovs[count].iov_base = batch->tb_data + DME_BATCH_HEADER_LEN
+                                        + DME_BATCH_ITEM_LEN;
+            send_iovs[count].iov_len = batch->tb_len - DME_BATCH_HEADER_LEN
+                                       - DME_BATCH_ITEM_LEN;
+        } else {
+            hdr = (dme_batch_hdr_t *)batch->tb_data;
+            hdr->batch_magic = htonl(DME_BATCH_MAGIC);
+            hdr->count = htons(batch->tb_count);
+            hdr->reserved = 0;
+            send_iovs[count].iov_base = batch->tb_data;
+            send_iovs[count].iov_len = batch->tb_len;
+        }
 
-    clock_gettime(CLOCK_REALTIME, &ts);
+        bzero(&send_msgs[count], sizeof(send_msgs[count]));
+        if (batch->tb_addr) {
+            send_msgs[count].msg_hdr.msg_name = batch->tb_addr;
+            send_msgs[count].msg_hdr.msg_namelen = sizeof(*batch->tb_addr);
+        }
+        send_msgs[count].msg_hdr.msg_iov = &send_iovs[count];
+        send_msgs[count].msg_hdr.msg_iovlen = 1;
+        send_fds[count] = batch->tb_fd;
+        count++;
 
-    bzero(linebuf, sizeof(linebuf));
-    px = strchr(sx, MSC_SEP);
+        batch->tb_count = 0;
+        batch->tb_len = DME_BATCH_HEADER_LEN;
+    }
 
-    if (px == NULL) {
-        /* Print to the end of the string */
-        snprintf(linebuf, sizeof(linebuf), "%s", sx);
-    } else {
-        /* Print to next line */
-        snprintf(linebuf, px - sx,  "%s", sx);
+#ifdef DME_IO_URING
+    if (uring_active()) {
+        tx_packs_count += count;
+        return dme_batch_submit(count, now);
+    }
+#endif
+
+    /*
+     * One sendmmsg() per run of datagrams on the same socket. It may stop
+     * early, send the rest. A connected socket reports an earlier ICMP error
+     * instead of sending, once. Any other error is that of the first
+     * datagram: it is lost, the others still go.
+     */
+    while (sent < count) {
+        for (run = sent + 1; run < count && send_fds[run] == send_fds[sent]; run++);
+
+        ret = sendmmsg(send_fds[sent], &send_msgs[sent], run - sent, 0);
+        if (ret < 0) {
+            if (errno == EINTR || errno == ECONNREFUSED) {
+                continue;
+            }
+            dbg_err("sendmmsg() failed: %s", strerror(errno));
+            err = ERR_SEND_MSG;
+            ret = 1;
+        }
+        sent += ret;
     }
+    tx_packs_count += count;
 
-    fprintf(stdout, "%09u.%09u %02d # p%llu->p%llu: %s\n",
-            (uint32)ts.tv_sec, (uint32)ts.tv_nsec, linecnt,
-            srcid, dstid, linebuf);
-    linecnt++;
+    return err;
+}
 
-    /* Print other MSC commands */
-    while (px != NULL) {
-        bzero(linebuf, sizeof(linebuf));
-        sx = ++px;
-        px = strchr(sx, MSC_SEP);
+static int dme_send_queued(bool_t now)
+{
+    int err = 0;
 
-        if (0 == strncmp(sx, "activate_src", 14)) {
-            fprintf(stdout, "%09u.%09u %02d # activate p%llu\n",
-                    (uint32)ts.tv_sec, (uint32)ts.tv_nsec, linecnt,
-                    srcid);
-        }
-        else if (0 == strncmp(sx, "activate_dst", 14)) {
-            fprintf(stdout, "%09u.%09u %02d # activate p%llu\n",
-                    (uint32)ts.tv_sec, (uint32)ts.tv_nsec, linecnt,
-                    dstid);
-        }
-        else if (0 == strncmp(sx, "deactivate_src", 16)) {
-            fprintf(stdout, "%09u.%09u %02d # deactivate p%llu\n",
-                    (uint32)ts.tv_sec, (uint32)ts.tv_nsec, linecnt,
-                    srcid);
+    if (tx_queued == TX_UDP) {
+        err = dme_batch_flush(now);
+    }
+    tcp_link_flush();
+    tx_queued = TX_NONE;
+    return err;
+}
+
+/*
+ * Sends all the queued messages. Called by the event loop before it waits.
+ */
+int dme_send_flush(void)
+{
+    return dme_send_queued(FALSE);
+}
+
+/*
+ * Flushes the queued messages if they wait on another path than the next.
+ */
+static inline void dme_send_order(tx_path_t path)
+{
+    if (tx_queued != TX_NONE && tx_queued != path) {
+        dme_send_queued(TRUE);
+    }
+    tx_queued = (path == TX_NOW) ? TX_NONE : path;
+}
+
+/*
+ * Allocates the batches, one per destination, with the socket and address
+ * each one is sent with.
+ */
+static int dme_batch_init(void)
+{
+    proc_id_t ix;
+
+    tx_batches = calloc(nodes_count + 1, sizeof(tx_batch_t));
+    send_msgs = calloc(nodes_count + 1, sizeof(*send_msgs));
+    send_iovs = calloc(nodes_count + 1, sizeof(*send_iovs));
+    send_fds = calloc(nodes_count + 1, sizeof(*send_fds));
+    if (!tx_batches || !send_msgs || !send_iovs || !send_fds) {
+        dbg_err("Could not allocate the outbound batches");
+        safe_free(tx_batches);
+        safe_free(send_msgs);
+        safe_free(send_iovs);
+        safe_free(send_fds);
+        return ERR_MALLOC;
+    }
+
+    for (ix = 0; ix <= nodes_count; ix++) {
+        tx_batches[ix].tb_len = DME_BATCH_HEADER_LEN;
+        tx_batches[ix].tb_fd = udp_link_fd(ix);
+        if (tx_batches[ix].tb_fd == nodes[proc_id].sock_fd) {
+            tx_batches[ix].tb_addr = (struct sockaddr_in *)&nodes[ix].listen_addr;
         }
-        else if (0 == strncmp(sx, "deactivate_src", 16)) {
-            fprintf(stdout, "%09u.%09u %02d # deactivate p%llu\n",
-                    (uint32)ts.tv_sec, (uint32)ts.tv_nsec, linecnt,
-                    dstid);
+    }
+    return 0;
+}
+
+static int dme_batch_add(proc_id_t dest, const uint8 * buff, size_t len)
+{
+    tx_batch_t * batch = NULL;
+    uint16 item_len = htons(len);
+    int err = 0;
+
+    if (!tx_batches && (err = dme_batch_init())) {
+        return err;
+    }
+    batch = &tx_batches[dest];
+
+    tx_msgs_count++;
+    if (len > MAX_PACK_LEN - DME_BATCH_HEADER_LEN - DME_BATCH_ITEM_LEN) {
+        /* does not fit in a batch, send it alone after the queued ones */
+        err = dme_send_queued(TRUE);
+        tx_packs_count++;
+        /* as in dme_batch_flush(), an earlier ICMP error is reported once */
+        while (0 > sendto(batch->tb_fd, buff, len, 0,
+                          (struct sockaddr *)batch->tb_addr,
+                          batch->tb_addr ? sizeof(*batch->tb_addr) : 0)) {
+            if (errno != EINTR && errno != ECONNREFUSED) {
+                dbg_err("sendto() failed: %s", strerror(errno));
+                return ERR_SEND_MSG;
+            }
         }
+        return err;
+    }
+
+    /* a datagram the flush lost is reported, this message still goes */
+    if (batch->tb_len + DME_BATCH_ITEM_LEN + len > MAX_PACK_LEN) {
+        err = dme_batch_flush(TRUE);
+    }
+
+    memcpy(batch->tb_data + batch->tb_len, &item_len, DME_BATCH_ITEM_LEN);
+    memcpy(batch->tb_data + batch->tb_len + DME_BATCH_ITEM_LEN, buff, len);
+    batch->tb_len += DME_BATCH_ITEM_LEN + len;
+    batch->tb_count++;
+    tx_queued = TX_UDP;
+    return err;
+}
+
+/*
+ * Sends a message to dest over UDP right away, as a datagram of its own.
+ */
+int dme_send_udp(proc_id_t dest, const uint8 * buff, size_t len)
+{
+    const struct sockaddr_in * addr = NULL;
+    int fd = udp_link_fd(dest);
 
-        linecnt++;
+    if (fd == nodes[proc_id].sock_fd) {
+        addr = (const struct sockaddr_in *)&nodes[dest].listen_addr;
     }
 
-    fflush(stdout);
+    tx_msgs_count++;
+    tx_packs_count++;
+    if (0 > sendto(fd, buff, len, 0, (const struct sockaddr *)addr,
+                   addr ? sizeof(*addr) : 0)) {
+        dbg_err("Send to %llu failed: %s", dest, strerror(errno));
+        return ERR_SEND_MSG;
+    }
     return 0;
 }
 
+/*
+ * Sends a message to the control socket of dest right away. The control
+ * messages keep their own order, they don't wait for the queued ones.
+ */
+static int dme_send_ctl(proc_id_t dest, const uint8 * buff, size_t len)
+{
+    tx_msgs_count++;
+    tx_packs_count++;
+    if (0 > sendto(nodes[proc_id].sock_fd, buff, len, 0,
+                   (const struct sockaddr *)&nodes[dest].ctl_addr,
+                   sizeof(nodes[dest].ctl_addr))) {
+        dbg_err("Control send failed: %s", strerror(errno));
+        return ERR_SEND_MSG;
+    }
+    return 0;
+}
+
+/*
+ * Sends a message to dest on the path of its link, without link emulation.
+ */
+int dme_send_direct(proc_id_t dest, const uint8 * buff, size_t len)
+{
+    if (ctl_link(dest)) {
+        return dme_send_ctl(dest, buff, len);
+    }
+    if (both_marked(tcp_link, dest)) {
+        dme_send_order(TX_TCP);
+        if (tcp_link_send(dest, buff, len)) {
+            return 0;
+        }
+    }
+    if (both_marked(shm_link, dest)) {
+        dme_send_order(TX_NOW);
+        if (shm_link_send(dest, buff, len)) {
+            return 0;
+        }
+    }
+
+    dme_send_order(TX_UDP);
+    return dme_batch_add(dest, buff, len);
+}
+
+/*
+ * Sends a message to dest through the link emulation, if it is on.
+ */
+int dme_send_link(proc_id_t dest, const uint8 * buff, size_t len)
+{
+    if (link_emu_hold(dest, buff, len)) {
+        return 0;
+    }
+    return dme_send_direct(dest, buff, len);
+}
+
+/*
+ * Sends a message to dest, in the compact format if dest reads it.
+ */
+static int dme_send_one(proc_id_t dest, uint8 * buff, size_t len)
+{
+    uint8 wire[COMPACT_BUFF_LEN(MAX_PACK_LEN)];
+    size_t wire_len = 0;
+
+    if (len <= MAX_PACK_LEN
+        && (wire_len = compact_encode(dest, buff, len, wire))) {
+        buff = wire;
+        len = wire_len;
+    }
+    if (rel_link_send(dest, buff, len)) {
+        return 0;
+    }
+    return dme_send_link(dest, buff, len);
+}
 
 /*
  * Send the buffer to node with process_id dest.
@@ -93,7 +398,6 @@ int dme_send_msg(proc_id_t dest, uint8 * buff, size_t len, char * const msctext)
 {
     dbg_msg("send_msg(dest=%llu, buff@%p, len=%u)", dest, buff, len);
     int maxcount = nodes_count;
-    struct sockaddr * dest_addr = NULL;
     
     if (dest < 0 || dest > maxcount) {
         dbg_err("Destination process id is out of bounds: %llu not in [0..%d]",
@@ -101,65 +405,425 @@ int dme_send_msg(proc_id_t dest, uint8 * buff, size_t len, char * const msctext)
         return ERR_SEND_MSG;
     }
     
-    dest_addr = (struct sockaddr *)&nodes[dest].listen_addr;
-    
-    msc_msg(proc_id, dest, msctext);
-    sendto(nodes[proc_id].sock_fd, buff, len, 0, dest_addr, sizeof(*dest_addr));
-    return 0;
+    trace_msg(proc_id, &dest, 1, msctext);
+    return dme_send_one(dest, buff, len);
+}
+
+/*
+ * Send the same buffer to several nodes. The UDP ones get it with the
+ * next flush, all with a single sendmmsg() call.
+ */
+int dme_send_msg_set(const proc_id_t * dests, size_t count,
+                     uint8 * buff, size_t len, char * const msctext)
+{
+    dbg_msg("send_msg_set(count=%u, buff@%p, len=%u)", count, buff, len);
+    size_t ix;
+    int err = 0;
+
+    for (ix = 0; ix < count; ix++) {
+        if (dests[ix] > nodes_count) {
+            dbg_err("Destination process id is out of bounds: %llu not in [0..%d]",
+                    dests[ix], nodes_count);
+            return ERR_SEND_MSG;
+        }
+    }
+
+    trace_msg(proc_id, dests, count, msctext);
+    for (ix = 0; ix < count && !err; ix++) {
+        err = dme_send_one(dests[ix], buff, len);
+    }
+    return err;
+}
+
+/*
+ * Releases the outbound batches, sending what they hold.
+ */
+void dme_send_deinit(void)
+{
+    dme_send_queued(TRUE);
+    dbg_msg("Sent %llu UDP messages in %llu datagrams",
+            tx_msgs_count, tx_packs_count);
+
+    safe_free(tx_batches);
+    safe_free(send_msgs);
+    safe_free(send_iovs);
+    safe_free(send_fds);
 }
 
 /*
  * Send a message to all the other nodes (except self):
  * {1, .., nodes_count} \ { proc_id }
+ * If the cluster has a multicast group this is a single send to the group.
  */
 int dme_broadcast_msg (uint8 * buff, size_t len, char * const msctext) {
+    proc_id_t dests[nodes_count];
+    size_t count = 0;
     int ix = 0;
-    int ret = 0;
+    const struct sockaddr_in * group = &nodes[proc_id].mcast_addr;
+    bool_t ctl = FALSE;
     
-    for (ix = 1; ix < proc_id && !ret; ix++) {
-        ret |= dme_send_msg(ix, buff, len, msctext);
+    for (ix = 1; ix <= nodes_count; ix++) {
+        if (ix != proc_id) {
+            dests[count++] = ix;
+            ctl = ctl || ctl_link(ix);
+        }
     }
-    for (ix = proc_id + 1; ix <= nodes_count && !ret; ix++) {
-        ret |= dme_send_msg(ix, buff, len, msctext);
+
+    /* emulated links, reliable delivery and control sockets are per site */
+    if (group->sin_family != AF_INET || link_emu_active() || rel_link_active()
+        || ctl) {
+        return dme_send_msg_set(dests, count, buff, len, msctext);
     }
-    
-    return ret;
+
+    trace_msg(proc_id, dests, count, msctext);
+    compact_announce(buff, len);
+    dme_send_order(TX_NOW);
+    if (0 > sendto(nodes[proc_id].sock_fd, buff, len, 0,
+                   (const struct sockaddr *)group, sizeof(*group))) {
+        dbg_err("Multicast send failed: %s", strerror(errno));
+        return ERR_SEND_MSG;
+    }
+    return 0;
 }
 
 
-/* 
- * Recieve a message and return an allocated buffer and length.
- * The buffer MUST BE DEALLOCATED in the calling function!
+/*
+ * Receive buffer pool.
+ * Packets are received straight into MAX_PACK_LEN slots of a pool and
+ * handed to the handlers as buff_t views, without copying. Each slot has a
+ * reference count: the receive path holds one reference while the handlers
+ * run, and a handler that needs the data later takes its own with
+ * dme_buff_ref() and drops it with dme_buff_unref().
+ * The pool grows by RX_CHUNK_LEN slots when empty, so there is no fixed limit.
+ * Stream transports may carry longer messages; their buffers are allocated
+ * one by one, with the same header, and freed when released.
  */
 
-#define MAX_PACK_LEN    (1024) /* To avoid fragmentation -> UDP fails */
-static uint8 test_buff[MAX_PACK_LEN];
+#define RX_CHUNK_LEN    (RECV_BATCH_LEN)
+
+typedef struct rx_slot_s rx_slot_t;
+struct rx_slot_s {
+    rx_slot_t  *rx_next;                /* free list link */
+    uint32      rx_refs;
+    uint32      rx_size;                /* MAX_PACK_LEN for pool slots */
+    uint8       rx_data[];
+};
+
+#define RX_SLOT_SIZE    (sizeof(rx_slot_t) + MAX_PACK_LEN)
 
-int dme_recv_msg(uint8 ** out_buff, size_t * out_len)
+#define rx_slot_of(data) \
+    ((rx_slot_t *)((uint8 *)(data) - offsetof(rx_slot_t, rx_data)))
+
+static rx_slot_t * rx_free = NULL;
+
+/*
+ * Get a slot from the pool with one reference held.
+ */
+static rx_slot_t * rx_slot_alloc(void)
 {
-    int len = 0;
-    *out_len = 0; /* initialize to 0 just to avoid reading an empty buffer */
-    
-    /* Determine the length of the packet first */
-    len = recv(nodes[proc_id].sock_fd, test_buff, MAX_PACK_LEN, MSG_PEEK);
-    
-    if (len <= 0 || !(*out_buff = malloc(len))) {
-        dbg_err("Could not allocate buffer of length %d", len);
+    rx_slot_t * chunk = NULL;
+    rx_slot_t * slot = NULL;
+    int ix;
+
+    if (!rx_free) {
+        if (!(chunk = calloc(RX_CHUNK_LEN, RX_SLOT_SIZE))) {
+            return NULL;
+        }
+        for (ix = RX_CHUNK_LEN - 1; ix >= 0; ix--) {
+            slot = (rx_slot_t *)((uint8 *)chunk + ix * RX_SLOT_SIZE);
+            slot->rx_size = MAX_PACK_LEN;
+            slot->rx_next = rx_free;
+            rx_free = slot;
+        }
+    }
+
+    slot = rx_free;
+    rx_free = slot->rx_next;
+    slot->rx_next = NULL;
+    slot->rx_refs = 1;
+    return slot;
+}
+
+/*
+ * Get an empty buffer of len bytes, for transports that don't receive into
+ * the pool directly. The caller holds one reference.
+ */
+bool_t dme_buff_alloc(buff_t * out_buff, size_t len)
+{
+    rx_slot_t * slot = NULL;
+
+    if (len <= MAX_PACK_LEN) {
+        slot = rx_slot_alloc();
+    } else if ((slot = malloc(sizeof(rx_slot_t) + len))) {
+        slot->rx_next = NULL;
+        slot->rx_refs = 1;
+        slot->rx_size = len;
+    }
+
+    if (!slot) {
+        dbg_err("Could not allocate a receive buffer of %u bytes", len);
+        return FALSE;
+    }
+    out_buff->data = slot->rx_data;
+    out_buff->len = len;
+    return TRUE;
+}
+
+/*
+ * Take a reference to a received buffer, keeping it valid after the handler
+ * returns. Only buffers handed out by the receive path may be referenced.
+ */
+buff_t dme_buff_ref(buff_t buff)
+{
+    if (buff.data) {
+        rx_slot_of(buff.data)->rx_refs++;
+    }
+    return buff;
+}
+
+/*
+ * Drop a reference to a received buffer. The last one returns it to the pool.
+ */
+void dme_buff_unref(buff_t buff)
+{
+    rx_slot_t * slot = NULL;
+
+    if (!buff.data) {
+        return;
+    }
+
+    slot = rx_slot_of(buff.data);
+    if (slot->rx_refs == 0) {
+        dbg_err("Buffer @%p released too many times!", buff.data);
+        return;
+    }
+    if (--slot->rx_refs == 0) {
+        if (slot->rx_size > MAX_PACK_LEN) {
+            free(slot);
+            return;
+        }
+        slot->rx_next = rx_free;
+        rx_free = slot;
+    }
+}
+
+/*
+ * Receive path.
+ * Every ready datagram is pulled with a single recvmmsg() call into pool
+ * slots kept registered with the mmsghdr array. Only the slots that were
+ * filled (and handed out) are replaced before the next call.
+ */
+static rx_slot_t * recv_slots[RECV_BATCH_LEN];
+static struct iovec recv_iovs[RECV_BATCH_LEN];
+static struct mmsghdr recv_msgs[RECV_BATCH_LEN];
+static struct sockaddr_in recv_addrs[RECV_BATCH_LEN];
+
+/*
+ * Registers a fresh slot in every empty batch position.
+ * Returns the number of usable positions.
+ */
+static int dme_recv_refill(void)
+{
+    int ix;
+
+    for (ix = 0; ix < RECV_BATCH_LEN; ix++) {
+        if (recv_slots[ix]) {
+            continue;
+        }
+        if (!(recv_slots[ix] = rx_slot_alloc())) {
+            dbg_err("Could not allocate receive buffers");
+            break;
+        }
+        recv_iovs[ix].iov_base = recv_slots[ix]->rx_data;
+        recv_iovs[ix].iov_len = MAX_PACK_LEN;
+        recv_msgs[ix].msg_hdr.msg_iov = &recv_iovs[ix];
+        recv_msgs[ix].msg_hdr.msg_iovlen = 1;
+    }
+    return ix;
+}
+
+/*
+ * Our own messages to the multicast group are looped back to us.
+ * Both message formats start with the magic and the sender's process id.
+ */
+static inline bool_t dme_is_own_msg(const buff_t * buff)
+{
+    uint64 pid;
+
+    if (buff->len < sizeof(uint32) + sizeof(pid)) {
+        return FALSE;
+    }
+    memcpy(&pid, buff->data + sizeof(uint32), sizeof(pid));
+    return ntohq(pid) == proc_id;
+}
+
+/*
+ * Receive up to RECV_BATCH_LEN datagrams that are ready on the socket,
+ * without blocking. *out_count is 0 if there was nothing to read.
+ * The caller owns one reference to each returned buffer and must release it
+ * with dme_buff_unref().
+ */
+int dme_recv_batch(int sock, buff_t * out_buffs, unsigned int * out_count)
+{
+    /* with connected sockets only the sites may still use the listening one */
+    bool_t filter = (sock == nodes[proc_id].sock_fd && udp_link_active());
+    int count = 0;
+    int vlen = 0;
+    int ix;
+
+    *out_count = 0;
+    if (shm_link_owns(sock)) {
+        return shm_link_recv(sock, out_buffs, RECV_BATCH_LEN, out_count);
+    }
+    if (tcp_link_owns(sock)) {
+        return tcp_link_recv(sock, out_buffs, RECV_BATCH_LEN, out_count);
+    }
+
+    if (0 == (vlen = dme_recv_refill())) {
         return ERR_RECV_MSG;
     }
-    
-    /* Recieve the real data */
-    if (len != recv(nodes[proc_id].sock_fd, *out_buff, len, 0)) {
-        dbg_err("The expected packet length has changed! How did this happen??");
-        safe_free(*out_buff);
+
+    for (ix = 0; ix < vlen; ix++) {
+        recv_msgs[ix].msg_hdr.msg_flags = 0;
+        recv_msgs[ix].msg_hdr.msg_name = filter ? &recv_addrs[ix] : NULL;
+        recv_msgs[ix].msg_hdr.msg_namelen = filter ? sizeof(recv_addrs[ix]) : 0;
+    }
+
+    count = recvmmsg(sock, recv_msgs, vlen,
+                     MSG_DONTWAIT, NULL);
+    if (count < 0) {
+        /* a connected socket reports ICMP errors, e.g. its peer is not up */
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR
+            || errno == ECONNREFUSED) {
+            return 0;
+        }
+        dbg_err("recvmmsg() failed: %s", strerror(errno));
         return ERR_RECV_MSG;
     }
-    
-    /* Now it's safe to report the retrieved buffer length */
-    *out_len = len;
+
+    for (ix = 0; ix < count; ix++) {
+        out_buffs[ix].data = recv_slots[ix]->rx_data;
+        out_buffs[ix].len = recv_msgs[ix].msg_len;
+        recv_slots[ix] = NULL;
+
+        /* Oversized packets are reported empty, so the caller skips them */
+        if (recv_msgs[ix].msg_hdr.msg_flags & MSG_TRUNC) {
+            dbg_err("Dropping packet longer than %d bytes", MAX_PACK_LEN);
+            out_buffs[ix].len = 0;
+        } else if (sock == nodes[proc_id].mcast_fd
+                   && dme_is_own_msg(&out_buffs[ix])) {
+            out_buffs[ix].len = 0;
+        } else if (filter && !udp_link_known(&recv_addrs[ix])) {
+            dbg_err("Dropping packet from %s:%d, not a site",
+                    inet_ntoa(recv_addrs[ix].sin_addr),
+                    ntohs(recv_addrs[ix].sin_port));
+            out_buffs[ix].len = 0;
+        }
+    }
+
+    *out_count = count;
     return 0;
 }
 
+#ifdef DME_IO_URING
+/*
+ * io_uring receive path.
+ * Each datagram socket has a multishot receive request that picks buffers
+ * from a ring of pool slots provided to the kernel, one completion per
+ * datagram. The slot of a completion is handed out like the recvmmsg() ones
+ * and a fresh slot takes its place in the ring right away.
+ */
+#define RECV_RING_LEN       (256)       /* a power of 2 */
+#define RECV_RING_GROUP     (0)
+
+static struct io_uring_buf_ring * recv_ring = NULL;
+static buff_t recv_ring_buffs[RECV_RING_LEN];   /* by buffer id */
+
+static void dme_recv_ring_fill(uint16 bid)
+{
+    if (dme_buff_alloc(&recv_ring_buffs[bid], MAX_PACK_LEN)) {
+        uring_buf_add(recv_ring, RECV_RING_LEN, recv_ring_buffs[bid].data,
+                      MAX_PACK_LEN, bid);
+    } else {
+        recv_ring_buffs[bid].data = NULL;
+    }
+}
+
+int dme_recv_ring_init(void)
+{
+    uint16 bid;
+
+    if (!(recv_ring = uring_buf_ring(RECV_RING_GROUP, RECV_RING_LEN))) {
+        return ERR_INIT;
+    }
+    for (bid = 0; bid < RECV_RING_LEN; bid++) {
+        dme_recv_ring_fill(bid);
+    }
+    return 0;
+}
+
+void dme_recv_ring_deinit(void)
+{
+    uint16 bid;
+
+    if (!recv_ring) {
+        return;
+    }
+    uring_buf_ring_free(recv_ring, RECV_RING_GROUP, RECV_RING_LEN);
+    recv_ring = NULL;
+    for (bid = 0; bid < RECV_RING_LEN; bid++) {
+        dme_buff_unref(recv_ring_buffs[bid]);
+        recv_ring_buffs[bid].data = NULL;
+    }
+}
+
+/*
+ * Starts receiving from a datagram socket into the ring.
+ * MSG_TRUNC makes the completions of oversized datagrams show their length.
+ */
+int dme_recv_ring_arm(int sock, uint64 user_data)
+{
+    struct io_uring_sqe * sqe = NULL;
+
+    if (!(sqe = uring_sqe())) {
+        return ERR_RECV_MSG;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = sock;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->msg_flags = MSG_TRUNC;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = RECV_RING_GROUP;
+    sqe->user_data = user_data;
+    return 0;
+}
+
+/*
+ * Takes the buffer of a receive completion, if it has one. The caller owns
+ * one reference to it; it is empty if the datagram is to be skipped.
+ */
+bool_t dme_recv_ring_take(int sock, int res, uint32 cqe_flags, buff_t * out_buff)
+{
+    uint16 bid = cqe_flags >> IORING_CQE_BUFFER_SHIFT;
+
+    if (!(cqe_flags & IORING_CQE_F_BUFFER)) {
+        return FALSE;
+    }
+
+    *out_buff = recv_ring_buffs[bid];
+    out_buff->len = res < 0 ? 0 : res;
+    dme_recv_ring_fill(bid);
+
+    if (res > MAX_PACK_LEN) {
+        dbg_err("Dropping packet longer than %d bytes", MAX_PACK_LEN);
+        out_buff->len = 0;
+    } else if (sock == nodes[proc_id].mcast_fd && dme_is_own_msg(out_buff)) {
+        out_buff->len = 0;
+    }
+    return TRUE;
+}
+#endif /* DME_IO_URING */
+
 /*
  * Prepare a DME message header for network sending.
  */
@@ -226,7 +890,7 @@ int dme_header_parse(buff_t buff, dme_message_hdr_t * const msg)
     msg->process_id = ntohq(src->process_id);
     msg->msg_type = ntohs(src->msg_type);
     msg->length = ntohs(src->length);
-    msg->flags = ntohs(src->flags);;
+    msg->flags = ntohs(src->flags) & ~DME_FLAG_COMPACT;
     
     return 0;
 }
@@ -19,12 +19,39 @@ static inline uint64 htonq(uint64 q) {
 }
 #define ntohq(q) htonq(q)
 #define MAX_MSC_TEXT 256
+#define MAX_PACK_LEN    (1024) /* To avoid fragmentation -> UDP fails */
 
 extern int dme_send_msg(proc_id_t dest, uint8 * buff, size_t len, char * const msctext);
-extern int dme_recv_msg(uint8 ** out_buff, size_t * out_len);
-
+extern int dme_send_link(proc_id_t dest, const uint8 * buff, size_t len);
+extern int dme_send_direct(proc_id_t dest, const uint8 * buff, size_t len);
+
+/* Maximum number of datagrams received with one system call */
+#define RECV_BATCH_LEN  (64)
+extern int dme_recv_batch(int sock, buff_t * out_buffs, unsigned int * out_count);
+
+#ifdef DME_IO_URING
+/* Receiving with io_uring, into provided buffers (see net.c) */
+extern int    dme_recv_ring_init(void);
+extern void   dme_recv_ring_deinit(void);
+extern int    dme_recv_ring_arm(int sock, uint64 user_data);
+extern bool_t dme_recv_ring_take(int sock, int res, uint32 cqe_flags,
+                                 buff_t * out_buff);
+#endif
+
+/* Received buffers are reference counted, see net.c */
+extern bool_t dme_buff_alloc(buff_t * out_buff, size_t len);
+extern buff_t dme_buff_ref(buff_t buff);
+extern void   dme_buff_unref(buff_t buff);
+
+extern int dme_send_msg_set(const proc_id_t * dests, size_t count,
+                            uint8 * buff, size_t len, char * const msctext);
 extern int dme_broadcast_msg(uint8 * buff, size_t len, char * const msctext);
 
+/* UDP messages are batched per destination until flushed, see net.c */
+extern int  dme_send_flush(void);
+extern int  dme_send_udp(proc_id_t dest, const uint8 * buff, size_t len);
+extern void dme_send_deinit(void);
+
 /* Message types for each algorithm */
 typedef enum msg_types_e {
     MSGT_LAMPORT,
@@ -106,6 +133,97 @@ typedef struct sup_message_s sup_message_t;
 #define SUPERVISOR_MESSAGE_LENGTH (sizeof(struct sup_message_s))
 
 
+/* The batch format. Several messages to the same site in one datagram. */
+/*
+ *   0                8                 16                24                32 
+ *   |- - - - - - - - + - - - - - - - - + - - - - - - - - + - - - - - - - - |
+ * 0 |                           Packet MAGIC                               |
+ *   |----------------------------------------------------------------------|
+ * 1 |         Message count            | xxxxxxxxxxx Reserved xxxxxxxxxxx  |
+ *   |----------------------------------------------------------------------|
+ * 2 |         Length                   |                                   |
+ *   |----------------------------------+                                   |
+ * . |                   A DME or supervisor message                        |
+ *   |                                  +-----------------------------------|
+ *   |                                  |         Length                    |
+ *   |----------------------------------+                                   |
+ * . |                                ....                                  |
+ *   |                                                                      |
+ * 
+ */
+
+#define DME_BATCH_MAGIC (0xBA7CAA59)  /* BATCHMSG in 31137 speech :) */
+struct dme_batch_hdr_s {
+    uint32      batch_magic;
+    uint16      count;          /* number of messages that follow */
+    uint16      reserved;
+} PACKED;
+typedef struct dme_batch_hdr_s dme_batch_hdr_t;
+
+#define DME_BATCH_HEADER_LEN (sizeof(struct dme_batch_hdr_s))
+#define DME_BATCH_ITEM_LEN   (sizeof(uint16))  /* length before each message */
+
+
+/* The reliable delivery envelope (see reliable.c) */
+/*
+ *   0                8                 16                24                32 
+ *   |- - - - - - - - + - - - - - - - - + - - - - - - - - + - - - - - - - - |
+ * 0 |                           Packet MAGIC                               |
+ *   |----------------------------------------------------------------------|
+ * 1 |                             Process ID                               |
+ * 2 |                              (64 bits)                               |
+ *   |----------------------------------------------------------------------|
+ * 3 |                  Sequence number (0: no message)                     |
+ *   |----------------------------------------------------------------------|
+ * 4 |              Acknowledgement: next sequence number expected          |
+ *   |----------------------------------------------------------------------|
+ * 5 |           Selective ack.: bit i set if (ack + 1 + i) arrived         |
+ *   |----------------------------------------------------------------------|
+ * 6 |                                                                      |
+ * . |                   A DME or supervisor message                        |
+ * . |                                                                      |
+ * 
+ */
+
+#define DME_REL_MAGIC (0x4E1AAA59)  /* RELAMSG in 31137 speech :) */
+struct dme_rel_hdr_s {
+    uint32      rel_magic;
+    uint64      process_id;     /* the sender */
+    uint32      seq;
+    uint32      ack;
+    uint32      sack;
+    uint8       data[0];
+} PACKED;
+typedef struct dme_rel_hdr_s dme_rel_hdr_t;
+
+#define DME_REL_HEADER_LEN (sizeof(struct dme_rel_hdr_s))
+
+
+/* The compact format of the DME and supervisor messages (see compact.c) */
+/*
+ *   +--------+-------------+----------+---------+--------------------------+
+ *   | Magic  | Process ID  | Msg type | Flags   | DME: Length delta,       |
+ *   | (1 B)  | (varint)    | (varint) | (varint)|      Pid position, DATA  |
+ *   |        |             |          |         | SUP: Secs, Nanosecs      |
+ *   +--------+-------------+----------+---------+--------------------------+
+ *
+ * All the fields after the magic are varints, except the DME data which is
+ * the data of the message without the copy of the sender's process id the
+ * pid position (offset + 1, 0 if none) points to. The length delta is the
+ * full message length minus its length field (mod 2^16), usually 0.
+ * A varint takes n bytes, n being one plus the trailing zero bits of the
+ * first one. If n < 9 the value is in the bits above those, little endian;
+ * if n = 9 (the first byte is 0) it is in the 8 bytes that follow.
+ */
+
+#define DME_CMSG_MAGIC      (0xC2)      /* compact v1 DME message */
+#define SUP_CMSG_MAGIC      (0xC3)      /* compact v1 supervisor message */
+#define is_compact_magic(b) (((b) & 0xFE) == DME_CMSG_MAGIC)
+
+/* Flags bit of the full messages telling the sender reads the compact ones */
+#define DME_FLAG_COMPACT    (0x8000)
+
+
 extern int dme_header_set(dme_message_hdr_t * const hdr, unsigned int msgtype,
                           unsigned int msglen, unsigned int flags);
 
@@ -0,0 +1,451 @@
+/*
+ * src/common/reliable.c
+ *
+ * Reliable delivery over UDP: sequence numbers, acknowledgements and
+ * retransmission.
+ *
+ * -------------------------------------------------------------------------
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <common/reliable.h>
+#include <common/net.h>
+#include <common/init.h>
+#include <common/util.h>
+
+/* Global variables from main process */
+extern const link_info_t * const nodes;
+extern const size_t nodes_count;
+extern const proc_id_t proc_id;
+
+/*
+ * With REL_ENV set every message is sent in an envelope (dme_rel_hdr_t)
+ * carrying its sequence number on the link to its destination, counted
+ * from 1, and the acknowledgement of what came on the reverse link: the
+ * next sequence number expected (cumulative) and a bitmap of the
+ * REL_WINDOW messages after it that already arrived (selective).
+ *
+ * The receiver delivers the messages of a link in order, keeping those
+ * that arrive early, and drops the duplicates. Acknowledgements ride on
+ * the messages sent back; if none was sent by the end of the event loop
+ * iteration a bare one (sequence number 0) goes out.
+ *
+ * The sender keeps every message until it is acknowledged. At most
+ * REL_WINDOW of them are in flight on a link, from the oldest one not
+ * acknowledged, as the receiver drops what is further ahead; the next ones
+ * wait their turn and go out as acknowledgements come. A timer per link
+ * resends the ones in flight if none was acknowledged for a retransmission
+ * timeout (RTO). The RTO follows the measured round trip time as in
+ * RFC 6298 (messages that were resent are not measured), doubling on
+ * every expiry.
+ */
+
+#define REL_RTO_INIT    (100000)        /* usec */
+#define REL_RTO_MIN     (5000)
+#define REL_RTO_MAX     (2000000)
+
+typedef struct rel_pkt_s rel_pkt_t;
+struct rel_pkt_s {
+    rel_pkt_t  *rp_next;
+    uint32      rp_seq;
+    bool_t      rp_resent;
+    uint64      rp_sent;                /* first sent at (usec) */
+    size_t      rp_len;
+    uint8       rp_data[];              /* the envelope */
+};
+
+typedef struct rel_peer_s {
+    /* sending */
+    uint32      rl_next_seq;
+    rel_pkt_t  *rl_head;                /* not acknowledged, in order */
+    rel_pkt_t  *rl_tail;
+    rel_pkt_t  *rl_unsent;              /* first one past the window */
+    dme_timer_t rl_timer;
+    uint64      rl_srtt;
+    uint64      rl_rttvar;
+    uint64      rl_rto;
+
+    /* receiving */
+    uint32      rl_expected;            /* next to deliver */
+    buff_t      rl_early[REL_WINDOW];   /* arrived early, by seq % REL_WINDOW */
+    bool_t      rl_ack_due;
+} rel_peer_t;
+
+static rel_peer_t * rel_peers = NULL;   /* indexed by proc id */
+static int rel_active = -1;             /* not decided yet */
+static unsigned int rel_drop = 0;       /* percent */
+
+static uint64 rel_time_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+bool_t rel_link_active(void)
+{
+    const char * env = NULL;
+    size_t ix;
+
+    if (rel_active < 0) {
+        env = getenv(REL_ENV);
+        rel_active = env && 0 != strcmp(env, "0");
+        if (rel_active && (env = getenv(REL_DROP_ENV))) {
+            rel_drop = strtoul(env, NULL, BASE_10);
+            srand(time(NULL) ^ proc_id);
+        }
+
+        if (rel_active
+            && !(rel_peers = calloc(nodes_count + 1, sizeof(rel_peer_t)))) {
+            dbg_err("Could not allocate the reliable links");
+            rel_active = FALSE;
+        }
+        for (ix = 0; rel_active && ix <= nodes_count; ix++) {
+            rel_peers[ix].rl_next_seq = 1;
+            rel_peers[ix].rl_expected = 1;
+            rel_peers[ix].rl_rto = REL_RTO_INIT;
+        }
+        dbg_msg("Reliable delivery is %s (dropping %u%%)",
+                rel_active ? "on" : "off", rel_drop);
+    }
+    return rel_active;
+}
+
+/*
+ * Fills in the acknowledgement of what came from pid.
+ */
+static void rel_set_ack(proc_id_t pid, dme_rel_hdr_t * hdr)
+{
+    rel_peer_t * peer = &rel_peers[pid];
+    uint32 sack = 0;
+    int ix;
+
+    for (ix = 0; ix < REL_WINDOW - 1; ix++) {
+        if (peer->rl_early[(peer->rl_expected + 1 + ix) % REL_WINDOW].data) {
+            sack |= 1U << ix;
+        }
+    }
+
+    hdr->ack = htonl(peer->rl_expected);
+    hdr->sack = htonl(sack);
+    peer->rl_ack_due = FALSE;
+}
+
+static int rel_xmit(proc_id_t dest, uint8 * env, size_t len)
+{
+    rel_set_ack(dest, (dme_rel_hdr_t *)env);
+
+    /* the supervisor's links are left alone: it checks the timing */
+    if (rel_drop && dest != SUPERVISOR_PID && proc_id != SUPERVISOR_PID
+        && (unsigned int)(rand() % 100) < rel_drop) {
+        dbg_msg("Dropping a message to %llu", dest);
+        return 0;
+    }
+    return dme_send_link(dest, env, len);
+}
+
+static inline void rel_arm(proc_id_t dest)
+{
+    rel_peer_t * peer = &rel_peers[dest];
+
+    if (peer->rl_timer == DME_TIMER_NONE) {
+        peer->rl_timer = schedule_event(DME_IEV_REL_TIMEOUT,
+                                        peer->rl_rto / 1000000,
+                                        (peer->rl_rto % 1000000) * 1000,
+                                        (void *)(long)dest);
+    } else {
+        reschedule_event(peer->rl_timer, peer->rl_rto / 1000000,
+                         (peer->rl_rto % 1000000) * 1000);
+    }
+}
+
+/*
+ * Sends the messages waiting for room in the window.
+ */
+static void rel_release(proc_id_t dest)
+{
+    rel_peer_t * peer = &rel_peers[dest];
+    rel_pkt_t * pkt = NULL;
+
+    while ((pkt = peer->rl_unsent)
+           && (int32)(pkt->rp_seq - peer->rl_head->rp_seq) < REL_WINDOW) {
+        pkt->rp_sent = rel_time_now();
+        rel_xmit(dest, pkt->rp_data, pkt->rp_len);
+        peer->rl_unsent = pkt->rp_next;
+    }
+}
+
+/*
+ * Sends a message to dest reliably.
+ * Returns FALSE if the layer is off; the caller sends it as it is.
+ */
+bool_t rel_link_send(proc_id_t dest, const uint8 * buff, size_t len)
+{
+    rel_peer_t * peer = NULL;
+    rel_pkt_t * pkt = NULL;
+    dme_rel_hdr_t * hdr = NULL;
+
+    if (!rel_link_active() || dest > nodes_count || dest == proc_id) {
+        return FALSE;
+    }
+    if (DME_REL_HEADER_LEN + len > MAX_PACK_LEN) {
+        dbg_err("Message of %u bytes too long to be sent reliably", len);
+        return FALSE;
+    }
+    if (!(pkt = malloc(sizeof(rel_pkt_t) + DME_REL_HEADER_LEN + len))) {
+        dbg_err("Could not keep a message of %u bytes", len);
+        return FALSE;
+    }
+
+    peer = &rel_peers[dest];
+    pkt->rp_next = NULL;
+    pkt->rp_seq = peer->rl_next_seq++;
+    pkt->rp_resent = FALSE;
+    pkt->rp_len = DME_REL_HEADER_LEN + len;
+
+    hdr = (dme_rel_hdr_t *)pkt->rp_data;
+    hdr->rel_magic = htonl(DME_REL_MAGIC);
+    hdr->process_id = htonq(proc_id);
+    hdr->seq = htonl(pkt->rp_seq);
+    memcpy(hdr->data, buff, len);
+
+    if (peer->rl_tail) {
+        peer->rl_tail->rp_next = pkt;
+    } else {
+        peer->rl_head = pkt;
+        rel_arm(dest);
+    }
+    peer->rl_tail = pkt;
+
+    if (!peer->rl_unsent) {
+        peer->rl_unsent = pkt;
+    }
+    rel_release(dest);
+    return TRUE;
+}
+
+/*
+ * Sends a bare acknowledgement to every peer that is owed one.
+ * Called by the event loop before it waits.
+ */
+void rel_link_flush(void)
+{
+    dme_rel_hdr_t hdr;
+    size_t ix;
+
+    if (!rel_peers) {
+        return;
+    }
+
+    for (ix = 0; ix <= nodes_count; ix++) {
+        if (!rel_peers[ix].rl_ack_due) {
+            continue;
+        }
+        hdr.rel_magic = htonl(DME_REL_MAGIC);
+        hdr.process_id = htonq(proc_id);
+        hdr.seq = 0;
+        rel_xmit(ix, (uint8 *)&hdr, DME_REL_HEADER_LEN);
+    }
+}
+
+/*
+ * Drops the messages to pid covered by an acknowledgement.
+ */
+static void rel_acked(proc_id_t pid, uint32 ack, uint32 sack)
+{
+    rel_peer_t * peer = &rel_peers[pid];
+    rel_pkt_t ** ppkt = &peer->rl_head;
+    rel_pkt_t * pkt = NULL;
+    uint64 rtt = 0;
+    uint64 err;
+    int32 after;
+    bool_t acked = FALSE;
+
+    peer->rl_tail = NULL;
+    while ((pkt = *ppkt)) {
+        after = (int32)(pkt->rp_seq - ack);
+        if (after < 0 || (after > 0 && after <= REL_WINDOW - 1
+                          && (sack & (1U << (after - 1))))) {
+            if (!pkt->rp_resent) {
+                rtt = rel_time_now() - pkt->rp_sent;
+                if (rtt == 0) {
+                    rtt = 1;
+                }
+            }
+            *ppkt = pkt->rp_next;
+            if (pkt == peer->rl_unsent) {
+                peer->rl_unsent = pkt->rp_next;
+            }
+            free(pkt);
+            acked = TRUE;
+            continue;
+        }
+        peer->rl_tail = pkt;
+        ppkt = &pkt->rp_next;
+    }
+
+    if (rtt) {
+        if (peer->rl_srtt == 0) {
+            peer->rl_srtt = rtt;
+            peer->rl_rttvar = rtt / 2;
+        } else {
+            err = peer->rl_srtt > rtt ? peer->rl_srtt - rtt : rtt - peer->rl_srtt;
+            peer->rl_rttvar = (3 * peer->rl_rttvar + err) / 4;
+            peer->rl_srtt = (7 * peer->rl_srtt + rtt) / 8;
+        }
+        peer->rl_rto = peer->rl_srtt + 4 * peer->rl_rttvar;
+        peer->rl_rto = peer->rl_rto < REL_RTO_MIN ? REL_RTO_MIN :
+                       peer->rl_rto > REL_RTO_MAX ? REL_RTO_MAX : peer->rl_rto;
+    }
+
+    if (!peer->rl_head) {
+        if (peer->rl_timer != DME_TIMER_NONE) {
+            cancel_event(peer->rl_timer);
+            peer->rl_timer = DME_TIMER_NONE;
+        }
+    } else if (acked) {
+        rel_arm(pid);
+        rel_release(pid);
+    }
+}
+
+/*
+ * DME_IEV_REL_TIMEOUT handler: resends what a peer did not acknowledge.
+ */
+int rel_link_timeout(void * cookie)
+{
+    proc_id_t dest = (proc_id_t)(long)cookie;
+    rel_peer_t * peer = NULL;
+    rel_pkt_t * pkt = NULL;
+
+    if (!rel_peers || dest > nodes_count) {
+        return 0;
+    }
+
+    peer = &rel_peers[dest];
+    peer->rl_timer = DME_TIMER_NONE;
+    if (!peer->rl_head) {
+        return 0;
+    }
+
+    peer->rl_rto *= 2;
+    if (peer->rl_rto > REL_RTO_MAX) {
+        peer->rl_rto = REL_RTO_MAX;
+    }
+    dbg_msg("Resending to %llu, next RTO %llu usec", dest, peer->rl_rto);
+
+    for (pkt = peer->rl_head; pkt && pkt != peer->rl_unsent; pkt = pkt->rp_next) {
+        pkt->rp_resent = TRUE;
+        rel_xmit(dest, pkt->rp_data, pkt->rp_len);
+    }
+    rel_arm(dest);
+    return 0;
+}
+
+/*
+ * Copies the message of an envelope to a buffer of its own.
+ */
+static bool_t rel_copy(buff_t env, buff_t * out)
+{
+    size_t len = env.len - DME_REL_HEADER_LEN;
+
+    if (!dme_buff_alloc(out, len)) {
+        return FALSE;
+    }
+    memcpy(out->data, env.data + DME_REL_HEADER_LEN, len);
+    return TRUE;
+}
+
+/*
+ * Takes the acknowledgement of an envelope and returns the messages that
+ * can now be delivered, in order. The caller releases them.
+ */
+int rel_link_recv(buff_t buff, buff_t * out_buffs, unsigned int * out_count)
+{
+    dme_rel_hdr_t hdr;
+    rel_peer_t * peer = NULL;
+    proc_id_t pid;
+    uint32 seq;
+    int32 ahead;
+    buff_t * early = NULL;
+
+    *out_count = 0;
+    if (buff.len < DME_REL_HEADER_LEN || !rel_link_active()) {
+        dbg_err("Recieved a truncated or unexpected envelope. Ignoring it.");
+        return 0;
+    }
+
+    memcpy(&hdr, buff.data, DME_REL_HEADER_LEN);
+    pid = ntohq(hdr.process_id);
+    if (pid > nodes_count || pid == proc_id) {
+        dbg_err("Recieved an envelope from unknown process %llu", pid);
+        return ERR_RECV_MSG;
+    }
+    peer = &rel_peers[pid];
+
+    rel_acked(pid, ntohl(hdr.ack), ntohl(hdr.sack));
+
+    if (0 == (seq = ntohl(hdr.seq))) {
+        return 0;
+    }
+
+    /* whatever it is, it gets acknowledged */
+    peer->rl_ack_due = TRUE;
+
+    ahead = (int32)(seq - peer->rl_expected);
+    if (ahead < 0 || ahead >= REL_WINDOW) {
+        dbg_msg("Ignoring message %u from %llu (expecting %u)",
+                seq, pid, peer->rl_expected);
+        return 0;
+    }
+
+    if (ahead > 0) {
+        early = &peer->rl_early[seq % REL_WINDOW];
+        if (!early->data && !rel_copy(buff, early)) {
+            return ERR_MALLOC;
+        }
+        return 0;
+    }
+
+    if (!rel_copy(buff, &out_buffs[(*out_count)++])) {
+        (*out_count)--;
+        return ERR_MALLOC;
+    }
+    peer->rl_expected++;
+
+    /* and those that were waiting for it */
+    while ((early = &peer->rl_early[peer->rl_expected % REL_WINDOW])->data) {
+        out_buffs[(*out_count)++] = *early;
+        early->data = NULL;
+        early->len = 0;
+        peer->rl_expected++;
+    }
+    return 0;
+}
+
+void rel_link_deinit(void)
+{
+    rel_pkt_t * pkt = NULL;
+    size_t ix;
+    int jx;
+
+    if (!rel_peers) {
+        return;
+    }
+
+    for (ix = 0; ix <= nodes_count; ix++) {
+        while ((pkt = rel_peers[ix].rl_head)) {
+            rel_peers[ix].rl_head = pkt->rp_next;
+            free(pkt);
+        }
+        for (jx = 0; jx < REL_WINDOW; jx++) {
+            dme_buff_unref(rel_peers[ix].rl_early[jx]);
+        }
+    }
+    safe_free(rel_peers);
+    rel_active = -1;
+}
@@ -0,0 +1,34 @@
+/*
+ * src/common/reliable.h
+ *
+ * Reliable delivery over UDP: sequence numbers, acknowledgements and
+ * retransmission.
+ *
+ * -------------------------------------------------------------------------
+ */
+
+#ifndef RELIABLE_H_
+#define RELIABLE_H_
+
+#include <common/defs.h>
+
+/* Set (to anything but "0") to make the message delivery reliable */
+#define REL_ENV         "DME_RELIABLE"
+/* Percentage of the datagrams between sites to drop, to test the above */
+#define REL_DROP_ENV    "DME_RELIABLE_DROP"
+
+/* Messages that can be in flight to a peer (the next ones wait for an
+ * acknowledgement); also the SACK bitmap width */
+#define REL_WINDOW      (32)
+
+extern bool_t rel_link_active(void);
+extern bool_t rel_link_send(proc_id_t dest, const uint8 * buff, size_t len);
+extern void   rel_link_flush(void);
+extern int    rel_link_timeout(void * cookie);
+extern void   rel_link_deinit(void);
+
+/* out_buffs must have room for REL_WINDOW + 1 messages */
+extern int    rel_link_recv(buff_t buff, buff_t * out_buffs,
+                            unsigned int * out_count);
+
+#endif /* RELIABLE_H_ */
@@ -0,0 +1,457 @@
+/*
+ * src/common/shmlink.c
+ *
+ * Shared memory transport between sites running on the same host.
+ *
+ * -------------------------------------------------------------------------
+ */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+
+#include <common/shmlink.h>
+#include <common/net.h>
+#include <common/init.h>
+
+/* Global variables from main process */
+extern const link_info_t * const nodes;
+extern const size_t nodes_count;
+extern const proc_id_t proc_id;
+
+/*
+ * Every ordered pair of sites marked 'shm' in the config file has its own
+ * single producer / single consumer ring, in a shared memory segment
+ * created by the sender.
+ *
+ * The sender also creates the eventfd that wakes the receiver and hands it
+ * over (SCM_RIGHTS) through the receiver's "doorbell": an abstract unix
+ * datagram socket named after its listen port. The receiver maps the
+ * segment, unlinks its name and watches the eventfd like a socket.
+ *
+ * The eventfd is only written when the ring was empty, i.e. when the
+ * receiver may be sleeping; a receiver that leaves messages in the ring
+ * writes it itself. Until a link is set up, and whenever a ring is
+ * full, messages go over UDP.
+ *
+ * eventfds can't raise signals, so only the epoll and io_uring backends have a
+ * doorbell; with the signal backend all the peers use UDP.
+ */
+
+typedef struct shm_slot_s {
+    uint32      ss_len;
+    uint8       ss_data[MAX_PACK_LEN];
+} shm_slot_t;
+
+typedef struct shm_ring_s {
+    uint32      sr_head;                /* written by the sender only */
+    uint8       sr_pad0[60];            /* keep the indexes on separate lines */
+    uint32      sr_tail;                /* written by the receiver only */
+    uint8       sr_pad1[60];
+    shm_slot_t  sr_slots[SHM_RING_LEN];
+} shm_ring_t;
+
+typedef struct shm_peer_s {
+    shm_ring_t *sp_tx;                  /* ring to the peer */
+    int         sp_tx_efd;
+    bool_t      sp_tx_up;               /* the peer has our eventfd */
+    uint64      sp_retry_at;            /* next set up attempt (usec) */
+    shm_ring_t *sp_rx;                  /* ring from the peer */
+    int         sp_rx_efd;
+} shm_peer_t;
+
+#define SHM_RETRY_USEC  (100000)        /* between set up attempts */
+#define SHM_DOORBELL    "dme-shm-%u"    /* abstract socket name, by port */
+#define SHM_SEGMENT     "/dme-shm-%u-%u" /* by sender and receiver port */
+
+static shm_peer_t * shm_peers = NULL;  /* indexed by proc id */
+static int shm_doorbell_fd = -1;
+static int shm_tx_sock = -1;            /* unbound, sends the eventfds */
+
+static inline bool_t shm_peer_ok(proc_id_t pid)
+{
+    return pid > 0 && pid <= nodes_count && nodes[pid].shm_link;
+}
+
+static inline uint16 shm_port(proc_id_t pid)
+{
+    return ntohs(nodes[pid].listen_addr.sin_port);
+}
+
+static socklen_t shm_doorbell_addr(proc_id_t pid, struct sockaddr_un * addr)
+{
+    bzero(addr, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    /* abstract names start with a NUL byte */
+    snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1,
+             SHM_DOORBELL, shm_port(pid));
+    return offsetof(struct sockaddr_un, sun_path) + 1 + strlen(addr->sun_path + 1);
+}
+
+static shm_ring_t * shm_ring_map(proc_id_t src, proc_id_t dst, bool_t create)
+{
+    char name[64];
+    shm_ring_t * ring = NULL;
+    int fd;
+
+    snprintf(name, sizeof(name), SHM_SEGMENT, shm_port(src), shm_port(dst));
+
+    if (0 > (fd = shm_open(name, create ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR,
+                           0600))) {
+        dbg_err("Could not open shared memory segment %s", name);
+        return NULL;
+    }
+
+    if ((!create || 0 == ftruncate(fd, sizeof(shm_ring_t)))) {
+        ring = mmap(NULL, sizeof(shm_ring_t), PROT_READ | PROT_WRITE,
+                    MAP_SHARED, fd, 0);
+        if (ring == MAP_FAILED) {
+            ring = NULL;
+        }
+    }
+    close(fd);
+
+    /* The name is not needed once both ends have it mapped */
+    if (!create) {
+        shm_unlink(name);
+    }
+
+    if (!ring) {
+        dbg_err("Could not map shared memory segment %s", name);
+    }
+    return ring;
+}
+
+/*
+ * Creates our ring to a peer and hands its eventfd to the peer's doorbell.
+ */
+static bool_t shm_link_connect(proc_id_t dest)
+{
+    shm_peer_t * peer = &shm_peers[dest];
+    struct sockaddr_un addr;
+    struct msghdr msg = {};
+    struct iovec iov;
+    struct cmsghdr * cmsg = NULL;
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } ctl;
+    uint64 src = proc_id;
+
+    if (!peer->sp_tx && !(peer->sp_tx = shm_ring_map(proc_id, dest, TRUE))) {
+        return FALSE;
+    }
+    if (peer->sp_tx_efd < 0
+        && 0 > (peer->sp_tx_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))) {
+        dbg_err("Could not create eventfd");
+        return FALSE;
+    }
+    if (shm_tx_sock < 0
+        && 0 > (shm_tx_sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0))) {
+        dbg_err("Could not create the unix socket");
+        return FALSE;
+    }
+
+    iov.iov_base = &src;
+    iov.iov_len = sizeof(src);
+    msg.msg_name = &addr;
+    msg.msg_namelen = shm_doorbell_addr(dest, &addr);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &peer->sp_tx_efd, sizeof(int));
+
+    if (0 > sendmsg(shm_tx_sock, &msg, MSG_DONTWAIT)) {
+        /* The peer is not up yet, or it uses the signal backend */
+        return FALSE;
+    }
+
+    dbg_msg("Shared memory link to %llu is up", dest);
+    return TRUE;
+}
+
+/*
+ * Receives a peer's eventfd on the doorbell and maps its ring.
+ */
+static int shm_link_accept(void)
+{
+    struct msghdr msg = {};
+    struct iovec iov;
+    struct cmsghdr * cmsg = NULL;
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } ctl;
+    uint64 src = 0;
+    int efd = -1;
+    shm_peer_t * peer = NULL;
+
+    iov.iov_base = &src;
+    iov.iov_len = sizeof(src);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+
+    while (0 < recvmsg(shm_doorbell_fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC)) {
+        cmsg = CMSG_FIRSTHDR(&msg);
+        if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS) {
+            dbg_err("Doorbell message without an eventfd");
+            goto next;
+        }
+        memcpy(&efd, CMSG_DATA(cmsg), sizeof(int));
+
+        if (!shm_peer_ok(src) || src == proc_id) {
+            dbg_err("Doorbell message from unexpected process %llu", src);
+            close(efd);
+            goto next;
+        }
+
+        /* A restarted peer sets up a new ring */
+        peer = &shm_peers[src];
+        if (peer->sp_rx) {
+            munmap(peer->sp_rx, sizeof(shm_ring_t));
+            peer->sp_rx = NULL;
+        }
+        if (peer->sp_rx_efd >= 0) {
+            close(peer->sp_rx_efd);
+            peer->sp_rx_efd = -1;
+        }
+
+        if (!(peer->sp_rx = shm_ring_map(src, proc_id, FALSE))
+            || add_input_socket(efd)) {
+            close(efd);
+            goto next;
+        }
+        peer->sp_rx_efd = efd;
+        dbg_msg("Shared memory link from %llu is up", src);
+
+next:
+        msg.msg_controllen = sizeof(ctl.buf);
+    }
+
+    return 0;
+}
+
+/*
+ * Opens the doorbell of this site. The caller watches the returned fd.
+ */
+int shm_link_init(int * out_fd)
+{
+    struct sockaddr_un addr;
+    socklen_t addrlen;
+    size_t ix;
+
+    if (!(shm_peers = calloc(nodes_count + 1, sizeof(shm_peer_t)))) {
+        return ERR_MALLOC;
+    }
+    for (ix = 0; ix <= nodes_count; ix++) {
+        shm_peers[ix].sp_tx_efd = shm_peers[ix].sp_rx_efd = -1;
+    }
+
+    if (0 > (shm_doorbell_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0))) {
+        dbg_err("Could not create the doorbell socket");
+        return ERR_INIT;
+    }
+
+    addrlen = shm_doorbell_addr(proc_id, &addr);
+    if (bind(shm_doorbell_fd, (struct sockaddr *)&addr, addrlen)) {
+        dbg_err("Could not bind the doorbell socket");
+        close(shm_doorbell_fd);
+        shm_doorbell_fd = -1;
+        return ERR_INIT;
+    }
+
+    *out_fd = shm_doorbell_fd;
+    return 0;
+}
+
+void shm_link_deinit(void)
+{
+    char name[64];
+    size_t ix;
+
+    if (!shm_peers) {
+        return;
+    }
+
+    for (ix = 0; ix <= nodes_count; ix++) {
+        if (shm_peers[ix].sp_tx) {
+            munmap(shm_peers[ix].sp_tx, sizeof(shm_ring_t));
+            /* the peer never mapped it, so the name is still there */
+            if (!shm_peers[ix].sp_tx_up) {
+                snprintf(name, sizeof(name), SHM_SEGMENT,
+                         shm_port(proc_id), shm_port(ix));
+                shm_unlink(name);
+            }
+        }
+        if (shm_peers[ix].sp_rx) {
+            munmap(shm_peers[ix].sp_rx, sizeof(shm_ring_t));
+        }
+        if (shm_peers[ix].sp_tx_efd >= 0) {
+            close(shm_peers[ix].sp_tx_efd);
+        }
+        if (shm_peers[ix].sp_rx_efd >= 0) {
+            close(shm_peers[ix].sp_rx_efd);
+        }
+    }
+    safe_free(shm_peers);
+
+    if (shm_doorbell_fd >= 0) {
+        close(shm_doorbell_fd);
+        shm_doorbell_fd = -1;
+    }
+    if (shm_tx_sock >= 0) {
+        close(shm_tx_sock);
+        shm_tx_sock = -1;
+    }
+}
+
+/*
+ * Sends a message through the shared memory ring to dest.
+ * Returns FALSE if dest is not reachable this way; the caller must use UDP.
+ */
+bool_t shm_link_send(proc_id_t dest, const uint8 * buff, size_t len)
+{
+    shm_peer_t * peer = NULL;
+    shm_ring_t * ring = NULL;
+    struct timespec ts;
+    uint64 now;
+    uint32 head;
+    uint32 tail;
+    uint64 one = 1;
+
+    if (!shm_peers || !nodes[proc_id].shm_link || !shm_peer_ok(dest)
+        || len > MAX_PACK_LEN) {
+        return FALSE;
+    }
+
+    peer = &shm_peers[dest];
+    if (!peer->sp_tx_up) {
+        /* not set up yet: try now and then */
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        now = (uint64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+        if (now < peer->sp_retry_at) {
+            return FALSE;
+        }
+        peer->sp_retry_at = now + SHM_RETRY_USEC;
+        if (!(peer->sp_tx_up = shm_link_connect(dest))) {
+            return FALSE;
+        }
+    }
+
+    ring = peer->sp_tx;
+    head = ring->sr_head;
+    tail = __atomic_load_n(&ring->sr_tail, __ATOMIC_ACQUIRE);
+    if (head - tail >= SHM_RING_LEN) {
+        dbg_err("Shared memory ring to %llu is full", dest);
+        return FALSE;
+    }
+
+    ring->sr_slots[head % SHM_RING_LEN].ss_len = len;
+    memcpy(ring->sr_slots[head % SHM_RING_LEN].ss_data, buff, len);
+    __atomic_store_n(&ring->sr_head, head + 1, __ATOMIC_SEQ_CST);
+
+    /* Wake the receiver only if it had consumed everything */
+    if (__atomic_load_n(&ring->sr_tail, __ATOMIC_SEQ_CST) == head) {
+        write(peer->sp_tx_efd, &one, sizeof(one));
+    }
+    return TRUE;
+}
+
+/*
+ * Is fd the doorbell or a ring's eventfd ?
+ */
+bool_t shm_link_owns(int fd)
+{
+    size_t ix;
+
+    if (!shm_peers || fd < 0) {
+        return FALSE;
+    }
+    if (fd == shm_doorbell_fd) {
+        return TRUE;
+    }
+    for (ix = 1; ix <= nodes_count; ix++) {
+        if (shm_peers[ix].sp_rx_efd == fd) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/*
+ * Receives up to max messages from the ring woken through fd, copying them
+ * into receive pool buffers (see dme_buff_alloc()).
+ * A ready doorbell sets up the new links and returns no messages.
+ */
+int shm_link_recv(int fd, buff_t * out_buffs, unsigned int max,
+                  unsigned int * out_count)
+{
+    shm_ring_t * ring = NULL;
+    shm_slot_t * slot = NULL;
+    uint64 counter;
+    uint32 head;
+    uint32 tail;
+    unsigned int count = 0;
+    size_t ix;
+
+    *out_count = 0;
+    if (fd == shm_doorbell_fd) {
+        return shm_link_accept();
+    }
+
+    for (ix = 1; ix <= nodes_count && !ring; ix++) {
+        if (shm_peers[ix].sp_rx_efd == fd) {
+            ring = shm_peers[ix].sp_rx;
+        }
+    }
+    if (!ring) {
+        return ERR_RECV_MSG;
+    }
+
+    /* reset the wake up counter before looking at the ring */
+    read(fd, &counter, sizeof(counter));
+
+    tail = ring->sr_tail;
+    head = __atomic_load_n(&ring->sr_head, __ATOMIC_ACQUIRE);
+    while (count < max && tail != head) {
+        slot = &ring->sr_slots[tail % SHM_RING_LEN];
+        if (!dme_buff_alloc(&out_buffs[count], slot->ss_len < MAX_PACK_LEN
+                                               ? slot->ss_len : MAX_PACK_LEN)) {
+            break;
+        }
+        memcpy(out_buffs[count].data, slot->ss_data, out_buffs[count].len);
+        count++;
+
+        __atomic_store_n(&ring->sr_tail, ++tail, __ATOMIC_SEQ_CST);
+        if (tail == head) {
+            head = __atomic_load_n(&ring->sr_head, __ATOMIC_SEQ_CST);
+        }
+    }
+
+    /*
+     * Stopped short (max reached or no buffer left): the sender won't wake
+     * us for the slots left, so wake ourselves up again.
+     */
+    if (tail != head) {
+        counter = 1;
+        write(fd, &counter, sizeof(counter));
+    }
+
+    *out_count = count;
+    return 0;
+}
@@ -0,0 +1,26 @@
+/*
+ * src/common/shmlink.h
+ *
+ * Shared memory transport between sites running on the same host.
+ *
+ * -------------------------------------------------------------------------
+ */
+
+#ifndef SHMLINK_H_
+#define SHMLINK_H_
+
+#include <common/defs.h>
+
+/* Messages each ring can hold */
+#define SHM_RING_LEN    (256)
+
+extern int    shm_link_init(int * out_fd);
+extern void   shm_link_deinit(void);
+
+extern bool_t shm_link_send(proc_id_t dest, const uint8 * buff, size_t len);
+
+extern bool_t shm_link_owns(int fd);
+extern int    shm_link_recv(int fd, buff_t * out_buffs, unsigned int max,
+                            unsigned int * out_count);
+
+#endif /* SHMLINK_H_ */
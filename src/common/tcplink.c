@@ -0,0 +1,571 @@
+/*
+ * src/common/tcplink.c
+ *
+ * TCP stream transport: one persistent connection per pair of sites.
+ *
+ * -------------------------------------------------------------------------
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/tcp.h>
+
+#include <common/tcplink.h>
+#include <common/net.h>
+#include <common/init.h>
+
+/* Global variables from main process */
+extern const link_info_t * const nodes;
+extern const size_t nodes_count;
+extern const proc_id_t proc_id;
+
+/*
+ * Sites marked 'tcp' in the config file talk to each other over TCP,
+ * listening on the same address and port as for UDP.
+ *
+ * The site that sends first connects and introduces itself with its
+ * process id (8 bytes). Both ends then use that connection in both
+ * directions, unless they both connected at the same time; each end then
+ * sends on its own connection and receives on both.
+ *
+ * Every message is framed with its length (4 bytes, network order).
+ * Messages are only copied to the peer's output buffer when sent; all those
+ * queued during an event loop iteration go out in a single write when the
+ * loop flushes the sends before waiting (see dme_send_flush()). What the
+ * socket has no room for stays in the buffer until the event loop tells
+ * it has, and the frames not written when a connection fails go over UDP.
+ *
+ * Until a connection is up (the connect is not waited for) messages go
+ * over UDP.
+ */
+
+#define TCP_FRAME_HDR   (sizeof(uint32))
+#define TCP_HELLO_LEN   (sizeof(uint64))
+#define TCP_RBUF_LEN    (2 * (TCP_MAX_FRAME + TCP_FRAME_HDR))
+#define TCP_RETRY_USEC  (100000)        /* between connect attempts */
+#define TCP_PID_UNKNOWN (~0ULL)
+
+typedef struct tcp_conn_s {
+    int         tc_fd;                  /* -1 if the entry is free */
+    proc_id_t   tc_pid;                 /* TCP_PID_UNKNOWN until hello */
+    bool_t      tc_fresh;               /* accepted, not yet read from */
+    bool_t      tc_connecting;          /* our connect() is in progress */
+    uint8      *tc_rbuf;
+    size_t      tc_rpos;                /* start of the next frame */
+    size_t      tc_rlen;                /* end of the received data */
+} tcp_conn_t;
+
+typedef struct tcp_peer_s {
+    int         tp_fd;                  /* connection we send on, or -1 */
+    uint64      tp_retry_at;            /* next connect attempt (usec) */
+    bool_t      tp_connecting;          /* a connection to it is coming up */
+    bool_t      tp_wait;                /* waits for room on tp_fd */
+    uint8      *tp_obuf;                /* queued frames */
+    size_t      tp_olen;
+    size_t      tp_odone;               /* bytes of them already written */
+    size_t      tp_osize;
+} tcp_peer_t;
+
+static tcp_peer_t * tcp_peers = NULL;   /* indexed by proc id */
+static tcp_conn_t * tcp_conns = NULL;
+static size_t tcp_conns_len = 0;
+static int tcp_listen_fd = -1;
+static bool_t tcp_pending = FALSE;      /* some peer has queued frames */
+
+static inline bool_t tcp_peer_ok(proc_id_t pid)
+{
+    return pid <= nodes_count && nodes[pid].tcp_link && pid != proc_id;
+}
+
+static tcp_conn_t * tcp_conn_find(int fd)
+{
+    size_t ix;
+
+    for (ix = 0; ix < tcp_conns_len; ix++) {
+        if (tcp_conns[ix].tc_fd == fd) {
+            return &tcp_conns[ix];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Start receiving on a new connection.
+ */
+static int tcp_conn_add(int fd, proc_id_t pid)
+{
+    tcp_conn_t * conn = tcp_conn_find(-1);
+    int one = 1;
+
+    if (!conn) {
+        dbg_err("Too many TCP connections");
+        return ERR_INIT;
+    }
+    if (!(conn->tc_rbuf = malloc(TCP_RBUF_LEN))) {
+        return ERR_MALLOC;
+    }
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    /* ours before it is watched: io_uring must poll it, not receive on it */
+    conn->tc_fd = fd;
+    if (add_input_socket(fd)) {
+        conn->tc_fd = -1;
+        safe_free(conn->tc_rbuf);
+        return ERR_INIT;
+    }
+
+    conn->tc_pid = pid;
+    conn->tc_fresh = (pid == TCP_PID_UNKNOWN);
+    conn->tc_connecting = FALSE;
+    conn->tc_rpos = conn->tc_rlen = 0;
+    return 0;
+}
+
+/*
+ * Sends over UDP the frames queued for a peer that were not written, the
+ * one written in part included, and empties its output buffer.
+ * Those written may still be lost with the connection.
+ */
+static void tcp_peer_fallback(proc_id_t pid)
+{
+    tcp_peer_t * peer = &tcp_peers[pid];
+    size_t pos;
+    uint32 flen;
+
+    for (pos = 0; pos < peer->tp_olen; pos += TCP_FRAME_HDR + flen) {
+        memcpy(&flen, peer->tp_obuf + pos, TCP_FRAME_HDR);
+        flen = ntohl(flen);
+        if (pos + TCP_FRAME_HDR + flen > peer->tp_odone) {
+            dme_send_udp(pid, peer->tp_obuf + pos + TCP_FRAME_HDR, flen);
+        }
+    }
+    if (peer->tp_olen > peer->tp_odone) {
+        dbg_msg("Sent %u bytes to %llu over UDP instead",
+                peer->tp_olen - peer->tp_odone, pid);
+    }
+    peer->tp_olen = peer->tp_odone = 0;
+    peer->tp_wait = FALSE;
+}
+
+static void tcp_conn_close(tcp_conn_t * conn)
+{
+    dbg_msg("Closing TCP connection from %llu", conn->tc_pid);
+
+    if (conn->tc_connecting) {
+        tcp_peers[conn->tc_pid].tp_connecting = FALSE;
+    }
+    if (conn->tc_pid != TCP_PID_UNKNOWN
+        && tcp_peers[conn->tc_pid].tp_fd == conn->tc_fd) {
+        tcp_peers[conn->tc_pid].tp_fd = -1;
+        tcp_peer_fallback(conn->tc_pid);
+    }
+
+    remove_input_socket(conn->tc_fd);
+    close(conn->tc_fd);
+    safe_free(conn->tc_rbuf);
+    conn->tc_fd = -1;
+}
+
+/*
+ * Starts connecting to a peer. The socket is watched first, so that it is
+ * non-blocking and tcp_conn_ready() hears of the outcome.
+ */
+static void tcp_link_connect(proc_id_t dest)
+{
+    tcp_conn_t * conn = NULL;
+    int fd;
+
+    if (0 > (fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP))) {
+        dbg_err("Could not create a TCP socket");
+        return;
+    }
+    if (tcp_conn_add(fd, dest)) {
+        close(fd);
+        return;
+    }
+    conn = tcp_conn_find(fd);
+
+    if (connect(fd, (const struct sockaddr *)&nodes[dest].listen_addr,
+                sizeof(nodes[dest].listen_addr))
+        && errno != EINPROGRESS) {
+        /* The peer is not up yet */
+        tcp_conn_close(conn);
+        return;
+    }
+
+    conn->tc_connecting = TRUE;
+    tcp_peers[dest].tp_connecting = TRUE;
+    watch_output_socket(fd, TRUE);
+}
+
+/*
+ * Completes our connection once connect() is done, introducing ourselves.
+ * Returns FALSE if it is not up (the connection is closed if it failed).
+ */
+static bool_t tcp_conn_ready(tcp_conn_t * conn)
+{
+    struct pollfd pfd = { .fd = conn->tc_fd, .events = POLLOUT };
+    uint64 hello = htonq(proc_id);
+    socklen_t optlen = sizeof(int);
+    int err = 0;
+
+    if (0 == poll(&pfd, 1, 0)) {
+        return FALSE;
+    }
+    if (getsockopt(conn->tc_fd, SOL_SOCKET, SO_ERROR, &err, &optlen) || err
+        || TCP_HELLO_LEN != write(conn->tc_fd, &hello, TCP_HELLO_LEN)) {
+        /* The peer is not up yet */
+        tcp_conn_close(conn);
+        return FALSE;
+    }
+
+    conn->tc_connecting = FALSE;
+    tcp_peers[conn->tc_pid].tp_connecting = FALSE;
+    watch_output_socket(conn->tc_fd, FALSE);
+
+    dbg_msg("TCP connection to %llu is up", conn->tc_pid);
+    /* send on it, unless the peer's connection came up first */
+    if (tcp_peers[conn->tc_pid].tp_fd < 0) {
+        tcp_peers[conn->tc_pid].tp_fd = conn->tc_fd;
+    }
+    return TRUE;
+}
+
+/*
+ * Opens the TCP listening socket of this site. The caller watches the
+ * returned fd.
+ */
+int tcp_link_init(int * out_fd)
+{
+    int one = 1;
+    size_t ix;
+
+    tcp_peers = calloc(nodes_count + 1, sizeof(tcp_peer_t));
+    tcp_conns_len = 2 * (nodes_count + 1);
+    tcp_conns = calloc(tcp_conns_len, sizeof(tcp_conn_t));
+    if (!tcp_peers || !tcp_conns) {
+        return ERR_MALLOC;
+    }
+    for (ix = 0; ix <= nodes_count; ix++) {
+        tcp_peers[ix].tp_fd = -1;
+    }
+    for (ix = 0; ix < tcp_conns_len; ix++) {
+        tcp_conns[ix].tc_fd = -1;
+    }
+
+    if (0 > (tcp_listen_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP))) {
+        dbg_err("Could not create the TCP listening socket");
+        return ERR_INIT;
+    }
+    setsockopt(tcp_listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    if (bind(tcp_listen_fd, (const struct sockaddr *)&nodes[proc_id].listen_addr,
+             sizeof(nodes[proc_id].listen_addr))
+        || listen(tcp_listen_fd, nodes_count + 1)) {
+        dbg_err("Could not listen for TCP connections");
+        close(tcp_listen_fd);
+        tcp_listen_fd = -1;
+        return ERR_INIT;
+    }
+
+    *out_fd = tcp_listen_fd;
+    return 0;
+}
+
+void tcp_link_deinit(void)
+{
+    size_t ix;
+
+    if (!tcp_peers) {
+        return;
+    }
+
+    tcp_link_flush();
+
+    for (ix = 0; ix < tcp_conns_len; ix++) {
+        if (tcp_conns[ix].tc_fd >= 0) {
+            tcp_conn_close(&tcp_conns[ix]);
+        }
+    }
+    for (ix = 0; ix <= nodes_count; ix++) {
+        safe_free(tcp_peers[ix].tp_obuf);
+    }
+    safe_free(tcp_peers);
+    safe_free(tcp_conns);
+    tcp_conns_len = 0;
+
+    if (tcp_listen_fd >= 0) {
+        close(tcp_listen_fd);
+        tcp_listen_fd = -1;
+    }
+}
+
+/*
+ * Queues a message to dest, to be written by tcp_link_flush().
+ * Returns FALSE if dest is not reachable this way; the caller must use UDP.
+ */
+bool_t tcp_link_send(proc_id_t dest, const uint8 * buff, size_t len)
+{
+    tcp_peer_t * peer = NULL;
+    struct timespec ts;
+    uint64 now;
+    uint32 hdr = htonl(len);
+    uint8 * obuf = NULL;
+    size_t size;
+
+    if (!tcp_peers || !tcp_peer_ok(dest) || len > TCP_MAX_FRAME) {
+        return FALSE;
+    }
+
+    peer = &tcp_peers[dest];
+    if (peer->tp_fd < 0) {
+        /* not connected: try now and then, UDP meanwhile */
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        now = (uint64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+        if (!peer->tp_connecting && now >= peer->tp_retry_at) {
+            peer->tp_retry_at = now + TCP_RETRY_USEC;
+            tcp_link_connect(dest);
+        }
+        return FALSE;
+    }
+
+    if (peer->tp_olen + TCP_FRAME_HDR + len > peer->tp_osize) {
+        size = 2 * (peer->tp_olen + TCP_FRAME_HDR + len);
+        if (!(obuf = realloc(peer->tp_obuf, size))) {
+            dbg_err("Could not grow the output buffer to %u", size);
+            return FALSE;
+        }
+        peer->tp_obuf = obuf;
+        peer->tp_osize = size;
+    }
+
+    memcpy(peer->tp_obuf + peer->tp_olen, &hdr, TCP_FRAME_HDR);
+    memcpy(peer->tp_obuf + peer->tp_olen + TCP_FRAME_HDR, buff, len);
+    peer->tp_olen += TCP_FRAME_HDR + len;
+    tcp_pending = TRUE;
+    return TRUE;
+}
+
+/*
+ * Drops the frames written out from the output buffer of a peer.
+ */
+static void tcp_peer_trim(tcp_peer_t * peer)
+{
+    size_t pos = 0;
+    uint32 flen;
+
+    if (peer->tp_odone == peer->tp_olen) {
+        peer->tp_olen = peer->tp_odone = 0;
+        return;
+    }
+    while (1) {
+        memcpy(&flen, peer->tp_obuf + pos, TCP_FRAME_HDR);
+        flen = ntohl(flen);
+        if (pos + TCP_FRAME_HDR + flen > peer->tp_odone) {
+            break;
+        }
+        pos += TCP_FRAME_HDR + flen;
+    }
+    if (pos > 0) {
+        memmove(peer->tp_obuf, peer->tp_obuf + pos, peer->tp_olen - pos);
+        peer->tp_olen -= pos;
+        peer->tp_odone -= pos;
+    }
+}
+
+/*
+ * Writes out all the queued frames, one write per peer.
+ * If a peer is slow to read, the rest waits for room in its socket.
+ */
+void tcp_link_flush(void)
+{
+    tcp_peer_t * peer = NULL;
+    size_t ix;
+    ssize_t ret;
+
+    if (!tcp_pending) {
+        return;
+    }
+    tcp_pending = FALSE;
+
+    for (ix = 0; ix <= nodes_count; ix++) {
+        peer = &tcp_peers[ix];
+        if (peer->tp_olen == 0 || peer->tp_wait) {
+            continue;
+        }
+
+        while (peer->tp_odone < peer->tp_olen) {
+            ret = write(peer->tp_fd, peer->tp_obuf + peer->tp_odone,
+                        peer->tp_olen - peer->tp_odone);
+            if (ret >= 0) {
+                peer->tp_odone += ret;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                /* see tcp_link_recv() */
+                peer->tp_wait = TRUE;
+                watch_output_socket(peer->tp_fd, TRUE);
+                break;
+            } else if (errno != EINTR) {
+                dbg_err("Lost the TCP connection to %u", ix);
+                tcp_conn_close(tcp_conn_find(peer->tp_fd));
+                break;
+            }
+        }
+        tcp_peer_trim(peer);
+    }
+}
+
+bool_t tcp_link_owns(int fd)
+{
+    return tcp_peers && fd >= 0 && (fd == tcp_listen_fd || tcp_conn_find(fd));
+}
+
+/*
+ * Receives up to max messages from a connection, reading as much as is
+ * ready. Returns the number of messages.
+ */
+static unsigned int tcp_conn_recv(tcp_conn_t * conn, buff_t * out_buffs,
+                                  unsigned int max)
+{
+    int fd = conn->tc_fd;
+    unsigned int count = 0;
+    uint64 hello;
+    uint32 flen;
+    size_t avail;
+    ssize_t ret;
+
+    while (1) {
+        /* take the complete frames */
+        while (count < max) {
+            avail = conn->tc_rlen - conn->tc_rpos;
+
+            if (conn->tc_pid == TCP_PID_UNKNOWN) {
+                if (avail < TCP_HELLO_LEN) {
+                    break;
+                }
+                memcpy(&hello, conn->tc_rbuf + conn->tc_rpos, TCP_HELLO_LEN);
+                conn->tc_rpos += TCP_HELLO_LEN;
+                conn->tc_pid = ntohq(hello);
+                if (!tcp_peer_ok(conn->tc_pid)) {
+                    dbg_err("TCP connection from unexpected process %llu",
+                            conn->tc_pid);
+                    conn->tc_pid = TCP_PID_UNKNOWN;
+                    tcp_conn_close(conn);
+                    goto out;
+                }
+                /* send on it too, unless we connected first */
+                if (tcp_peers[conn->tc_pid].tp_fd < 0) {
+                    tcp_peers[conn->tc_pid].tp_fd = fd;
+                }
+                continue;
+            }
+
+            if (avail < TCP_FRAME_HDR) {
+                break;
+            }
+            memcpy(&flen, conn->tc_rbuf + conn->tc_rpos, TCP_FRAME_HDR);
+            flen = ntohl(flen);
+            if (flen > TCP_MAX_FRAME) {
+                dbg_err("Bad frame length %u from %llu", flen, conn->tc_pid);
+                tcp_conn_close(conn);
+                goto out;
+            }
+            if (avail < TCP_FRAME_HDR + flen) {
+                break;
+            }
+            if (!dme_buff_alloc(&out_buffs[count], flen)) {
+                goto out;
+            }
+            memcpy(out_buffs[count].data,
+                   conn->tc_rbuf + conn->tc_rpos + TCP_FRAME_HDR, flen);
+            conn->tc_rpos += TCP_FRAME_HDR + flen;
+            count++;
+        }
+
+        if (count == max) {
+            break;
+        }
+
+        /* make room and read some more */
+        if (conn->tc_rpos > 0) {
+            memmove(conn->tc_rbuf, conn->tc_rbuf + conn->tc_rpos,
+                    conn->tc_rlen - conn->tc_rpos);
+            conn->tc_rlen -= conn->tc_rpos;
+            conn->tc_rpos = 0;
+        }
+
+        ret = read(fd, conn->tc_rbuf + conn->tc_rlen,
+                   TCP_RBUF_LEN - conn->tc_rlen);
+        if (ret > 0) {
+            conn->tc_rlen += ret;
+        } else if (ret < 0 && errno == EINTR) {
+            continue;
+        } else {
+            if (ret == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                tcp_conn_close(conn);
+            } else {
+                conn->tc_fresh = FALSE;
+            }
+            break;
+        }
+    }
+
+out:
+    return count;
+}
+
+/*
+ * Receives up to max messages from a connection, once it is up. Whether
+ * it became readable or writable, the frames waiting for room on it are
+ * written again with the next flush.
+ * A ready listening socket accepts the new connections and returns what
+ * they sent so far: with signals, data that arrived before the connection
+ * was watched would not raise one.
+ */
+int tcp_link_recv(int fd, buff_t * out_buffs, unsigned int max,
+                  unsigned int * out_count)
+{
+    tcp_conn_t * conn = NULL;
+    unsigned int count = 0;
+    size_t ix;
+    int afd;
+
+    *out_count = 0;
+
+    if (fd != tcp_listen_fd) {
+        if (!(conn = tcp_conn_find(fd))) {
+            return ERR_RECV_MSG;
+        }
+        if (conn->tc_connecting && !tcp_conn_ready(conn)) {
+            return 0;
+        }
+        if (conn->tc_pid != TCP_PID_UNKNOWN
+            && tcp_peers[conn->tc_pid].tp_fd == fd
+            && tcp_peers[conn->tc_pid].tp_wait) {
+            tcp_peers[conn->tc_pid].tp_wait = FALSE;
+            watch_output_socket(fd, FALSE);
+            tcp_pending = TRUE;
+        }
+        *out_count = tcp_conn_recv(conn, out_buffs, max);
+        return 0;
+    }
+
+    while (0 <= (afd = accept(tcp_listen_fd, NULL, NULL))) {
+        if (tcp_conn_add(afd, TCP_PID_UNKNOWN)) {
+            close(afd);
+        }
+    }
+
+    for (ix = 0; ix < tcp_conns_len && count < max; ix++) {
+        if (tcp_conns[ix].tc_fd >= 0 && tcp_conns[ix].tc_fresh) {
+            count += tcp_conn_recv(&tcp_conns[ix], out_buffs + count,
+                                   max - count);
+        }
+    }
+
+    *out_count = count;
+    return 0;
+}
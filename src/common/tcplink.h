@@ -0,0 +1,27 @@
+/*
+ * src/common/tcplink.h
+ *
+ * TCP stream transport: one persistent connection per pair of sites.
+ *
+ * -------------------------------------------------------------------------
+ */
+
+#ifndef TCPLINK_H_
+#define TCPLINK_H_
+
+#include <common/defs.h>
+
+/* Longest message a frame can carry */
+#define TCP_MAX_FRAME   (65536)
+
+extern int    tcp_link_init(int * out_fd);
+extern void   tcp_link_deinit(void);
+
+extern bool_t tcp_link_send(proc_id_t dest, const uint8 * buff, size_t len);
+extern void   tcp_link_flush(void);
+
+extern bool_t tcp_link_owns(int fd);
+extern int    tcp_link_recv(int fd, buff_t * out_buffs, unsigned int max,
+                            unsigned int * out_count);
+
+#endif /* TCPLINK_H_ */
@@ -0,0 +1,217 @@
+/*
+ * src/common/trace.c
+ *
+ * MSC trace of the sent messages.
+ *
+ * -------------------------------------------------------------------------
+ */
+
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include <common/trace.h>
+
+/*
+ * Sending a message only appends a fixed size record to a ring; no
+ * formatting and no I/O. The ring is written out in one go by
+ * trace_flush(), which the event loop calls before it waits (and which is
+ * called right away if the ring fills up).
+ *
+ * If DME_TRACE names a file the raw records are appended to it (several
+ * processes can share one file) and build/msctrace turns them into text.
+ * Otherwise the records are printed as MSC text on stdout when flushed.
+ */
+
+#define TRACE_RING_LEN  (1024)
+
+static trace_rec_t trace_ring[TRACE_RING_LEN];
+static uint32 trace_count = 0;
+
+static bool_t trace_ready = FALSE;
+static int trace_fd = -1;               /* -1: text on stdout */
+
+static void trace_init(void)
+{
+    const char * path = getenv(TRACE_ENV);
+
+    trace_ready = TRUE;
+    if (!path || !*path) {
+        return;
+    }
+
+    if (0 > (trace_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644))) {
+        dbg_err("Could not open trace file %s. Tracing to stdout.", path);
+    }
+}
+
+/*
+ * Appends a record of a message, with no destinations yet.
+ */
+static trace_rec_t * trace_rec_add(proc_id_t srcid, const struct timespec * ts,
+                                   const char * msctext, uint16 block)
+{
+    trace_rec_t * rec = NULL;
+    size_t len = strlen(msctext);
+
+    if (trace_count == TRACE_RING_LEN) {
+        trace_flush();
+    }
+
+    rec = &trace_ring[trace_count++];
+    rec->tr_sec = ts->tv_sec;
+    rec->tr_nsec = ts->tv_nsec;
+    rec->tr_src = srcid;
+    rec->tr_block = block;
+    rec->tr_dsts = 0;
+
+    /* long texts are cut */
+    if (len >= TRACE_TEXT_LEN) {
+        len = TRACE_TEXT_LEN - 1;
+    }
+    memcpy(rec->tr_text, msctext, len);
+    rec->tr_text[len] = '\0';
+    rec->tr_len = len;
+    return rec;
+}
+
+/*
+ * Record a message sent from srcid to each of the count destinations in
+ * dstids. Consecutive destinations of the same block share a record, so
+ * a broadcast in id order takes one record per TRACE_REC_DSTS sites.
+ */
+void trace_msg(proc_id_t srcid, const proc_id_t * dstids, size_t count,
+               const char * msctext)
+{
+    struct timespec ts;
+    trace_rec_t * rec = NULL;
+    size_t ix;
+
+    if (!trace_ready) {
+        trace_init();
+    }
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    for (ix = 0; ix < count; ix++) {
+        if (!rec || rec->tr_block != dstids[ix] / TRACE_REC_DSTS) {
+            rec = trace_rec_add(srcid, &ts, msctext,
+                                dstids[ix] / TRACE_REC_DSTS);
+        }
+        rec->tr_dsts |= 1ULL << (dstids[ix] % TRACE_REC_DSTS);
+    }
+}
+
+/*
+ * Write out the recorded messages.
+ */
+void trace_flush(void)
+{
+    const uint8 * px = (const uint8 *)trace_ring;
+    size_t left = trace_count * sizeof(trace_rec_t);
+    ssize_t ret;
+    uint32 ix;
+
+    if (trace_count == 0) {
+        return;
+    }
+
+    if (trace_fd < 0) {
+        for (ix = 0; ix < trace_count; ix++) {
+            trace_print(stdout, &trace_ring[ix]);
+        }
+        fflush(stdout);
+    } else {
+        while (left > 0) {
+            if (0 > (ret = write(trace_fd, px, left))) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                dbg_err("Could not write the trace file");
+                break;
+            }
+            px += ret;
+            left -= ret;
+        }
+    }
+
+    trace_count = 0;
+}
+
+void trace_deinit(void)
+{
+    trace_flush();
+    if (trace_fd >= 0) {
+        close(trace_fd);
+        trace_fd = -1;
+    }
+    trace_ready = FALSE;
+}
+
+/*
+ * Print a record as MSC text lines, for each destination:
+ * <sec>.<nsec> <line> # p<src>->p<dst>: <text>
+ * followed by a line for each MSC command in the text.
+ */
+void trace_print(FILE * fh, const trace_rec_t * rec)
+{
+    const char * px = NULL;
+    const char * sx = NULL;
+    char linebuf[TRACE_TEXT_LEN];
+    int linecnt = 0;
+    proc_id_t srcid = rec->tr_src;
+    proc_id_t dstid;
+    uint32 bit;
+
+    for (bit = 0; bit < TRACE_REC_DSTS; bit++) {
+        if (!(rec->tr_dsts & (1ULL << bit))) {
+            continue;
+        }
+        dstid = (proc_id_t)rec->tr_block * TRACE_REC_DSTS + bit;
+
+        sx = rec->tr_text;
+        linecnt = 0;
+
+        bzero(linebuf, sizeof(linebuf));
+        px = strchr(sx, MSC_SEP);
+
+        if (px == NULL) {
+            /* Print to the end of the string */
+            snprintf(linebuf, sizeof(linebuf), "%s", sx);
+        } else {
+            /* Print to next line, the size counts the terminating NUL */
+            snprintf(linebuf, px - sx + 1, "%s", sx);
+        }
+
+        fprintf(fh, "%09u.%09u %02d # p%llu->p%llu: %s\n",
+                rec->tr_sec, rec->tr_nsec, linecnt,
+                srcid, dstid, linebuf);
+        linecnt++;
+
+        /* Print other MSC commands */
+        while (px != NULL) {
+            sx = ++px;
+            px = strchr(sx, MSC_SEP);
+
+            if (0 == strncmp(sx, "activate_src", 12)) {
+                fprintf(fh, "%09u.%09u %02d # activate p%llu\n",
+                        rec->tr_sec, rec->tr_nsec, linecnt, srcid);
+            }
+            else if (0 == strncmp(sx, "activate_dst", 12)) {
+                fprintf(fh, "%09u.%09u %02d # activate p%llu\n",
+                        rec->tr_sec, rec->tr_nsec, linecnt, dstid);
+            }
+            else if (0 == strncmp(sx, "deactivate_src", 14)) {
+                fprintf(fh, "%09u.%09u %02d # deactivate p%llu\n",
+                        rec->tr_sec, rec->tr_nsec, linecnt, srcid);
+            }
+            else if (0 == strncmp(sx, "deactivate_dst", 14)) {
+                fprintf(fh, "%09u.%09u %02d # deactivate p%llu\n",
+                        rec->tr_sec, rec->tr_nsec, linecnt, dstid);
+            }
+
+            linecnt++;
+        }
+    }
+}
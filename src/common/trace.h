@@ -0,0 +1,50 @@
+/*
+ * src/common/trace.h
+ *
+ * MSC trace of the sent messages.
+ *
+ * -------------------------------------------------------------------------
+ */
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdio.h>
+#include <common/defs.h>
+
+/* Separates the message text from the MSC commands (activate_src, ...) */
+#define MSC_SEP '|'
+
+/* File to write binary trace records to, instead of text on stdout */
+#define TRACE_ENV       "DME_TRACE"
+
+#define TRACE_REC_LEN   (256)
+#define TRACE_TEXT_LEN  (TRACE_REC_LEN - 24)
+#define TRACE_REC_DSTS  (64)            /* destinations a record can hold */
+
+/*
+ * A binary trace record: one message sent to a set of destinations, all
+ * in the same block of TRACE_REC_DSTS process ids; a message sent to
+ * several blocks takes a record per block.
+ * All fields are in host order; the converter runs on the same host.
+ */
+struct trace_rec_s {
+    uint32      tr_sec;                 /* CLOCK_REALTIME send time */
+    uint32      tr_nsec;
+    uint32      tr_src;                 /* sender process id */
+    uint16      tr_len;                 /* text length */
+    uint16      tr_block;               /* of the destinations */
+    uint64      tr_dsts;                /* bit i set: sent to process
+                                         * tr_block * TRACE_REC_DSTS + i */
+    char        tr_text[TRACE_TEXT_LEN];
+} PACKED;
+typedef struct trace_rec_s trace_rec_t;
+
+extern void trace_msg(proc_id_t srcid, const proc_id_t * dstids, size_t count,
+                      const char * msctext);
+extern void trace_flush(void);
+extern void trace_deinit(void);
+
+extern void trace_print(FILE * fh, const trace_rec_t * rec);
+
+#endif /* TRACE_H_ */
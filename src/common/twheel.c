@@ -0,0 +1,380 @@
+/*
+ * src/common/twheel.c
+ *
+ * Hierarchical timing wheel used to multiplex all the scheduled events
+ * on a single kernel timer.
+ *
+ * -------------------------------------------------------------------------
+ */
+
+#include <string.h>
+#include <common/twheel.h>
+
+/*
+ * A timer lives in the level given by the most significant slot digit in
+ * which its expire time differs from the wheel time (tw_now), in the slot
+ * given by that digit. So every linked timer sits in a slot "after" the
+ * current digit of its level and the first non empty slot of the lowest
+ * non empty level is always the next one to process.
+ * Processing a slot of a level above 0 cascades its timers to lower levels.
+ */
+typedef enum tw_state_e {
+    TW_FREE = 0,                        /* in the free list */
+    TW_PENDING,                         /* linked in the wheel */
+    TW_FIRED,                           /* expired, waiting to be claimed */
+} tw_state_t;
+
+struct tw_timer_s {
+    tw_timer_t *tw_next;
+    tw_timer_t *tw_prev;
+    uint64      tw_expires;             /* absolute expire time in usec */
+    dme_ev_t    tw_event;
+    void       *tw_cookie;
+    uint32      tw_id;                  /* index among all allocated timers */
+    uint32      tw_gen;                 /* generation, bumped on every reuse */
+    uint8       tw_state;
+    uint8       tw_level;
+    uint8       tw_slot;
+};
+
+#define TW_SLOT_MASK    (TW_SLOTS - 1)
+#define TW_TOP_LEVEL    (TW_LEVELS - 1)
+#define TW_CHUNK_LEN    (256)           /* timers allocated at once */
+
+static tw_timer_t * tw_slots[TW_LEVELS][TW_SLOTS];
+static uint64 tw_bitmap[TW_LEVELS];     /* non empty slots of each level */
+static uint64 tw_now = 0;               /* wheel time */
+
+/* Free timers and the chunks they were allocated in */
+static tw_timer_t * tw_free = NULL;
+static tw_timer_t ** tw_chunks = NULL;
+static size_t tw_chunks_count = 0;
+
+/*
+ * Timer allocation.
+ * Timers are recycled through a free list which grows by TW_CHUNK_LEN
+ * elements when empty, so there is no fixed limit.
+ */
+static tw_timer_t * tw_timer_alloc(void)
+{
+    tw_timer_t * chunk = NULL;
+    tw_timer_t ** chunks = NULL;
+    tw_timer_t * t = NULL;
+    int ix;
+
+    if (!tw_free) {
+        chunks = realloc(tw_chunks, (tw_chunks_count + 1) * sizeof(*tw_chunks));
+        if (!chunks) {
+            return NULL;
+        }
+        tw_chunks = chunks;
+
+        if (!(chunk = calloc(TW_CHUNK_LEN, sizeof(tw_timer_t)))) {
+            return NULL;
+        }
+
+        for (ix = TW_CHUNK_LEN - 1; ix >= 0; ix--) {
+            chunk[ix].tw_id = tw_chunks_count * TW_CHUNK_LEN + ix;
+            chunk[ix].tw_next = tw_free;
+            tw_free = &chunk[ix];
+        }
+        tw_chunks[tw_chunks_count++] = chunk;
+    }
+
+    t = tw_free;
+    tw_free = t->tw_next;
+
+    /* generation 0 is never used so that no handle equals TW_HANDLE_NONE */
+    if (++t->tw_gen == 0) {
+        t->tw_gen = 1;
+    }
+    return t;
+}
+
+static void tw_timer_release(tw_timer_t * t)
+{
+    t->tw_state = TW_FREE;
+    t->tw_next = tw_free;
+    tw_free = t;
+}
+
+static inline tw_handle_t tw_handle(const tw_timer_t * t)
+{
+    return ((tw_handle_t)t->tw_gen << 32) | t->tw_id;
+}
+
+/*
+ * Gets the timer a handle refers to, or NULL if the handle is stale.
+ */
+static tw_timer_t * tw_lookup(tw_handle_t timer)
+{
+    uint32 id = (uint32)timer;
+    uint32 gen = (uint32)(timer >> 32);
+    tw_timer_t * t = NULL;
+
+    if (timer == TW_HANDLE_NONE || id >= tw_chunks_count * TW_CHUNK_LEN) {
+        return NULL;
+    }
+
+    t = &tw_chunks[id / TW_CHUNK_LEN][id % TW_CHUNK_LEN];
+    if (t->tw_gen != gen || t->tw_state == TW_FREE) {
+        return NULL;
+    }
+    return t;
+}
+
+/*
+ * Link a timer in its slot. The expire time must be after tw_now.
+ */
+static void tw_link(tw_timer_t * t)
+{
+    uint64 diff = t->tw_expires ^ tw_now;
+    int level = (63 - __builtin_clzll(diff)) / TW_SLOT_BITS;
+    int slot;
+
+    if (level > TW_TOP_LEVEL) {
+        level = TW_TOP_LEVEL;
+    }
+    slot = (t->tw_expires >> (level * TW_SLOT_BITS)) & TW_SLOT_MASK;
+
+    t->tw_state = TW_PENDING;
+    t->tw_level = level;
+    t->tw_slot = slot;
+    t->tw_prev = NULL;
+    t->tw_next = tw_slots[level][slot];
+    if (t->tw_next) {
+        t->tw_next->tw_prev = t;
+    }
+    tw_slots[level][slot] = t;
+    tw_bitmap[level] |= 1ULL << slot;
+}
+
+/*
+ * Remove a pending timer from its slot.
+ */
+static void tw_unlink(tw_timer_t * t)
+{
+    if (t->tw_prev) {
+        t->tw_prev->tw_next = t->tw_next;
+    } else {
+        tw_slots[t->tw_level][t->tw_slot] = t->tw_next;
+        if (!t->tw_next) {
+            tw_bitmap[t->tw_level] &= ~(1ULL << t->tw_slot);
+        }
+    }
+
+    if (t->tw_next) {
+        t->tw_next->tw_prev = t->tw_prev;
+    }
+}
+
+/*
+ * Clamps an expire time to (tw_now .. tw_now + TW_MAX_DELAY]
+ */
+static inline uint64 tw_clamp(uint64 expires)
+{
+    if (expires <= tw_now) {
+        return tw_now + 1;
+    } else if (expires - tw_now > TW_MAX_DELAY) {
+        return tw_now + TW_MAX_DELAY;
+    }
+    return expires;
+}
+
+/*
+ * Finds the next slot to be processed and the wheel time at which it starts.
+ * Returns FALSE if the wheel is empty.
+ */
+static bool_t tw_next_slot(int * out_level, int * out_slot, uint64 * out_start)
+{
+    int level;
+    int shift;
+    int cur;
+    uint64 base;
+    uint64 later;
+
+    for (level = 0; level < TW_LEVELS; level++) {
+        if (!tw_bitmap[level]) {
+            continue;
+        }
+
+        shift = level * TW_SLOT_BITS;
+        cur = (tw_now >> shift) & TW_SLOT_MASK;
+        base = tw_now & ~((1ULL << (shift + TW_SLOT_BITS)) - 1);
+        later = (cur == TW_SLOT_MASK) ? 0 : tw_bitmap[level] & (~0ULL << (cur + 1));
+
+        if (later) {
+            *out_slot = __builtin_ctzll(later);
+        } else {
+            /* Only the top level wraps around */
+            *out_slot = __builtin_ctzll(tw_bitmap[level]);
+            base += 1ULL << (shift + TW_SLOT_BITS);
+        }
+
+        *out_level = level;
+        *out_start = base + ((uint64)*out_slot << shift);
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+void twheel_init(uint64 now)
+{
+    memset(tw_slots, 0, sizeof(tw_slots));
+    memset(tw_bitmap, 0, sizeof(tw_bitmap));
+    tw_now = now;
+}
+
+void twheel_deinit(void)
+{
+    size_t ix;
+
+    for (ix = 0; ix < tw_chunks_count; ix++) {
+        safe_free(tw_chunks[ix]);
+    }
+    safe_free(tw_chunks);
+    tw_chunks_count = 0;
+    tw_free = NULL;
+
+    memset(tw_slots, 0, sizeof(tw_slots));
+    memset(tw_bitmap, 0, sizeof(tw_bitmap));
+}
+
+/*
+ * Add a timer that expires at 'expires' (absolute usec). Delays longer than
+ * TW_MAX_DELAY are clamped.
+ * Returns TW_HANDLE_NONE if no timer could be allocated.
+ */
+tw_handle_t twheel_add(uint64 expires, dme_ev_t event, void * cookie)
+{
+    tw_timer_t * t = NULL;
+
+    if (!(t = tw_timer_alloc())) {
+        dbg_err("Could not allocate a timer");
+        return TW_HANDLE_NONE;
+    }
+
+    t->tw_expires = tw_clamp(expires);
+    t->tw_event = event;
+    t->tw_cookie = cookie;
+    tw_link(t);
+
+    return tw_handle(t);
+}
+
+/*
+ * Delete a pending or fired (but not claimed) timer.
+ * Returns FALSE if the handle is stale.
+ */
+bool_t twheel_del(tw_handle_t timer)
+{
+    tw_timer_t * t = tw_lookup(timer);
+
+    if (!t) {
+        return FALSE;
+    }
+
+    if (t->tw_state == TW_PENDING) {
+        tw_unlink(t);
+    }
+    tw_timer_release(t);
+    return TRUE;
+}
+
+/*
+ * Move a pending or fired (but not claimed) timer to a new expire time.
+ * The handle stays the same. Returns FALSE if the handle is stale.
+ */
+bool_t twheel_mod(tw_handle_t timer, uint64 expires)
+{
+    tw_timer_t * t = tw_lookup(timer);
+
+    if (!t) {
+        return FALSE;
+    }
+
+    if (t->tw_state == TW_PENDING) {
+        tw_unlink(t);
+    }
+    t->tw_expires = tw_clamp(expires);
+    tw_link(t);
+    return TRUE;
+}
+
+/*
+ * Release a fired timer, getting its event and cookie.
+ * Returns FALSE if the timer was deleted or rescheduled since it fired.
+ */
+bool_t twheel_claim(tw_handle_t timer, dme_ev_t * out_event, void ** out_cookie)
+{
+    tw_timer_t * t = tw_lookup(timer);
+
+    if (!t || t->tw_state != TW_FIRED) {
+        return FALSE;
+    }
+
+    *out_event = t->tw_event;
+    *out_cookie = t->tw_cookie;
+    tw_timer_release(t);
+    return TRUE;
+}
+
+/*
+ * Gets the time at which the wheel must next be processed.
+ * Returns FALSE if there are no timers.
+ */
+bool_t twheel_next_expiry(uint64 * out_expires)
+{
+    int level;
+    int slot;
+
+    return tw_next_slot(&level, &slot, out_expires);
+}
+
+/*
+ * Advance the wheel to 'now', calling fire() for every expired timer in
+ * order of expiration. Fired timers must be claimed (or deleted) afterwards.
+ */
+void twheel_expire(uint64 now, twheel_fire_fnct_t fire)
+{
+    tw_timer_t * t = NULL;
+    tw_timer_t * next = NULL;
+    tw_timer_t * px = NULL;
+    int level;
+    int slot;
+    uint64 start;
+
+    while (tw_next_slot(&level, &slot, &start) && start <= now) {
+        tw_now = start;
+
+        /* unlink the whole slot, reversing it to get the insertion order */
+        for (t = tw_slots[level][slot], next = NULL; t; ) {
+            px = t->tw_next;
+            t->tw_next = next;
+            next = t;
+            t = px;
+        }
+        t = next;
+        tw_slots[level][slot] = NULL;
+        tw_bitmap[level] &= ~(1ULL << slot);
+
+        for (; t; t = next) {
+            next = t->tw_next;
+            if (t->tw_expires <= tw_now) {
+                t->tw_state = TW_FIRED;
+                if (!fire(tw_handle(t))) {
+                    tw_timer_release(t);
+                }
+            } else {
+                /* cascade */
+                tw_link(t);
+            }
+        }
+    }
+
+    /* All the remaining slots start after now */
+    if (now > tw_now) {
+        tw_now = now;
+    }
+}
@@ -0,0 +1,52 @@
+/*
+ * src/common/twheel.h
+ *
+ * Hierarchical timing wheel used to multiplex all the scheduled events
+ * on a single kernel timer.
+ *
+ * -------------------------------------------------------------------------
+ */
+
+#ifndef TWHEEL_H_
+#define TWHEEL_H_
+
+#include <common/defs.h>
+
+/*
+ * The wheel time unit is the microsecond. There are TW_LEVELS levels of
+ * TW_SLOTS slots each. The longest delay that can be scheduled is
+ * (TW_SLOTS - 1) top level slots (about 18 hours). Longer delays are clamped.
+ */
+#define TW_SLOT_BITS    (6)
+#define TW_SLOTS        (1 << TW_SLOT_BITS)
+#define TW_LEVELS       (6)
+#define TW_MAX_DELAY    ((uint64)(TW_SLOTS - 1) << ((TW_LEVELS - 1) * TW_SLOT_BITS))
+
+typedef struct tw_timer_s tw_timer_t;
+
+/*
+ * Timer handles carry a generation number, so a handle to a timer that was
+ * released (claimed or deleted) never matches the timer recycled in its place.
+ */
+typedef uint64 tw_handle_t;
+#define TW_HANDLE_NONE  ((tw_handle_t)0)
+
+/*
+ * Called for every expired timer. The timer stays valid until it is claimed
+ * (or deleted). Returning FALSE releases it right away.
+ */
+typedef bool_t (twheel_fire_fnct_t)(tw_handle_t timer);
+
+extern void twheel_init(uint64 now);
+extern void twheel_deinit(void);
+
+extern tw_handle_t twheel_add(uint64 expires, dme_ev_t event, void * cookie);
+extern bool_t      twheel_del(tw_handle_t timer);
+extern bool_t      twheel_mod(tw_handle_t timer, uint64 expires);
+extern bool_t      twheel_claim(tw_handle_t timer, dme_ev_t * out_event,
+                                void ** out_cookie);
+
+extern bool_t twheel_next_expiry(uint64 * out_expires);
+extern void   twheel_expire(uint64 now, twheel_fire_fnct_t fire);
+
+#endif /* TWHEEL_H_ */
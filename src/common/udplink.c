@@ -0,0 +1,173 @@
+/*
+ * src/common/udplink.c
+ *
+ * Connected UDP sockets: one per peer site.
+ *
+ * -------------------------------------------------------------------------
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+#include <common/udplink.h>
+#include <common/init.h>
+
+/* Global variables from main process */
+extern const link_info_t * const nodes;
+extern const size_t nodes_count;
+extern const proc_id_t proc_id;
+
+/*
+ * With UDP_CONNECT_ENV set every site opens, next to its listening socket,
+ * a UDP socket per peer bound to the same address and port (SO_REUSEPORT)
+ * and connected to the peer's listen address.
+ *
+ * Messages to a peer are sent on its socket, so the kernel looks up the
+ * route once, when connecting, instead of for each datagram. Messages from
+ * a peer arrive on it too, as a connected socket takes the datagrams of its
+ * 4-tuple before the listening one. What still arrives on the listening
+ * socket comes from elsewhere and is only accepted from a site's listen
+ * address (see dme_recv_batch()): that covers the peers which sent before
+ * this site connected to them, and drops the spoofed sources.
+ *
+ * Both ends use their listen address as the source, so a site with these
+ * sockets talks to sites without them as usual.
+ */
+
+static int * udp_fds = NULL;            /* indexed by proc id, -1 if none */
+static int udp_active = -1;             /* not decided yet */
+
+/* The sites' listen addresses as udp_addr_key()s, sorted */
+static uint64 * udp_known = NULL;
+static size_t udp_known_count = 0;
+
+#define udp_addr_key(addr)                                                  \
+    (((uint64)(addr)->sin_addr.s_addr << 16) | (addr)->sin_port)
+
+static int udp_key_cmp(const void * a, const void * b)
+{
+    uint64 ka = *(const uint64 *)a;
+    uint64 kb = *(const uint64 *)b;
+
+    return (ka > kb) - (ka < kb);
+}
+
+bool_t udp_link_active(void)
+{
+    const char * env = NULL;
+
+    if (udp_active < 0) {
+        env = getenv(UDP_CONNECT_ENV);
+        udp_active = env && 0 != strcmp(env, "0");
+        dbg_msg("Connected UDP sockets are %s", udp_active ? "on" : "off");
+    }
+    return udp_active;
+}
+
+/*
+ * Opens the socket connected to a peer's listen address.
+ */
+static int udp_link_connect(proc_id_t dest)
+{
+    int one = 1;
+    int fd = -1;
+
+    if (0 > (fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_UDP))) {
+        dbg_err("Could not allocate a socket for peer %llu", dest);
+        return -1;
+    }
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one))
+        || bind(fd, (const struct sockaddr *)&nodes[proc_id].listen_addr,
+                sizeof(nodes[proc_id].listen_addr))
+        || connect(fd, (const struct sockaddr *)&nodes[dest].listen_addr,
+                   sizeof(nodes[dest].listen_addr))) {
+        dbg_err("Could not connect a socket to peer %llu: %s",
+                dest, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Opens the sockets to all the peers and receives from them. A peer whose
+ * socket could not be opened is reached through the listening socket.
+ */
+int udp_link_init(void)
+{
+    proc_id_t ix;
+    int res = 0;
+
+    if (!udp_link_active()) {
+        return 0;
+    }
+    udp_fds = malloc((nodes_count + 1) * sizeof(int));
+    udp_known = malloc((nodes_count + 1) * sizeof(uint64));
+    if (!udp_fds || !udp_known) {
+        dbg_err("Could not allocate the connected sockets");
+        safe_free(udp_fds);
+        safe_free(udp_known);
+        return ERR_MALLOC;
+    }
+
+    /* for udp_link_known(), once per datagram on the listening socket */
+    for (ix = 0; ix <= nodes_count; ix++) {
+        udp_known[ix] = udp_addr_key(&nodes[ix].listen_addr);
+    }
+    udp_known_count = nodes_count + 1;
+    qsort(udp_known, udp_known_count, sizeof(uint64), udp_key_cmp);
+
+    for (ix = 0; ix <= nodes_count; ix++) {
+        udp_fds[ix] = -1;
+        if (ix == proc_id || nodes[ix].listen_addr.sin_family != AF_INET) {
+            continue;
+        }
+        if (0 > (udp_fds[ix] = udp_link_connect(ix))) {
+            continue;
+        }
+        if (res = add_input_socket(udp_fds[ix])) {
+            close(udp_fds[ix]);
+            udp_fds[ix] = -1;
+            break;
+        }
+    }
+    return res;
+}
+
+void udp_link_deinit(void)
+{
+    proc_id_t ix;
+
+    safe_free(udp_known);
+    udp_known_count = 0;
+
+    if (!udp_fds) {
+        return;
+    }
+    for (ix = 0; ix <= nodes_count; ix++) {
+        if (udp_fds[ix] >= 0) {
+            close(udp_fds[ix]);
+        }
+    }
+    safe_free(udp_fds);
+}
+
+int udp_link_fd(proc_id_t dest)
+{
+    if (udp_fds && udp_fds[dest] >= 0) {
+        return udp_fds[dest];
+    }
+    return nodes[proc_id].sock_fd;
+}
+
+/*
+ * Is addr the listen address of a site ?
+ */
+bool_t udp_link_known(const struct sockaddr_in * addr)
+{
+    uint64 key = udp_addr_key(addr);
+
+    return NULL != bsearch(&key, udp_known, udp_known_count, sizeof(uint64),
+                           udp_key_cmp);
+}
@@ -0,0 +1,25 @@
+/*
+ * src/common/udplink.h
+ *
+ * Connected UDP sockets: one per peer site.
+ *
+ * -------------------------------------------------------------------------
+ */
+
+#ifndef UDPLINK_H_
+#define UDPLINK_H_
+
+#include <common/defs.h>
+
+#define UDP_CONNECT_ENV "DME_UDP_CONNECT"
+
+extern bool_t udp_link_active(void);
+extern int    udp_link_init(void);
+extern void   udp_link_deinit(void);
+
+/* The socket to send to dest on: its connected one or the listening one */
+extern int    udp_link_fd(proc_id_t dest);
+
+extern bool_t udp_link_known(const struct sockaddr_in * addr);
+
+#endif /* UDPLINK_H_ */
@@ -0,0 +1,292 @@
+/*
+ * src/common/uring.c
+ *
+ * Minimal io_uring interface, on the raw system calls.
+ *
+ * -------------------------------------------------------------------------
+ */
+
+#include <common/uring.h>
+
+#ifdef DME_IO_URING
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/*
+ * A single ring, used by the event loop only.
+ * Submission queue entries are filled in place and published all at once
+ * by uring_enter(), which also waits for completions if asked to, so an
+ * event loop iteration can submit everything and wait with one system
+ * call. A full submission queue is submitted as soon as an entry is needed.
+ */
+typedef struct uring_s {
+    int         ur_fd;
+
+    /* submission queue */
+    uint32     *ur_sq_head;
+    uint32     *ur_sq_tail;
+    uint32     *ur_sq_array;
+    uint32      ur_sq_mask;
+    uint32      ur_sq_entries;
+    uint32      ur_sq_local_tail;       /* filled, not yet published */
+    struct io_uring_sqe *ur_sqes;
+
+    /* completion queue */
+    uint32     *ur_cq_head;
+    uint32     *ur_cq_tail;
+    uint32      ur_cq_mask;
+    struct io_uring_cqe *ur_cqes;
+
+    /* mappings */
+    void       *ur_sq_ring;
+    size_t      ur_sq_ring_len;
+    void       *ur_cq_ring;
+    size_t      ur_cq_ring_len;
+    size_t      ur_sqes_len;
+} uring_t;
+
+static uring_t ring = { .ur_fd = -1 };
+
+/* Only one task submits and it waits for completions, let the kernel know */
+#define URING_SETUP_FLAGS   (IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN \
+                             | IORING_SETUP_SINGLE_ISSUER                     \
+                             | IORING_SETUP_DEFER_TASKRUN)
+
+static int uring_setup(unsigned int entries, struct io_uring_params * params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+bool_t uring_active(void)
+{
+    return ring.ur_fd >= 0;
+}
+
+bool_t uring_init(unsigned int entries)
+{
+    struct io_uring_params params;
+    uint8 * sq = NULL;
+    uint8 * cq = NULL;
+
+    memset(&params, 0, sizeof(params));
+    params.flags = URING_SETUP_FLAGS;
+    if (0 > (ring.ur_fd = uring_setup(entries, &params))) {
+        /* older kernels know fewer flags */
+        memset(&params, 0, sizeof(params));
+        ring.ur_fd = uring_setup(entries, &params);
+    }
+    if (ring.ur_fd < 0) {
+        dbg_err("io_uring_setup() failed: %s", strerror(errno));
+        return FALSE;
+    }
+
+    ring.ur_sq_ring_len = params.sq_off.array + params.sq_entries * sizeof(uint32);
+    ring.ur_cq_ring_len = params.cq_off.cqes
+                          + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring.ur_cq_ring_len > ring.ur_sq_ring_len) {
+            ring.ur_sq_ring_len = ring.ur_cq_ring_len;
+        }
+        ring.ur_cq_ring_len = ring.ur_sq_ring_len;
+    }
+
+    ring.ur_sq_ring = mmap(NULL, ring.ur_sq_ring_len, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, ring.ur_fd,
+                           IORING_OFF_SQ_RING);
+    if (ring.ur_sq_ring == MAP_FAILED) {
+        ring.ur_sq_ring = NULL;
+        goto fail;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring.ur_cq_ring = ring.ur_sq_ring;
+    } else {
+        ring.ur_cq_ring = mmap(NULL, ring.ur_cq_ring_len, PROT_READ | PROT_WRITE,
+                               MAP_SHARED | MAP_POPULATE, ring.ur_fd,
+                               IORING_OFF_CQ_RING);
+        if (ring.ur_cq_ring == MAP_FAILED) {
+            ring.ur_cq_ring = NULL;
+            goto fail;
+        }
+    }
+
+    ring.ur_sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring.ur_sqes = mmap(NULL, ring.ur_sqes_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring.ur_fd, IORING_OFF_SQES);
+    if (ring.ur_sqes == MAP_FAILED) {
+        ring.ur_sqes = NULL;
+        goto fail;
+    }
+
+    sq = ring.ur_sq_ring;
+    ring.ur_sq_head = (uint32 *)(sq + params.sq_off.head);
+    ring.ur_sq_tail = (uint32 *)(sq + params.sq_off.tail);
+    ring.ur_sq_array = (uint32 *)(sq + params.sq_off.array);
+    ring.ur_sq_mask = *(uint32 *)(sq + params.sq_off.ring_mask);
+    ring.ur_sq_entries = params.sq_entries;
+    ring.ur_sq_local_tail = *ring.ur_sq_tail;
+
+    cq = ring.ur_cq_ring;
+    ring.ur_cq_head = (uint32 *)(cq + params.cq_off.head);
+    ring.ur_cq_tail = (uint32 *)(cq + params.cq_off.tail);
+    ring.ur_cq_mask = *(uint32 *)(cq + params.cq_off.ring_mask);
+    ring.ur_cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    dbg_msg("io_uring with %u/%u entries (flags 0x%x)",
+            params.sq_entries, params.cq_entries, params.flags);
+    return TRUE;
+
+fail:
+    dbg_err("Could not map the io_uring: %s", strerror(errno));
+    uring_deinit();
+    return FALSE;
+}
+
+void uring_deinit(void)
+{
+    if (ring.ur_sqes) {
+        munmap(ring.ur_sqes, ring.ur_sqes_len);
+    }
+    if (ring.ur_cq_ring && ring.ur_cq_ring != ring.ur_sq_ring) {
+        munmap(ring.ur_cq_ring, ring.ur_cq_ring_len);
+    }
+    if (ring.ur_sq_ring) {
+        munmap(ring.ur_sq_ring, ring.ur_sq_ring_len);
+    }
+    if (ring.ur_fd >= 0) {
+        close(ring.ur_fd);
+    }
+    memset(&ring, 0, sizeof(ring));
+    ring.ur_fd = -1;
+}
+
+/*
+ * Submits the filled entries and waits for wait_count completions.
+ * Returns 0 or ERR_RECV_MSG; an interrupted wait is not an error.
+ */
+int uring_enter(unsigned int wait_count)
+{
+    uint32 to_submit = ring.ur_sq_local_tail - *ring.ur_sq_tail;
+    int ret;
+
+    __atomic_store_n(ring.ur_sq_tail, ring.ur_sq_local_tail, __ATOMIC_RELEASE);
+    if (to_submit == 0 && wait_count == 0) {
+        return 0;
+    }
+
+    ret = syscall(__NR_io_uring_enter, ring.ur_fd, to_submit, wait_count,
+                  wait_count ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+        dbg_err("io_uring_enter() failed: %s", strerror(errno));
+        return ERR_RECV_MSG;
+    }
+    return 0;
+}
+
+/*
+ * Gets a zeroed submission queue entry, to be submitted by the next
+ * uring_enter(). Returns NULL if the queue stays full.
+ */
+struct io_uring_sqe * uring_sqe(void)
+{
+    struct io_uring_sqe * sqe = NULL;
+    uint32 idx;
+
+    if (ring.ur_sq_local_tail - __atomic_load_n(ring.ur_sq_head, __ATOMIC_ACQUIRE)
+        >= ring.ur_sq_entries) {
+        uring_enter(0);
+        if (ring.ur_sq_local_tail - __atomic_load_n(ring.ur_sq_head, __ATOMIC_ACQUIRE)
+            >= ring.ur_sq_entries) {
+            dbg_err("The io_uring submission queue is full");
+            return NULL;
+        }
+    }
+
+    idx = ring.ur_sq_local_tail & ring.ur_sq_mask;
+    sqe = &ring.ur_sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ring.ur_sq_array[idx] = idx;
+    ring.ur_sq_local_tail++;
+    return sqe;
+}
+
+/*
+ * Takes the next completion, if any.
+ */
+bool_t uring_cqe(struct io_uring_cqe * out_cqe)
+{
+    uint32 head = *ring.ur_cq_head;
+
+    if (head == __atomic_load_n(ring.ur_cq_tail, __ATOMIC_ACQUIRE)) {
+        return FALSE;
+    }
+    *out_cqe = ring.ur_cqes[head & ring.ur_cq_mask];
+    __atomic_store_n(ring.ur_cq_head, head + 1, __ATOMIC_RELEASE);
+    return TRUE;
+}
+
+/*
+ * Registers a ring of provided buffers for group. The kernel picks a buffer
+ * from it for each request with IOSQE_BUFFER_SELECT and reports its id in
+ * the completion flags.
+ */
+struct io_uring_buf_ring * uring_buf_ring(uint16 group, unsigned int entries)
+{
+    struct io_uring_buf_reg reg;
+    struct io_uring_buf_ring * br = NULL;
+    size_t len = entries * sizeof(struct io_uring_buf);
+
+    br = mmap(NULL, len, PROT_READ | PROT_WRITE,
+              MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (br == MAP_FAILED) {
+        dbg_err("Could not allocate the provided buffers ring");
+        return NULL;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)br;
+    reg.ring_entries = entries;
+    reg.bgid = group;
+    if (0 > syscall(__NR_io_uring_register, ring.ur_fd,
+                    IORING_REGISTER_PBUF_RING, &reg, 1)) {
+        dbg_err("Could not register the provided buffers: %s", strerror(errno));
+        munmap(br, len);
+        return NULL;
+    }
+    return br;
+}
+
+void uring_buf_ring_free(struct io_uring_buf_ring * br, uint16 group,
+                         unsigned int entries)
+{
+    struct io_uring_buf_reg reg;
+
+    if (!br) {
+        return;
+    }
+    memset(&reg, 0, sizeof(reg));
+    reg.bgid = group;
+    syscall(__NR_io_uring_register, ring.ur_fd,
+            IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    munmap(br, entries * sizeof(struct io_uring_buf));
+}
+
+/*
+ * Hands a buffer (back) to the kernel.
+ */
+void uring_buf_add(struct io_uring_buf_ring * br, unsigned int entries,
+                   void * addr, unsigned int len, uint16 bid)
+{
+    uint16 tail = br->tail;
+    struct io_uring_buf * buf = &br->bufs[tail & (entries - 1)];
+
+    buf->addr = (unsigned long)addr;
+    buf->len = len;
+    buf->bid = bid;
+    __atomic_store_n(&br->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+#endif /* DME_IO_URING */
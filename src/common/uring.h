@@ -0,0 +1,58 @@
+/*
+ * src/common/uring.h
+ *
+ * Minimal io_uring interface, on the raw system calls.
+ *
+ * -------------------------------------------------------------------------
+ */
+
+#ifndef URING_H_
+#define URING_H_
+
+#include <common/defs.h>
+
+#ifdef DME_IO_URING
+
+#include <linux/io_uring.h>
+
+/*
+ * The user data of each request: what it is for (kind) and a value, the
+ * file descriptor for the network requests.
+ */
+typedef enum uring_kind_e {
+    URING_KIND_STOP = 1,                /* the forced exit signalfd is ready */
+    URING_KIND_TIMER,                   /* value: timer generation */
+    URING_KIND_CANCEL,                  /* timeout and request removals */
+    URING_KIND_SEND,
+    URING_KIND_RECV,                    /* multishot receive */
+    URING_KIND_POLL,                    /* multishot poll */
+    URING_KIND_POLLOUT,                 /* one shot poll for room to write */
+} uring_kind_t;
+
+#define uring_tag(kind, val)    (((uint64)(kind) << 32) | (uint32)(val))
+#define uring_tag_kind(tag)     ((uring_kind_t)((tag) >> 32))
+#define uring_tag_val(tag)      ((uint32)(tag))
+
+extern bool_t uring_init(unsigned int entries);
+extern void   uring_deinit(void);
+extern bool_t uring_active(void);
+
+extern struct io_uring_sqe * uring_sqe(void);
+extern int    uring_enter(unsigned int wait_count);
+extern bool_t uring_cqe(struct io_uring_cqe * out_cqe);
+
+/* Provided buffers, entries must be a power of 2 */
+extern struct io_uring_buf_ring * uring_buf_ring(uint16 group,
+                                                 unsigned int entries);
+extern void   uring_buf_ring_free(struct io_uring_buf_ring * ring, uint16 group,
+                                  unsigned int entries);
+extern void   uring_buf_add(struct io_uring_buf_ring * ring, unsigned int entries,
+                            void * addr, unsigned int len, uint16 bid);
+
+#else
+
+#define uring_active()  (FALSE)
+
+#endif /* DME_IO_URING */
+
+#endif /* URING_H_ */
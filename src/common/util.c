@@ -11,6 +11,8 @@
 #include <stdio.h>
 #include <arpa/inet.h>
 #include <common/util.h>
+#include <common/udplink.h>
+#include <common/localload.h>
 #include <unistd.h>
 
 /*
@@ -62,6 +64,9 @@ int parse_peer_params(int argc, char ** argv,
             fprintf(stdout, PEER_USAGE_MESSAGE);
             exit(ERR_BADARGS);
     }
+
+    /* A bad workload in the environment stops the program here too */
+    local_load_active();
     
     dbg_msg("proc_id=%llu file=%s", *out_proc_id, *out_fname);
     
@@ -71,25 +76,72 @@ int parse_peer_params(int argc, char ** argv,
 #define SUPERVISOR_USAGE_MESSAGE \
 "Usage:\n"\
 "       supervisor -f <config-file> [-r <concurency ratio>] [-c <cproc_count>]\n"\
-"                  [-t <sec interval>]\n"\
+"                  [-t <sec interval>] [-d <CS duration>]\n"\
+"                  [-l <requests per sec>[:<step>]] [-a <distribution>]\n"\
 "                  [-o <out-logfile>]\n"\
-" Note: concurent proc count takes precedence over the the concurenct ratio."
+" Note: concurent proc count takes precedence over the the concurenct ratio.\n"\
+" With '-t 0' each test starts as soon as the previous one is over.\n"\
+" The CS duration is in seconds, or with a unit: 1.5, 250ms, 20us (default 5).\n"\
+" With '-l' the requests arrive at the given total rate instead (open loop),\n"\
+" the rate growing by <step> every interval; the time between arrivals is\n"\
+" exp (Poisson arrivals, the default), fixed or uniform.\n"
 
+/*
+ * Parses a duration: a decimal number of seconds, or of the unit that
+ * follows it (s, ms, us or ns).
+ */
+int parse_duration(const char * str, timespec_t * out_ts)
+{
+    static const struct { const char * name; double nsecs; } units[] = {
+        { "", 1e9 }, { "s", 1e9 }, { "ms", 1e6 }, { "us", 1e3 }, { "ns", 1 },
+    };
+    char * end = NULL;
+    double value;
+    uint64 nsecs;
+    int ix;
+
+    value = strtod(str, &end);
+    /* "nan" fails this too */
+    if (end == str || !(value >= 0)) {
+        return ERR_BADARGS;
+    }
+    for (ix = 0; ix < sizeof(units) / sizeof(units[0]); ix++) {
+        if (0 == strcmp(end, units[ix].name)) {
+            break;
+        }
+    }
+    if (ix == sizeof(units) / sizeof(units[0])
+        || value * units[ix].nsecs >= 1e9 * (uint32)-1) {
+        return ERR_BADARGS;
+    }
 
-#define SUPERVISOR_OPT_STRING "f:t:r:c:o:"
+    nsecs = (uint64)(value * units[ix].nsecs + 0.5);
+    out_ts->tv_sec = nsecs / 1000000000;
+    out_ts->tv_nsec = nsecs % 1000000000;
+    return 0;
+}
+
+#define SUPERVISOR_OPT_STRING "f:t:r:c:o:d:l:a:"
 extern int parse_sup_params(int argc, char * argv[],
                             char ** out_fname,
                             char ** out_logfname,
                             uint32 *out_concurency_ratio,
                             uint32 *out_concurent_count,
-                            uint32 *out_election_interval)
+                            uint32 *out_election_interval,
+                            timespec_t *out_cs_duration,
+                            double *out_load_rate,
+                            double *out_load_step,
+                            dist_kind_t *out_arrival)
 {
+    char * end = NULL;
     char optchar = '\0';
     bool_t file_provided = FALSE;
     int testval;
     bool_t err = FALSE;
     
-    if (!out_fname || !out_concurency_ratio || !out_election_interval) {
+    if (!out_fname || !out_concurency_ratio || !out_election_interval
+        || !out_cs_duration || !out_load_rate || !out_load_step
+        || !out_arrival) {
         return 1;
     }
 
@@ -126,14 +178,39 @@ extern int parse_sup_params(int argc, char * argv[],
 
         case 't':
             testval = strtoul(optarg, NULL, BASE_10);
-            if (testval < 5 || testval > 300) {
-                fprintf(stderr, "Election period must be in (5..300).\n");
+            if (testval < 0 || testval > 300) {
+                fprintf(stderr, "Election period must be in (0..300).\n");
                 err = TRUE;
             } else {
                 *out_election_interval = testval;
             }
             break;
 
+        case 'd':
+            if (parse_duration(optarg, out_cs_duration)) {
+                fprintf(stderr, "Bad CS duration '%s'.\n", optarg);
+                err = TRUE;
+            }
+            break;
+
+        case 'l':
+            *out_load_rate = strtod(optarg, &end);
+            *out_load_step = *end == ':' ? strtod(end + 1, &end) : 0;
+            if (*end || !(*out_load_rate > 0 && *out_load_rate <= LOAD_MAX_RATE)
+                || !(*out_load_step >= 0 && *out_load_step <= LOAD_MAX_RATE)) {
+                fprintf(stderr, "Bad request rate '%s' (at most %.0f/s).\n",
+                        optarg, LOAD_MAX_RATE);
+                err = TRUE;
+            }
+            break;
+
+        case 'a':
+            if (dist_kind_parse(optarg, out_arrival)) {
+                fprintf(stderr, "Arrivals must be exp, fixed or uniform.\n");
+                err = TRUE;
+            }
+            break;
+
         default:
             /* Print usage */
             fprintf(stdout, SUPERVISOR_USAGE_MESSAGE);
@@ -153,6 +230,9 @@ extern int parse_sup_params(int argc, char * argv[],
         exit(ERR_BADARGS);
     }
 
+    /* A bad workload in the environment stops the program here too */
+    local_load_active();
+
     return 0;
 }
 
@@ -190,6 +270,8 @@ int parse_file(const char * fname, proc_id_t p_id,
     char *mult;
     
     uint64 lnk_speed;
+    uint32 lnk_latency;
+    struct sockaddr_in mcast_addr = {};
         
     link_info_t * cnode = NULL;
     
@@ -214,7 +296,7 @@ int parse_file(const char * fname, proc_id_t p_id,
     dbg_msg("Allocated nodes array nodes[%d]", *out_nodes_count);
     
     ix = 0;
-    while (ix <= prc_count && fgets(linebuf, sizeof(linebuf), fh) != NULL) {
+    while (fgets(linebuf, sizeof(linebuf), fh) != NULL) {
         dbg_msg("readbuf[%d] = %s", strlen(linebuf), linebuf);
         
         /*
@@ -231,6 +313,30 @@ int parse_file(const char * fname, proc_id_t p_id,
             continue;
         }
 
+        /*
+         * Optional multicast group used for broadcasts, on any line:
+         * multicast <group-ip>:<port>
+         */
+        if (0 == strcmp(tok, "multicast")) {
+            tok = strtok(NULL, TOK_DELIM);
+            mcast_addr.sin_family = AF_INET;
+            if (!tok || 1 != inet_pton(AF_INET, tok, &mcast_addr.sin_addr.s_addr)
+                || !IN_MULTICAST(ntohl(mcast_addr.sin_addr.s_addr))
+                || !(tok = strtok(NULL, TOK_DELIM))) {
+                dbg_err("Bad multicast group in file %s", fname);
+                fclose(fh);
+                return ERR_BADFILE;
+            }
+            mcast_addr.sin_port = htons(strtoul(tok, NULL, BASE_10));
+            dbg_msg("Broadcasts go to the multicast group on port %s", tok);
+            continue;
+        }
+
+        /* Lines after the last process are ignored */
+        if (ix > prc_count) {
+            continue;
+        }
+
         jx = 0;
         cnode = (*out_nodes) + ix;
         cnode->proc_id = ix;
@@ -243,18 +349,55 @@ int parse_file(const char * fname, proc_id_t p_id,
         /* Parse the port */
         tok = strtok(NULL, TOK_DELIM);
         cnode->listen_addr.sin_port = htons(strtoul(tok, NULL, BASE_10));
+
+        /*
+         * Sites marked 'shm' (after the address) are on the same host and
+         * talk to each other through shared memory. Sites marked 'tcp'
+         * talk to each other over TCP.
+         * 'ctl:<port>' gives a site (or the supervisor) a separate socket for
+         * the supervisor messages, on the same IP.
+         */
+        tok = strtok(NULL, TOK_DELIM);
+        if (tok && 0 == strcmp(tok, "ctl")) {
+            if (!(tok = strtok(NULL, TOK_DELIM))) {
+                dbg_err("Bad control port in file %s", fname);
+                fclose(fh);
+                return ERR_BADFILE;
+            }
+            cnode->ctl_addr = cnode->listen_addr;
+            cnode->ctl_addr.sin_port = htons(strtoul(tok, NULL, BASE_10));
+            tok = strtok(NULL, TOK_DELIM);
+        }
+        if (tok && 0 == strcmp(tok, "shm")) {
+            cnode->shm_link = TRUE;
+            tok = strtok(NULL, TOK_DELIM);
+        } else if (tok && 0 == strcmp(tok, "tcp")) {
+            cnode->tcp_link = TRUE;
+            tok = strtok(NULL, TOK_DELIM);
+        }
         
         /* 
          * Only for this proc_id parse link speeds,
          * wich can have sufixes of K,M,G case insensitive
+         * and may be followed by a latency in ms (or us): 10m/20ms
          */
         if (ix == p_id && ix > 0) {
-            while (jx < prc_count && NULL != (tok = strtok(NULL, TOK_DELIM))) {
+            while (jx < prc_count && NULL != tok) {
                 /* No error checking done here */
                 lnk_speed = strtoull(tok, &mult, BASE_10) * speed_mult(*mult);
-                dbg_msg("\t\t found link speed to node %2d: %10s = %llu", jx, tok, lnk_speed);
+                lnk_latency = 0;
+                if ((mult = strchr(tok, '/'))) {
+                    lnk_latency = strtoul(mult + 1, &mult, BASE_10);
+                    if (*mult != 'u' && *mult != 'U') {
+                        lnk_latency *= 1000;
+                    }
+                }
+                dbg_msg("\t\t found link speed to node %2d: %10s = %llu (%u usec)",
+                        jx, tok, lnk_speed, lnk_latency);
                 
+                cnode->link_latency[jx] = lnk_latency;
                 cnode->link_speeds[jx++] = lnk_speed;
+                tok = strtok(NULL, TOK_DELIM);
             }
             
             if (jx < prc_count) {
@@ -280,15 +423,101 @@ int parse_file(const char * fname, proc_id_t p_id,
         dbg_err("File %s has only %d of %d records", fname, ix, prc_count);
         return ERR_BADFILE;
     }
+
+    for (ix = 0; ix <= prc_count; ix++) {
+        (*out_nodes)[ix].mcast_addr = mcast_addr;
+    }
     
     return 0;
 }
 
 
 
+/*
+ * Multicast setup.
+ * Broadcasts are sent from the listening socket to the group, through the
+ * interface of the listen address (the loopback one for 127.0.0.1, so that
+ * all the sites on a host get them). Every site except the supervisor also
+ * receives the group on a separate socket, as the group port is shared.
+ */
+static int open_mcast_socket (proc_id_t p_id, link_info_t * const nodes)
+{
+    int res = 0;
+    int one = 1;
+    uint8 ttl = 1;
+    struct in_addr ifaddr = nodes[p_id].listen_addr.sin_addr;
+    struct ip_mreq mreq = {};
+
+    if ((res = setsockopt(nodes[p_id].sock_fd, IPPROTO_IP, IP_MULTICAST_IF,
+                          &ifaddr, sizeof(ifaddr)))
+        || (res = setsockopt(nodes[p_id].sock_fd, IPPROTO_IP, IP_MULTICAST_TTL,
+                             &ttl, sizeof(ttl)))
+        || (res = setsockopt(nodes[p_id].sock_fd, IPPROTO_IP, IP_MULTICAST_LOOP,
+                             &one, sizeof(one)))) {
+        dbg_err("Could not set multicast options on the listening socket.");
+        return res;
+    }
+
+    /* The supervisor only sends to the group */
+    if (p_id == 0) {
+        return 0;
+    }
+
+    if (1 > (nodes[p_id].mcast_fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP))) {
+        dbg_err("Could not alocate multicast socket");
+        return -1;
+    }
+
+    mreq.imr_multiaddr = nodes[p_id].mcast_addr.sin_addr;
+    mreq.imr_interface = ifaddr;
+
+    if ((res = setsockopt(nodes[p_id].mcast_fd, SOL_SOCKET, SO_REUSEADDR,
+                          &one, sizeof(one)))
+        || (res = bind(nodes[p_id].mcast_fd,
+                       (const struct sockaddr *)&nodes[p_id].mcast_addr,
+                       sizeof(nodes[p_id].mcast_addr)))
+        || (res = setsockopt(nodes[p_id].mcast_fd, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+                             &mreq, sizeof(mreq)))) {
+        dbg_err("Could not join the multicast group.");
+        close(nodes[p_id].mcast_fd);
+        nodes[p_id].mcast_fd = 0;
+        return res;
+    }
+
+    dbg_msg("The multicast socket is open on fd %d", nodes[p_id].mcast_fd);
+    return 0;
+}
+
+/*
+ * The supervisor messages to a site with a control address arrive on a
+ * socket of their own, which the event loop reads first (see init.c).
+ */
+static int open_ctl_socket (proc_id_t p_id, link_info_t * const nodes)
+{
+    int res = 0;
+
+    if (1 > (nodes[p_id].ctl_fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP))) {
+        dbg_err("Could not alocate control socket");
+        return -1;
+    }
+
+    if (res = bind(nodes[p_id].ctl_fd,
+                   (const struct sockaddr *)&nodes[p_id].ctl_addr,
+                   sizeof(nodes[p_id].ctl_addr))) {
+        dbg_err("Could not bind the control socket.");
+        close(nodes[p_id].ctl_fd);
+        nodes[p_id].ctl_fd = 0;
+        return res;
+    }
+
+    dbg_msg("The control socket is open on fd %d", nodes[p_id].ctl_fd);
+    return 0;
+}
+
 int open_listen_socket (proc_id_t p_id, link_info_t * const nodes, size_t nodes_count)
 {
     int res = 0;
+    int one = 1;
     int max_nodes = nodes_count;
     
     if (p_id < 0 || p_id > max_nodes) {
@@ -304,6 +533,14 @@ int open_listen_socket (proc_id_t p_id, link_info_t * const nodes, size_t nodes_
     }
     
     dbg_msg("The socket is open on fd %d", nodes[p_id].sock_fd);
+
+    /* The connected sockets to the peers share the address (see udplink.c) */
+    if (udp_link_active()
+        && (res = setsockopt(nodes[p_id].sock_fd, SOL_SOCKET, SO_REUSEPORT,
+                             &one, sizeof(one)))) {
+        dbg_err("Could not set SO_REUSEPORT on the socket.");
+        goto end;
+    }
     
     if (res = bind(nodes[p_id].sock_fd,
                    (const struct sockaddr *)&nodes[p_id].listen_addr,
@@ -311,6 +548,14 @@ int open_listen_socket (proc_id_t p_id, link_info_t * const nodes, size_t nodes_
         dbg_err("Could not bind socket.");
         goto end;
     }
+
+    if (nodes[p_id].mcast_addr.sin_family == AF_INET) {
+        res = open_mcast_socket(p_id, nodes);
+    }
+
+    if (!res && nodes[p_id].ctl_addr.sin_family == AF_INET) {
+        res = open_ctl_socket(p_id, nodes);
+    }
     
 end:
     /* There was an error so close the socket if created */
@@ -321,9 +566,15 @@ end:
     return res;
 }
 
+/*
+ * Time to put a message of msg_length bytes on a link of link_speed bps.
+ */
 uint64 get_msg_delay_usec(uint64 link_speed, size_t msg_length)
 {
-    return (msg_length * 1000000 / link_speed);
+    if (link_speed == 0) {
+        return 0;
+    }
+    return ((uint64)msg_length * 8 * 1000000 / link_speed);
 }
 
 /*
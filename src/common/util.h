@@ -15,10 +15,14 @@
 #include <time.h>
 
 #include <common/defs.h>
+#include <common/dist.h>
 
 #define BASE_10         10
 #define BASE_16         16
 
+/* Highest open loop request rate (-l), per second: the step stops there */
+#define LOAD_MAX_RATE   (1e6)
+
 typedef struct timespec timespec_t;
 /*
  * Export functions in "util.c" to be available for other modules.
@@ -33,7 +37,12 @@ extern int parse_sup_params(int argc, char * argv[],
                             char ** out_logfname,
                             uint32 *out_concurency_ratio,
                             uint32 *out_concurent_count,
-                            uint32 *out_election_interval);
+                            uint32 *out_election_interval,
+                            timespec_t *out_cs_duration,
+                            double *out_load_rate,
+                            double *out_load_step,
+                            dist_kind_t *out_arrival);
+extern int parse_duration(const char * str, timespec_t * out_ts);
 
 extern int parse_file(const char * fname, proc_id_t p_id,
                link_info_t * out_nodes[], size_t * out_nodes_count);
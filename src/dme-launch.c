@@ -0,0 +1,393 @@
+/*
+ * dme-launch.c
+ *
+ * Starts a cluster: one algorithm process per site of a config file and
+ * the supervisor, without a terminal each. Every process writes its output
+ * to a file of its own. The run ends after a given time, when the
+ * supervisor exits, or on ^C/^Z; the processes are then told to exit
+ * (SIGTSTP, their forced exit) and their exit status is reported.
+ *
+ * -------------------------------------------------------------------------
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sched.h>
+#include <sys/wait.h>
+
+#include <common/defs.h>
+#include <common/util.h>
+
+/*
+ * global vars, defined in each app
+ * The config file is parsed as the supervisor would, into nodes.
+ */
+proc_id_t proc_id = 0;
+link_info_t * nodes = NULL;
+size_t nodes_count = 0;
+
+int err_code = 0;
+bool_t exit_request = FALSE;
+
+#define USAGE_MESSAGE \
+"Usage:\n"\
+"       dme-launch  -f <config-file> [-a <algorithm>] [-b <bin-dir>]\n"\
+"                   [-l <log-dir>] [-d <seconds>] [-p <cpu-list>]\n"\
+"                   [-- <supervisor args>]\n"\
+"\n"\
+" Starts <algorithm> (default lamport) for each site of the config file,\n"\
+" then the supervisor with '-f <config-file> <supervisor args>'. Process i\n"\
+" writes to <log-dir>/<algorithm><i>.log, the supervisor to\n"\
+" <log-dir>/<algorithm>0.log. The run lasts <seconds> (0: until the\n"\
+" supervisor exits or ^C). With -p the processes are pinned round robin to\n"\
+" the CPUs of the list (e.g. 0,2-5), the supervisor first.\n"\
+" The exit status is 0 if every process exited with 0.\n"
+
+#define LAUNCH_OPT_STRING   "f:a:b:l:d:p:h"
+#define MAX_SUP_ARGS        (32)
+#define MAX_PINNED_CPUS     (1024)
+#define EXIT_GRACE_SECS     (5)         /* before the processes are killed */
+
+typedef struct child_s {
+    pid_t       ch_pid;                 /* 0 once reaped */
+    int         ch_status;              /* as returned by waitpid() */
+} child_t;
+
+static char * fname = NULL;
+static char * algorithm = "lamport";
+static char * bindir = "build";
+static char * logdir = ".";
+static unsigned int duration = 0;
+static int cpus[MAX_PINNED_CPUS];
+static unsigned int cpus_count = 0;
+
+static child_t * children = NULL;       /* indexed by proc id */
+static unsigned int running = 0;
+
+/*
+ * Parses a cpu list: "0,2,4-7".
+ */
+static int parse_cpus(const char * list)
+{
+    char * end = NULL;
+    long first;
+    long last;
+
+    while (*list) {
+        first = last = strtol(list, &end, BASE_10);
+        if (end == list || first < 0) {
+            return ERR_BADARGS;
+        }
+        if (*end == '-') {
+            list = end + 1;
+            last = strtol(list, &end, BASE_10);
+            if (end == list || last < first) {
+                return ERR_BADARGS;
+            }
+        }
+        for (; first <= last && cpus_count < MAX_PINNED_CPUS; first++) {
+            cpus[cpus_count++] = first;
+        }
+        if (*end == ',') {
+            end++;
+        } else if (*end) {
+            return ERR_BADARGS;
+        }
+        list = end;
+    }
+    return cpus_count ? 0 : ERR_BADARGS;
+}
+
+/*
+ * Starts a process with its output going to logname, pinned to a cpu if
+ * there is a cpu list. Returns its pid, or -1.
+ */
+static pid_t launch(char * const argv[], const char * logname,
+                    unsigned int index, const sigset_t * origmask)
+{
+    cpu_set_t cpuset;
+    sigset_t mask = *origmask;
+    pid_t pid;
+    int fd;
+
+    if (0 > (pid = fork())) {
+        fprintf(stderr, "Could not start %s: %s\n", argv[0], strerror(errno));
+        return -1;
+    }
+    if (pid > 0) {
+        return pid;
+    }
+
+    /*
+     * The terminal's ^C and ^Z are for the launcher only. SIGTSTP stays
+     * blocked (across execv()) until the program's event loop takes it as
+     * its forced exit; delivered before that, it would stop the process.
+     */
+    setpgid(0, 0);
+    sigaddset(&mask, SIGTSTP);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+
+    if (cpus_count) {
+        CPU_ZERO(&cpuset);
+        CPU_SET(cpus[index % cpus_count], &cpuset);
+        if (sched_setaffinity(0, sizeof(cpuset), &cpuset)) {
+            fprintf(stderr, "Could not pin %s to cpu %d: %s\n",
+                    argv[0], cpus[index % cpus_count], strerror(errno));
+        }
+    }
+
+    if (0 > (fd = open(logname, O_WRONLY | O_CREAT | O_TRUNC, 0644))) {
+        fprintf(stderr, "Could not open %s: %s\n", logname, strerror(errno));
+        _exit(ERR_BADFILE);
+    }
+    dup2(fd, STDOUT_FILENO);
+    dup2(fd, STDERR_FILENO);
+    close(fd);
+
+    execv(argv[0], argv);
+    fprintf(stderr, "Could not execute %s: %s\n", argv[0], strerror(errno));
+    _exit(ERR_BADFILE);
+}
+
+/*
+ * Reaps the exited processes. Returns TRUE if one of them was the
+ * supervisor or exited with an error.
+ */
+static bool_t reap(void)
+{
+    bool_t run_over = FALSE;
+    proc_id_t ix;
+    pid_t pid;
+    int status;
+
+    while (0 < (pid = waitpid(-1, &status, WNOHANG))) {
+        for (ix = 0; ix <= nodes_count; ix++) {
+            if (children[ix].ch_pid == pid) {
+                break;
+            }
+        }
+        if (ix > nodes_count) {
+            continue;
+        }
+
+        children[ix].ch_pid = 0;
+        children[ix].ch_status = status;
+        running--;
+        if (ix == SUPERVISOR_PID || !WIFEXITED(status) || WEXITSTATUS(status)) {
+            run_over = TRUE;
+        }
+    }
+    return run_over;
+}
+
+/*
+ * Waits for the end of the run: a signal in waitset, the duration or a
+ * process exiting.
+ */
+static void wait_run(const sigset_t * waitset)
+{
+    struct timespec deadline;
+    struct timespec now;
+    struct timespec timeout;
+    siginfo_t sinfo;
+    int signo;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += duration;
+
+    while (running) {
+        if (duration) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            timeout = timespec_delta(now, deadline);
+            if (timeout.tv_sec < 0) {
+                return;
+            }
+            signo = sigtimedwait(waitset, &sinfo, &timeout);
+        } else {
+            signo = sigwaitinfo(waitset, &sinfo);
+        }
+
+        if (signo == SIGCHLD) {
+            if (reap()) {
+                return;
+            }
+        } else if (signo > 0) {
+            fprintf(stderr, "Stopping the run (signal %d)\n", signo);
+            return;
+        } else if (errno == EAGAIN) {
+            return;
+        }
+    }
+}
+
+/*
+ * Tells the processes still running to exit and kills those that don't.
+ */
+static void stop_all(const sigset_t * waitset)
+{
+    struct timespec timeout = { EXIT_GRACE_SECS, 0 };
+    siginfo_t sinfo;
+    proc_id_t ix;
+
+    for (ix = 0; ix <= nodes_count; ix++) {
+        if (children[ix].ch_pid > 0) {
+            kill(children[ix].ch_pid, SIGTSTP);
+        }
+    }
+
+    reap();
+    while (running && 0 < sigtimedwait(waitset, &sinfo, &timeout)) {
+        reap();
+    }
+
+    for (ix = 0; ix <= nodes_count; ix++) {
+        if (children[ix].ch_pid > 0) {
+            fprintf(stderr, "Killing %llu (pid %d)\n", ix, children[ix].ch_pid);
+            kill(children[ix].ch_pid, SIGKILL);
+            waitpid(children[ix].ch_pid, &children[ix].ch_status, 0);
+            children[ix].ch_pid = 0;
+            running--;
+        }
+    }
+}
+
+/*
+ * Prints the exit status of each process; returns 0 if all exited with 0.
+ */
+static int report(void)
+{
+    int res = 0;
+    int status;
+    proc_id_t ix;
+
+    for (ix = 0; ix <= nodes_count; ix++) {
+        status = children[ix].ch_status;
+        if (WIFEXITED(status)) {
+            fprintf(stdout, "%-10s %3llu: exit %d\n",
+                    ix == SUPERVISOR_PID ? "supervisor" : algorithm,
+                    ix, WEXITSTATUS(status));
+            res |= WEXITSTATUS(status);
+        } else {
+            fprintf(stdout, "%-10s %3llu: signal %d\n",
+                    ix == SUPERVISOR_PID ? "supervisor" : algorithm,
+                    ix, WTERMSIG(status));
+            res |= ERR_FATAL;
+        }
+    }
+    return res ? 1 : 0;
+}
+
+int main(int argc, char * argv[])
+{
+    char path[256];
+    char logname[256];
+    char idstr[32];
+    char * site_argv[] = { path, "-i", idstr, "-f", NULL, NULL };
+    char * sup_argv[MAX_SUP_ARGS + 4] = { path, "-f", NULL };
+    sigset_t waitset;
+    sigset_t origmask;
+    int optchar;
+    int ix;
+    int res = 0;
+
+    while ((optchar = getopt(argc, argv, LAUNCH_OPT_STRING)) != -1) {
+        switch (optchar) {
+        case 'f':
+            fname = optarg;
+            break;
+        case 'a':
+            algorithm = optarg;
+            break;
+        case 'b':
+            bindir = optarg;
+            break;
+        case 'l':
+            logdir = optarg;
+            break;
+        case 'd':
+            duration = strtoul(optarg, NULL, BASE_10);
+            break;
+        case 'p':
+            if (parse_cpus(optarg)) {
+                fprintf(stderr, "Bad cpu list '%s'\n", optarg);
+                return ERR_BADARGS;
+            }
+            break;
+        default:
+            fprintf(stdout, USAGE_MESSAGE);
+            return ERR_BADARGS;
+        }
+    }
+    if (!fname || argc - optind > MAX_SUP_ARGS) {
+        fprintf(stdout, USAGE_MESSAGE);
+        return ERR_BADARGS;
+    }
+
+    if (0 != (res = parse_file(fname, SUPERVISOR_PID, &nodes, &nodes_count))) {
+        fprintf(stderr, "Could not parse %s\n", fname);
+        return res;
+    }
+    if (!(children = calloc(nodes_count + 1, sizeof(child_t)))) {
+        res = ERR_MALLOC;
+        goto end;
+    }
+
+    /* the signals that end the run are only waited for */
+    sigemptyset(&waitset);
+    sigaddset(&waitset, SIGCHLD);
+    sigaddset(&waitset, SIGINT);
+    sigaddset(&waitset, SIGTERM);
+    sigaddset(&waitset, SIGTSTP);
+    sigprocmask(SIG_BLOCK, &waitset, &origmask);
+
+    /* The sites first, then the supervisor */
+    site_argv[4] = fname;
+    for (ix = 1; ix <= nodes_count; ix++) {
+        snprintf(path, sizeof(path), "%s/%s", bindir, algorithm);
+        snprintf(idstr, sizeof(idstr), "%d", ix);
+        snprintf(logname, sizeof(logname), "%s/%s%d.log", logdir, algorithm, ix);
+        if (0 > (children[ix].ch_pid = launch(site_argv, logname, ix, &origmask))) {
+            children[ix].ch_pid = 0;
+            res = ERR_INIT;
+            break;
+        }
+        running++;
+    }
+
+    if (!res) {
+        sup_argv[2] = fname;
+        for (ix = optind; ix < argc; ix++) {
+            sup_argv[3 + ix - optind] = argv[ix];
+        }
+        snprintf(path, sizeof(path), "%s/supervisor", bindir);
+        snprintf(logname, sizeof(logname), "%s/%s0.log", logdir, algorithm);
+        if (0 > (children[0].ch_pid = launch(sup_argv, logname, 0, &origmask))) {
+            children[0].ch_pid = 0;
+            res = ERR_INIT;
+        } else {
+            running++;
+        }
+    }
+
+    if (!res) {
+        fprintf(stdout, "Started %u processes of %s and the supervisor\n",
+                nodes_count, algorithm);
+        fflush(stdout);
+        wait_run(&waitset);
+    }
+    stop_all(&waitset);
+
+    if (!res) {
+        res = report();
+    }
+
+end:
+    safe_free(children);
+    safe_free(nodes);
+    return res;
+}
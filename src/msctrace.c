@@ -0,0 +1,79 @@
+/*
+ * msctrace.c
+ *
+ * Converts binary trace files (written by processes started with DME_TRACE
+ * set) to the MSC text format printed on stdout when tracing to text:
+ *   <sec>.<nsec> <line> # p<src>->p<dst>: <text>
+ * 
+ * -------------------------------------------------------------------------
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <common/defs.h>
+#include <common/trace.h>
+
+/*
+ * global vars, defined in each app
+ * Not used here, but the common modules need them.
+ */
+proc_id_t proc_id = 0;
+link_info_t * nodes = NULL;
+size_t nodes_count = 0;
+
+int err_code = 0;
+bool_t exit_request = FALSE;
+
+#define USAGE_MESSAGE \
+"Usage:\n"\
+"       msctrace  <trace-file> [<trace-file> ...]\n"\
+"       msctrace  -   (read from stdin)\n"
+
+static int convert(FILE * fh, const char * fname)
+{
+    trace_rec_t rec;
+    size_t count = 0;
+
+    while (1 == fread(&rec, sizeof(rec), 1, fh)) {
+        /* never trust the terminator */
+        rec.tr_text[sizeof(rec.tr_text) - 1] = '\0';
+        trace_print(stdout, &rec);
+        count++;
+    }
+
+    if (ferror(fh)) {
+        fprintf(stderr, "Error reading %s after %u records\n", fname, count);
+        return ERR_BADFILE;
+    }
+    return 0;
+}
+
+int main(int argc, char * argv[])
+{
+    FILE * fh = NULL;
+    int res = 0;
+    int ix;
+
+    if (argc < 2) {
+        fprintf(stderr, USAGE_MESSAGE);
+        return ERR_BADARGS;
+    }
+
+    for (ix = 1; ix < argc; ix++) {
+        if (0 == strcmp(argv[ix], "-")) {
+            res |= convert(stdin, "stdin");
+            continue;
+        }
+
+        if (NULL == (fh = fopen(argv[ix], "rb"))) {
+            fprintf(stderr, "Could not open file %s\n", argv[ix]);
+            res = ERR_BADFILE;
+            continue;
+        }
+        res |= convert(fh, argv[ix]);
+        fclose(fh);
+    }
+
+    return res;
+}
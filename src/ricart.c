@@ -17,7 +17,9 @@
 #include "common/init.h"
 #include "common/fsm.h"
 #include "common/util.h"
+#include "common/localload.h"
 #include "common/net.h"
+#include "common/msgschema.h"
 
 /*
  * global vars, defined in each app
@@ -33,7 +35,7 @@ bool_t exit_request = FALSE;
 static char * fname = NULL;
 static struct timespec sup_tstamp;      /* used for performance measurements */
 static timespec_t sup_syncro;           /* used to sync with the supervisor */
-static uint32 critical_region_simulated_duration = 0;
+static timespec_t critical_region_simulated_duration = { 0, 0 };
 
 /*
  * Ricart specifics
@@ -58,19 +60,15 @@ static bool_t *ricart_replies = NULL;
 /*
  * Structure of the ricart DME message
  */
-struct ricart_message_s {
-    dme_message_hdr_t lm_hdr;
-    uint32            type;             /* REQUEST/REPLY/RELEASE */
-    uint32            tstamp_sec;
-    uint32            tstamp_nsec;
-    proc_id_t         pid;              /* even though is redundant it's used to mirror the theory */
-} PACKED;
+#define RICART_MSG_FIELDS(F)                                            \
+    F(uint32,    type,        uint32)   /* REQUEST/REPLY/RELEASE */     \
+    F(uint32,    tstamp_sec,  uint32)                                   \
+    F(uint32,    tstamp_nsec, uint32)                                   \
+    F(proc_id_t, pid,         uint64)   /* even though is redundant it's used to mirror the theory */
+DME_MSG_SCHEMA(ricart, MSGT_RICART, RICART_MSG_FIELDS)
 
 static uint32 my_tstamp_sec;
 static uint32 my_tstamp_nsec;
- 
-
-typedef struct ricart_message_s ricart_message_t;
 
 #define RICART_MSG_LEN  (sizeof(ricart_message_t))
 #define RICART_DATA_LEN (RICART_MSG_LEN - DME_MESSAGE_HEADER_LEN)
@@ -108,8 +106,8 @@ static bool_t my_turn(void) {
 static void peer_msg_add_timestamp(ricart_message_t * msg) {
     struct timespec ts;
     clock_gettime(CLOCK_REALTIME, &ts);
-    msg->tstamp_sec = htonl((uint32)(ts.tv_sec - sup_syncro.tv_sec));
-    msg->tstamp_nsec = htonl((uint32)(ts.tv_nsec - sup_syncro.tv_nsec));
+    msg->tstamp_sec = (uint32)(ts.tv_sec - sup_syncro.tv_sec);
+    msg->tstamp_nsec = (uint32)(ts.tv_nsec - sup_syncro.tv_nsec);
 }
 
 /*
@@ -122,39 +120,15 @@ static int ricart_msg_set(ricart_message_t * const msg, unsigned int msgtype,
         return ERR_DME_HDR;
     }
 
-    /* first set the header */
-    dme_header_set(&msg->lm_hdr, MSGT_RICART, RICART_MSG_LEN, 0);
-
-    /* then the ricart specific data */
+    /* the ricart specific data, in host order */
     peer_msg_add_timestamp(msg);
-    msg->type = htonl(msgtype);
-    msg->pid = htonq(proc_id);
+    msg->type = msgtype;
+    msg->pid = proc_id;
 
     snprintf(msctext, msclen, "%s(%u.%09u, %llu)", msg_type_tostr(msgtype),
-             ntohl(msg->tstamp_sec), ntohl(msg->tstamp_nsec), proc_id);
+             msg->tstamp_sec, msg->tstamp_nsec, proc_id);
 
-    return 0;
-}
-
-/*
- * Parse a received ricart message. The space must be already allocated in 'msg'.
- */
-static int ricart_msg_parse(buff_t buff, ricart_message_t * msg) {
-    ricart_message_t * src = (ricart_message_t *)buff.data;
-
-    if (!msg || buff.data == NULL || buff.len < DME_MESSAGE_HEADER_LEN) {
-        return ERR_DME_HDR;
-    }
-
-    /* first parse the header */
-    dme_header_parse(buff, &msg->lm_hdr);
-    /* then the ricart specific data */
-    msg->tstamp_sec = ntohl(src->tstamp_sec);
-    msg->tstamp_nsec = ntohl(src->tstamp_nsec);
-    msg->type = ntohl(src->type);
-    msg->pid = ntohq(src->pid);
-    dbg_msg("msg parse from %llu , type = %u ",msg->pid, msg->type);
-    dbg_msg("src msg parse timestamp  = %u sec %u nsec", msg->tstamp_sec , msg->tstamp_nsec);
+    return ricart_msg_encode(msg);
 }
 
 /*
@@ -183,6 +157,14 @@ static int supervisor_send_inform_message(dme_ev_t ev) {
         sup_tstamp.tv_nsec = tnow.tv_nsec;
         break;
 
+    case DME_SEV_READY:
+    case DME_SEV_SYNCRO_ACK:
+        /* The startup handshake (see supervisor.c) */
+        sup_msg_set(&msg, ev, 0, 0, 0, msctext, sizeof(msctext));
+        err = dme_send_msg(SUPERVISOR_PID, (uint8*)&msg, SUPERVISOR_MESSAGE_LENGTH,
+                           msctext);
+        break;
+
     default:
         /* No need to send informs to the supervisor in other cases */
         break;
@@ -218,12 +200,19 @@ static int handle_supervisor_msg(void * cookie) {
         clock_gettime(CLOCK_REALTIME, &sup_tstamp);
         sup_msg_parse(*buff, &srcmsg);
 
-        if (srcmsg.msg_type == DME_SEV_SYNCRO) {
+        if (srcmsg.msg_type == DME_SEV_READY) {
+            ret = supervisor_send_inform_message(DME_SEV_READY);
+        }
+        else if (srcmsg.msg_type == DME_SEV_SYNCRO) {
             sup_syncro.tv_sec = srcmsg.sec_tdelta;
             sup_syncro.tv_nsec = srcmsg.nsec_tdelta;
+            ret = supervisor_send_inform_message(DME_SEV_SYNCRO_ACK);
+            local_load_start();
         }
-        else if (srcmsg.msg_type == DME_EV_WANT_CRITICAL_REG) {
-            critical_region_simulated_duration = srcmsg.sec_tdelta;
+        else if (srcmsg.msg_type == DME_EV_WANT_CRITICAL_REG &&
+                 !local_load_active()) {
+            critical_region_simulated_duration.tv_sec = srcmsg.sec_tdelta;
+            critical_region_simulated_duration.tv_nsec = srcmsg.nsec_tdelta;
             ret = handle_event(DME_EV_WANT_CRITICAL_REG, NULL);
         }
 
@@ -259,7 +248,10 @@ static int handle_peer_msg(void * cookie) {
         return ERR_RECV_MSG;
     }
 
-    ricart_msg_parse(*buff, &srcmsg);
+    if (0 != (ret = ricart_msg_decode(*buff, &srcmsg))) {
+        dbg_err("Recieved a malformed message. Ignoring it.");
+        return ret;
+    }
 
     switch(fsm_state) {
     case PS_IDLE:
@@ -374,7 +366,8 @@ int process_ev_entered_cr(void * cookie)
 
     /* Finish our simulated work after the ammount of time specified by the supervisor */
     schedule_event(DME_EV_EXITED_CRITICAL_REG,
-                   critical_region_simulated_duration, 0, NULL);
+                   critical_region_simulated_duration.tv_sec,
+                   critical_region_simulated_duration.tv_nsec, NULL);
 
     dbg_msg("Exit point");
     return err;
@@ -397,6 +390,7 @@ int process_ev_exited_cr(void * cookie)
 
     /* inform the supervisor */
     supervisor_send_inform_message(DME_EV_EXITED_CRITICAL_REG);
+    local_load_think();
     int ix = 0; 
     ricart_message_t dstmsg;
     for (ix = 1; ix <=nodes_count ; ix++){
@@ -410,6 +404,19 @@ int process_ev_exited_cr(void * cookie)
     return err;
 }
 
+/*
+ * A request of this site (see localload.c), handled as one from the
+ * supervisor.
+ */
+int process_ev_local_request(void * cookie)
+{
+    clock_gettime(CLOCK_REALTIME, &sup_tstamp);
+    critical_region_simulated_duration = local_load_cs_time();
+
+    return handle_event(DME_EV_WANT_CRITICAL_REG, NULL);
+}
+
+
 
 int main(int argc, char *argv[])
 {
@@ -454,6 +461,10 @@ int main(int argc, char *argv[])
     register_event_handler(DME_EV_WANT_CRITICAL_REG, process_ev_want_cr);
     register_event_handler(DME_EV_ENTERED_CRITICAL_REG, process_ev_entered_cr);
     register_event_handler(DME_EV_EXITED_CRITICAL_REG, process_ev_exited_cr);
+    register_event_handler(DME_EV_LOCAL_REQUEST, process_ev_local_request);
+
+    /* Tell the supervisor we are up (it asks again if it starts after us) */
+    supervisor_send_inform_message(DME_SEV_READY);
 
     /*
      * Main loop: just sit here and wait for interrupts (triggered by the supervisor).
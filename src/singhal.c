@@ -15,7 +15,9 @@
 #include "common/init.h"
 #include "common/fsm.h"
 #include "common/util.h"
+#include "common/localload.h"
 #include "common/net.h"
+#include "common/msgschema.h"
 
 /*
  * global vars, defined in each app
@@ -31,7 +33,7 @@ bool_t exit_request = FALSE;
 static char * fname = NULL;
 static struct timespec sup_tstamp;      /* used for performance measurements */
 static timespec_t sup_syncro;
-static uint32 critical_region_simulated_duration = 0;
+static timespec_t critical_region_simulated_duration = { 0, 0 };
 
 /*
  * Singhal specifics
@@ -63,14 +65,12 @@ uint32 * Ri_val = NULL;
 /*
  * Structure of the Singhal DME message
  */
-struct singhal_message_s {
-    dme_message_hdr_t lm_hdr;
-    uint32            type;             /* REQUEST/REPLY */
-    uint32            tstamp_sec;
-    uint32            tstamp_nsec;
-    proc_id_t         pid;              /* even though is redundant it's used to mirror the theory */
-} PACKED;
-typedef struct singhal_message_s singhal_message_t;
+#define SINGHAL_MSG_FIELDS(F)                                           \
+    F(uint32,    type,        uint32)   /* REQUEST/REPLY */             \
+    F(uint32,    tstamp_sec,  uint32)                                   \
+    F(uint32,    tstamp_nsec, uint32)                                   \
+    F(proc_id_t, pid,         uint64)   /* even though is redundant it's used to mirror the theory */
+DME_MSG_SCHEMA(singhal, MSGT_SINGHAL, SINGHAL_MSG_FIELDS)
 
 #define SINGHAL_MSG_LEN  (sizeof(singhal_message_t))
 #define SINGHAL_DATA_LEN (SINGHAL_MSG_LEN - DME_MESSAGE_HEADER_LEN)
@@ -188,8 +188,8 @@ static int request_prio_cmp(const request_t * const a,
 static void peer_msg_add_timestamp(singhal_message_t * msg) {
     struct timespec ts;
     clock_gettime(CLOCK_REALTIME, &ts);
-    msg->tstamp_sec = htonl((uint32)(ts.tv_sec - sup_syncro.tv_sec));
-    msg->tstamp_nsec = htonl((uint32)(ts.tv_nsec - sup_syncro.tv_nsec));
+    msg->tstamp_sec = (uint32)(ts.tv_sec - sup_syncro.tv_sec);
+    msg->tstamp_nsec = (uint32)(ts.tv_nsec - sup_syncro.tv_nsec);
 }
 
 /*
@@ -202,39 +202,15 @@ static int singhal_msg_set(singhal_message_t * const msg, unsigned int msgtype,
         return ERR_DME_HDR;
     }
 
-    /* first set the header */
-    dme_header_set(&msg->lm_hdr, MSGT_SINGHAL, SINGHAL_MSG_LEN, 0);
-
-    /* then the singhal specific data */
+    /* the singhal specific data, in host order */
     peer_msg_add_timestamp(msg);
-    msg->type = htonl(msgtype);
-    msg->pid = htonq(proc_id);
+    msg->type = msgtype;
+    msg->pid = proc_id;
 
     snprintf(msctext, msclen, "%s(ts=%u.%09u, pid=%llu)", msg_type_tostr(msgtype),
-             ntohl(msg->tstamp_sec), ntohl(msg->tstamp_nsec), proc_id);
-
-    return 0;
-}
-
-/*
- * Parse a received singhal message. The space must be already allocated in 'msg'.
- */
-static int singhal_msg_parse(buff_t buff, singhal_message_t * msg) {
-    singhal_message_t * src = (singhal_message_t *)buff.data;
-
-    if (!msg || buff.data == NULL || buff.len < DME_MESSAGE_HEADER_LEN) {
-        return ERR_DME_HDR;
-    }
-
-    /* first parse the header */
-    dme_header_parse(buff, &msg->lm_hdr);
-
-    /* then the singhal specific data */
-    msg->tstamp_sec = ntohl(src->tstamp_sec);
-    msg->tstamp_nsec = ntohl(src->tstamp_nsec);
-    msg->type = ntohl(src->type);
-    msg->pid = ntohq(src->pid);
+             msg->tstamp_sec, msg->tstamp_nsec, proc_id);
 
+    return singhal_msg_encode(msg);
 }
 
 /*
@@ -266,6 +242,14 @@ static int supervisor_send_inform_message(dme_ev_t ev) {
         sup_tstamp.tv_nsec = tnow.tv_nsec;
         break;
 
+    case DME_SEV_READY:
+    case DME_SEV_SYNCRO_ACK:
+        /* The startup handshake (see supervisor.c) */
+        sup_msg_set(&msg, ev, 0, 0, 0, msctext, sizeof(msctext));
+        err = dme_send_msg(SUPERVISOR_PID, (uint8*)&msg, SUPERVISOR_MESSAGE_LENGTH,
+                           msctext);
+        break;
+
     default:
         /* No need to send informs to the supervisor in other cases */
         break;
@@ -280,22 +264,17 @@ static int supervisor_send_inform_message(dme_ev_t ev) {
 int singhal_set_msg_send (uint8 * buff, size_t len, nodes_set_t set,
                           char * const msctext)
 {
+    proc_id_t dests[nodes_count];
+    size_t count = 0;
     int ix = 0;
-    int ret = 0;
 
-    for (ix = 1; ix < proc_id && !ret; ix++) {
-    	if (set[ix]) {
-    		ret |= dme_send_msg(ix, buff, len, msctext);
-    	}
-    }
-
-    for (ix = proc_id + 1; ix <= nodes_count && !ret; ix++) {
-    	if (set[ix]) {
-    		ret |= dme_send_msg(ix, buff, len, msctext);
+    for (ix = 1; ix <= nodes_count; ix++) {
+    	if (set[ix] && ix != proc_id) {
+    		dests[count++] = ix;
     	}
     }
 
-    return ret;
+    return dme_send_msg_set(dests, count, buff, len, msctext);
 }
 
 
@@ -326,12 +305,19 @@ static int handle_supervisor_msg(void * cookie) {
         clock_gettime(CLOCK_REALTIME, &sup_tstamp);
         sup_msg_parse(*buff, &srcmsg);
 
-        if (srcmsg.msg_type == DME_SEV_SYNCRO) {
+        if (srcmsg.msg_type == DME_SEV_READY) {
+            ret = supervisor_send_inform_message(DME_SEV_READY);
+        }
+        else if (srcmsg.msg_type == DME_SEV_SYNCRO) {
             sup_syncro.tv_sec = srcmsg.sec_tdelta;
             sup_syncro.tv_nsec = srcmsg.nsec_tdelta;
+            ret = supervisor_send_inform_message(DME_SEV_SYNCRO_ACK);
+            local_load_start();
         }
-        else if (srcmsg.msg_type == DME_EV_WANT_CRITICAL_REG) {
-            critical_region_simulated_duration = srcmsg.sec_tdelta;
+        else if (srcmsg.msg_type == DME_EV_WANT_CRITICAL_REG &&
+                 !local_load_active()) {
+            critical_region_simulated_duration.tv_sec = srcmsg.sec_tdelta;
+            critical_region_simulated_duration.tv_nsec = srcmsg.nsec_tdelta;
             ret = handle_event(DME_EV_WANT_CRITICAL_REG, NULL);
         }
 
@@ -390,7 +376,10 @@ static int handle_peer_msg(void * cookie) {
     }
 
     /* Parsing and processing received message */
-    singhal_msg_parse(*buff, &srcmsg);
+    if (0 != (ret = singhal_msg_decode(*buff, &srcmsg))) {
+        dbg_err("Recieved a malformed message. Ignoring it.");
+        return ret;
+    }
     Sj = srcmsg.pid;
 
     if (srcmsg.type == MTYPE_REQUEST) {
@@ -538,7 +527,8 @@ int process_ev_entered_cr(void * cookie)
 
     /* Finish our simulated work after the ammount of time specified by the supervisor */
     schedule_event(DME_EV_EXITED_CRITICAL_REG,
-                   critical_region_simulated_duration, 0, NULL);
+                   critical_region_simulated_duration.tv_sec,
+                   critical_region_simulated_duration.tv_nsec, NULL);
 
     return err;
 }
@@ -562,6 +552,7 @@ int process_ev_exited_cr(void * cookie)
 
     /* inform the supervisor */
     supervisor_send_inform_message(DME_EV_EXITED_CRITICAL_REG);
+    local_load_think();
     fsm_state = PS_IDLE;
 
     Executing = FALSE;
@@ -594,6 +585,19 @@ int process_ev_exited_cr(void * cookie)
     return err;
 }
 
+/*
+ * A request of this site (see localload.c), handled as one from the
+ * supervisor.
+ */
+int process_ev_local_request(void * cookie)
+{
+    clock_gettime(CLOCK_REALTIME, &sup_tstamp);
+    critical_region_simulated_duration = local_load_cs_time();
+
+    return handle_event(DME_EV_WANT_CRITICAL_REG, NULL);
+}
+
+
 
 int main(int argc, char *argv[])
 {
@@ -642,6 +646,7 @@ int main(int argc, char *argv[])
     register_event_handler(DME_EV_WANT_CRITICAL_REG, process_ev_want_cr);
     register_event_handler(DME_EV_ENTERED_CRITICAL_REG, process_ev_entered_cr);
     register_event_handler(DME_EV_EXITED_CRITICAL_REG, process_ev_exited_cr);
+    register_event_handler(DME_EV_LOCAL_REQUEST, process_ev_local_request);
 
 
 
@@ -654,6 +659,9 @@ int main(int argc, char *argv[])
     Requesting = FALSE;
     Executing = FALSE;
 
+    /* Tell the supervisor we are up (it asks again if it starts after us) */
+    supervisor_send_inform_message(DME_SEV_READY);
+
     /*
      * Main loop: just sit here and wait for interrupts (triggered by the supervisor).
      * All work is done in interrupt handlers mapped to registered functions.
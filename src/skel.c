@@ -17,7 +17,9 @@
 #include <common/init.h>
 #include <common/fsm.h>
 #include <common/util.h>
+#include <common/localload.h>
 #include <common/net.h>
+#include <common/msgschema.h>
 
 /*
  * global vars, defined in each app
@@ -34,7 +36,7 @@ bool_t exit_request = FALSE;
 
 /* Other vars */
 static struct timespec sup_tstamp;      /* used for performance measurements */
-static uint32 critical_region_simulated_duration = 5;
+static timespec_t critical_region_simulated_duration = { 5, 0 };
 
 /*
  * Algorithm Specifics
@@ -60,17 +62,17 @@ const char * msg_type_tostr(int mtype) {
 
 /*
  * Generic alg. message structure.
- * Every alg. should include the common header.
+ * Every alg. should include the common header, which DME_MSG_SCHEMA() adds
+ * before the fields listed here as F(type, name, word), 'word' being the
+ * type the field is byte swapped as (uint8 for none).
+ * The Message type must be added to the list in common/net.h
  */
-struct generic_message_s {
-    /* common header */
-    dme_message_hdr_t lm_hdr;
+#define MSGT_GENERIC    (0xFFFF)        /* placeholder */
 
-    /* Algorithm specific fields */
-    uint32 field1;
-    uint8  field2[20];
-} PACKED;
-typedef struct generic_message_s generic_message_t;
+#define GENERIC_MSG_FIELDS(F)                                           \
+    F(uint32,    field1, uint32)                                        \
+    F(uint8,     field2, uint8)
+DME_MSG_SCHEMA(generic, MSGT_GENERIC, GENERIC_MSG_FIELDS)
 
 #define GENERIC_MSG_LEN  (sizeof(generic_message_t))
 #define GENERIC_DATA_LEN (GENERIC_MSG_LEN - DME_MESSAGE_HEADER_LEN)
@@ -98,38 +100,13 @@ static int generic_msg_set(generic_message_t * const msg, unsigned int msgtype,
         return ERR_DME_HDR;
     }
 
-    /*
-     * First set the header.
-     * The Message type must be added to the list in common/net.h
-     */
-
-    /* dme_header_set(&msg->lm_hdr, MSGT_GENERIC, GENERIC_MSG_LEN, 0); */
-
-    /* then the generic alg. specific data which must be converted to network order*/
+    /* the generic alg. specific data, in host order */
 
-    /* msg->field1 = hton..(...) */
+    /* msg->field1 = ... */
     snprintf(msctext, msclen, "%s( )", msg_type_tostr(msgtype));
 
-    return 0;
-}
-
-/*
- * Parse a received generic message. The space must be already allocated in 'msg'.
- */
-static int generic_msg_parse(buff_t buff, generic_message_t * msg) {
-    generic_message_t * src = (generic_message_t *)buff.data;
-
-    if (!msg || buff.data == NULL || buff.len < DME_MESSAGE_HEADER_LEN) {
-        return ERR_DME_HDR;
-    }
-
-    /* first parse the header */
-    dme_header_parse(buff, &msg->lm_hdr);
-
-    /* then the generic alg. specific data which must be converted from network order */
-
-    /* msg->field1 = ntoh..(....) */
-
+    /* sets the header and converts the fields to network order */
+    return generic_msg_encode(msg);
 }
 
 /*
@@ -159,6 +136,14 @@ static int supervisor_send_inform_message(dme_ev_t ev) {
         sup_tstamp.tv_nsec = tnow.tv_nsec;
         break;
 
+    case DME_SEV_READY:
+    case DME_SEV_SYNCRO_ACK:
+        /* The startup handshake (see supervisor.c) */
+        sup_msg_set(&msg, ev, 0, 0, 0, msctext, sizeof(msctext));
+        err = dme_send_msg(SUPERVISOR_PID, (uint8*)&msg, SUPERVISOR_MESSAGE_LENGTH,
+                           msctext);
+        break;
+
     default:
         /* No need to send informs to the supervisor in other cases */
         break;
@@ -193,12 +178,19 @@ static int handle_supervisor_msg(void * cookie) {
         clock_gettime(CLOCK_REALTIME, &sup_tstamp);
         sup_msg_parse(*buff, &srcmsg);
 
-        if (srcmsg.msg_type == DME_SEV_SYNCRO) {
+        if (srcmsg.msg_type == DME_SEV_READY) {
+            ret = supervisor_send_inform_message(DME_SEV_READY);
+        }
+        else if (srcmsg.msg_type == DME_SEV_SYNCRO) {
             sup_syncro.tv_sec = srcmsg.sec_tdelta;
             sup_syncro.tv_nsec = srcmsg.nsec_tdelta;
+            ret = supervisor_send_inform_message(DME_SEV_SYNCRO_ACK);
+            local_load_start();
         }
-        else if (srcmsg.msg_type == DME_EV_WANT_CRITICAL_REG) {
-            critical_region_simulated_duration = srcmsg.sec_tdelta;
+        else if (srcmsg.msg_type == DME_EV_WANT_CRITICAL_REG &&
+                 !local_load_active()) {
+            critical_region_simulated_duration.tv_sec = srcmsg.sec_tdelta;
+            critical_region_simulated_duration.tv_nsec = srcmsg.nsec_tdelta;
             ret = handle_event(DME_EV_WANT_CRITICAL_REG, NULL);
         }
 
@@ -239,7 +231,10 @@ static int handle_peer_msg(void * cookie) {
     }
 
     /* parse the received buffer in the srcmsg structure */
-    generic_msg_parse(*buff, &srcmsg);
+    if (0 != (ret = generic_msg_decode(*buff, &srcmsg))) {
+        dbg_err("Recieved a malformed message. Ignoring it.");
+        return ret;
+    }
 
     switch(fsm_state) {
     case PS_IDLE:
@@ -311,7 +306,8 @@ int process_ev_entered_cr(void * cookie)
 
     /* Finish our simulated work after the amount of time specified by the supervisor */
     schedule_event(DME_EV_EXITED_CRITICAL_REG,
-                   critical_region_simulated_duration, 0, NULL);
+                   critical_region_simulated_duration.tv_sec,
+                   critical_region_simulated_duration.tv_nsec, NULL);
 
     dbg_msg("Exit point");
     return err;
@@ -335,6 +331,7 @@ int process_ev_exited_cr(void * cookie)
 
     /* inform the supervisor */
     supervisor_send_inform_message(DME_EV_EXITED_CRITICAL_REG);
+    local_load_think();
 
     /* Switch state to IDLE */
     fsm_state = PS_IDLE;
@@ -346,6 +343,19 @@ int process_ev_exited_cr(void * cookie)
     return err;
 }
 
+/*
+ * A request of this site (see localload.c), handled as one from the
+ * supervisor.
+ */
+int process_ev_local_request(void * cookie)
+{
+    clock_gettime(CLOCK_REALTIME, &sup_tstamp);
+    critical_region_simulated_duration = local_load_cs_time();
+
+    return handle_event(DME_EV_WANT_CRITICAL_REG, NULL);
+}
+
+
 
 int main(int argc, char *argv[])
 {
@@ -391,6 +401,10 @@ int main(int argc, char *argv[])
     register_event_handler(DME_EV_WANT_CRITICAL_REG, process_ev_want_cr);
     register_event_handler(DME_EV_ENTERED_CRITICAL_REG, process_ev_entered_cr);
     register_event_handler(DME_EV_EXITED_CRITICAL_REG, process_ev_exited_cr);
+    register_event_handler(DME_EV_LOCAL_REQUEST, process_ev_local_request);
+
+    /* Tell the supervisor we are up (it asks again if it starts after us) */
+    supervisor_send_inform_message(DME_SEV_READY);
 
     /*
      * Main loop: just sit here and wait for interrupts (triggered by the supervisor).
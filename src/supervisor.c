@@ -18,6 +18,8 @@
 #include <common/util.h>
 #include <common/net.h>
 #include <common/fsm.h>
+#include <common/dist.h>
+#include <common/localload.h>
 
 /* 
  * global vars, defined in each app
@@ -36,7 +38,8 @@ static char * logfname = "supervisor.log";
 static FILE * log_fh;
 
 
-static unsigned int election_interval = 10;     /* time in seconds to rerun election */
+static unsigned int election_interval = 10;     /* time in seconds to rerun election (0: when idle) */
+static timespec_t cs_duration = { 5, 0 };       /* time each process stays in the CS */
 static unsigned int concurency_ratio = 50;      /* value in percent of total processes */
 static unsigned int max_concurrent_proc = 0;    /* This will be computed in main() */
 static bool_t fixed_concurent_num = FALSE;
@@ -49,6 +52,84 @@ static timespec_t * synchro_delays;
 static timespec_t * response_times;
 static unsigned int elected_proc_count;
 static unsigned int received_resps_count;
+
+/*
+ * The open loop workload (-l).
+ * Instead of rounds, CS requests arrive at load_rate per second in total,
+ * the times between arrivals following the arrival distribution, each for
+ * a random site: with exponential times every site gets its own Poisson
+ * arrivals of load_rate / nodes_count per second. The arrival times are
+ * kept on schedule even if the supervisor is late, so a slow cluster does
+ * not lower the load it is offered. A site gets its next request as soon
+ * as it exited the CS; until then they wait in its queue (requests coming
+ * to a full queue are dropped).
+ * Every -t seconds (1 with -t 0) the supervisor logs the offered rate, the
+ * throughput, the time the requests waited in the queues and the backlog,
+ * then raises the rate by load_step. The first interval in which the
+ * throughput falls behind the offered rate while the backlog grows gives
+ * the saturation point.
+ * When the sites make their own requests (closed loop, see localload.c)
+ * the supervisor only logs the same statistics of what they report.
+ */
+#define OL_QUEUE_LEN            (1024)
+#define OL_SATURATED(offered, throughput) ((throughput) < 0.95 * (offered))
+
+#define ts_nsecs(ts)            ((uint64)(ts).tv_sec * 1000000000 + (ts).tv_nsec)
+
+typedef struct ol_site_s {
+    uint64          os_queue[OL_QUEUE_LEN]; /* arrival times (nsecs) */
+    unsigned int    os_head;
+    unsigned int    os_count;
+    bool_t          os_busy;                /* its request was sent */
+    uint64          os_arrived;             /* arrival time of that one */
+} ol_site_t;
+
+typedef struct ol_stats_s {
+    uint64          arrivals;
+    uint64          dropped;
+    uint64          sent;
+    uint64          entered;
+    uint64          served;                 /* EXITED */
+    uint64          queue_nsecs;            /* arrival -> sent to the site */
+    uint64          resp_nsecs;             /* at the site: request -> ENTERED */
+    uint64          sojourn_nsecs;          /* arrival -> EXITED */
+    uint64          cs_nsecs;               /* at the site: ENTERED -> EXITED */
+} ol_stats_t;
+
+static double load_rate = 0;                    /* requests per second; 0: rounds */
+static double load_step = 0;                    /* added every interval */
+static dist_t arrival = { DIST_EXP, 0 };
+static ol_site_t * ol_sites;                    /* indexed by proc id */
+static ol_stats_t ol_stats;                     /* of the current interval */
+static uint64 ol_next_arrival;
+static uint64 ol_interval_start;
+static unsigned int ol_backlog;                 /* at the last report */
+static bool_t ol_saturated = FALSE;
+
+/*
+ * The startup handshake.
+ * Each site sends READY once it listens for messages. Every
+ * STARTUP_TICK_NSEC the supervisor asks again (with READY) the sites it did
+ * not hear from, as they may have started before it. When all are ready it
+ * sends SYNCRO, the same way, until each site acknowledged it; then the
+ * tests start. A site silent for STARTUP_TIMEOUT secs in a phase fails the
+ * run, the ones that did not answer being reported.
+ */
+#define STARTUP_TICK_NSEC   (100 * 1000 * 1000)
+#define STARTUP_TIMEOUT     (30)
+#define STARTUP_TICKS       (STARTUP_TIMEOUT * (1000000000 / STARTUP_TICK_NSEC))
+
+typedef enum startup_phase_e {
+    SP_WAIT_READY,
+    SP_WAIT_SYNCRO_ACK,
+    SP_RUNNING,
+} startup_phase_t;
+
+static startup_phase_t startup_phase = SP_WAIT_READY;
+static bool_t * startup_acked;                  /* indexed by proc id */
+static unsigned int startup_acked_count;
+static unsigned int startup_ticks;
+static dme_timer_t startup_timer = DME_TIMER_NONE;
 /* 
  * trigger_critical_region()
  * 
@@ -96,30 +177,109 @@ static proc_id_t get_random_pid() {
     
 }
 
-/* 
- * Event handler functions.
- * These functions must properly free the cookie received.
+/*
+ * Sends msgtype to the sites that did not answer in this startup phase.
+ * The time stamp, if any, goes in the time delta fields.
  */
-int syncro(void * cookie) {
+static int startup_send(unsigned int msgtype, const timespec_t * pts) {
     sup_message_t msg = {};
     char msctext[MAX_MSC_TEXT] = {};
-    uint8 * buff = (uint8 *) &msg;
-    timespec_t ts_syncro;
-    timespec_t *pts = NULL;
+    proc_id_t dests[nodes_count];
+    size_t count = 0;
+    proc_id_t ix;
 
-    if ((timespec_t*)cookie == NULL) {
-        clock_gettime(CLOCK_REALTIME, &ts_syncro);
-        pts = &ts_syncro;
-    } else {
-        pts = (timespec_t*)cookie;
+    for (ix = 1; ix <= nodes_count; ix++) {
+        if (!startup_acked[ix]) {
+            dests[count++] = ix;
+        }
+    }
+    if (!count) {
+        return 0;
     }
 
-    sup_msg_set(&msg, DME_SEV_SYNCRO,
-                (uint32)pts->tv_sec, (uint32)pts->tv_nsec, 0,
+    sup_msg_set(&msg, msgtype,
+                pts ? (uint32)pts->tv_sec : 0, pts ? (uint32)pts->tv_nsec : 0, 0,
                 msctext, sizeof(msctext));
 
-    return dme_broadcast_msg(buff, SUPERVISOR_MESSAGE_LENGTH, msctext);
+    return dme_send_msg_set(dests, count, (uint8 *)&msg,
+                            SUPERVISOR_MESSAGE_LENGTH, msctext);
+}
+
+/*
+ * Records the answer of a site in this startup phase and moves to the next
+ * one once all the sites answered.
+ */
+static void startup_answer(proc_id_t pid, startup_phase_t phase) {
+    if (startup_phase != phase || pid < 1 || pid > nodes_count
+        || startup_acked[pid]) {
+        return;
+    }
+    startup_acked[pid] = TRUE;
+    if (++startup_acked_count < nodes_count) {
+        return;
+    }
+
+    memset(startup_acked, 0, (nodes_count + 1) * sizeof(startup_acked[0]));
+    startup_acked_count = 0;
+    startup_ticks = 0;
+
+    if (phase == SP_WAIT_READY) {
+        dbg_msg("All sites are ready; synchronizing");
+
+        /* Start working; mark time */
+        clock_gettime(CLOCK_REALTIME, &tstamp_supervisor_start);
+        startup_phase = SP_WAIT_SYNCRO_ACK;
+        startup_send(DME_SEV_SYNCRO, &tstamp_supervisor_start);
+        reschedule_event(startup_timer, 0, STARTUP_TICK_NSEC);
+    } else {
+        dbg_msg("All sites are synchronized; starting the tests");
+        startup_phase = SP_RUNNING;
+        cancel_event(startup_timer);
+        startup_timer = DME_TIMER_NONE;
+        deliver_event(DME_SEV_PERIODIC_WORK, NULL);
+        if (load_rate > 0) {
+            deliver_event(DME_SEV_ARRIVAL, NULL);
+        }
+    }
+}
+
+/* 
+ * Event handler functions.
+ * These functions must properly free the cookie received.
+ */
+int startup_tick(void * cookie) {
+    const char * what = startup_phase == SP_WAIT_READY ? "READY" : "SYNCRO ack";
+    proc_id_t ix;
+
+    startup_timer = DME_TIMER_NONE;
+    if (startup_phase == SP_RUNNING) {
+        return 0;
+    }
+
+    if (startup_ticks++ >= STARTUP_TICKS) {
+        fprintf(log_fh, "No %s after %u seconds from %u of %u sites:", what,
+                STARTUP_TIMEOUT, nodes_count - startup_acked_count, nodes_count);
+        fprintf(stderr, "No %s after %u seconds from sites:", what, STARTUP_TIMEOUT);
+        for (ix = 1; ix <= nodes_count; ix++) {
+            if (!startup_acked[ix]) {
+                fprintf(log_fh, " %llu", ix);
+                fprintf(stderr, " %llu", ix);
+            }
+        }
+        log_msg("");
+        fprintf(stderr, "\n");
+        fflush(log_fh);
+        return ERR_INIT;
+    }
 
+    /* Failed sends are retried on the next tick */
+    if (startup_phase == SP_WAIT_READY) {
+        startup_send(DME_SEV_READY, NULL);
+    } else {
+        startup_send(DME_SEV_SYNCRO, &tstamp_supervisor_start);
+    }
+    startup_timer = schedule_event(DME_SEV_STARTUP_TICK, 0, STARTUP_TICK_NSEC, NULL);
+    return 0;
 }
 
 int do_work(void * cookie) {
@@ -230,7 +390,8 @@ int do_work(void * cookie) {
         
         /* Trigger the elected processes to compete for the critical region */
         for (ix = 0; ix < concurrent_count; ix++) {
-            trigger_critical_region(pid_arr[ix],5,0);
+            trigger_critical_region(pid_arr[ix],
+                                    cs_duration.tv_sec, cs_duration.tv_nsec);
             nodes[pid_arr[ix]].state = PS_PENDING;
         }
     } else {
@@ -238,8 +399,176 @@ int do_work(void * cookie) {
     }
     
     
-    /* reschedule this process */
-    schedule_event(DME_SEV_PERIODIC_WORK, election_interval, 0, NULL);
+    /* reschedule this process; back to back tests restart on the last EXITED */
+    if (election_interval) {
+        schedule_event(DME_SEV_PERIODIC_WORK, election_interval, 0, NULL);
+    }
+    return 0;
+}
+
+/*
+ * Sends its oldest queued request to a site.
+ */
+static void open_loop_send(proc_id_t pid, uint64 now) {
+    ol_site_t * site = &ol_sites[pid];
+
+    site->os_arrived = site->os_queue[site->os_head];
+    site->os_head = (site->os_head + 1) % OL_QUEUE_LEN;
+    site->os_count--;
+    site->os_busy = TRUE;
+
+    ol_stats.sent++;
+    ol_stats.queue_nsecs += now - site->os_arrived;
+
+    trigger_critical_region(pid, cs_duration.tv_sec, cs_duration.tv_nsec);
+    nodes[pid].state = PS_PENDING;
+}
+
+/*
+ * Takes the ENTERED and EXITED messages in open or closed loop.
+ */
+static int open_loop_inform(const sup_message_t * msg, uint64 now) {
+    proc_id_t pid = msg->process_id;
+    ol_site_t * site = NULL;
+
+    if (pid < 1 || pid > nodes_count) {
+        return ERR_BAD_PEER_ID;
+    }
+    site = &ol_sites[pid];
+
+    if (msg->msg_type == DME_EV_ENTERED_CRITICAL_REG) {
+        nodes[pid].state = PS_EXECUTING;
+        ol_stats.entered++;
+        ol_stats.resp_nsecs += (uint64)msg->sec_tdelta * 1000000000
+                               + msg->nsec_tdelta;
+
+        if (!critical_region_is_sane()) {
+            dbg_err("Unfortunately there are multiple processes in the CS at the same time!");
+            return ERR_FATAL;
+        }
+        return 0;
+    }
+
+    nodes[pid].state = PS_IDLE;
+    ol_stats.served++;
+    ol_stats.cs_nsecs += (uint64)msg->sec_tdelta * 1000000000 + msg->nsec_tdelta;
+    if (site->os_busy) {
+        site->os_busy = FALSE;
+        ol_stats.sojourn_nsecs += now - site->os_arrived;
+    }
+    if (site->os_count) {
+        open_loop_send(pid, now);
+    }
+    return 0;
+}
+
+/*
+ * The requests due by now arrive; then waits for the next one.
+ */
+int open_loop_arrival(void * cookie) {
+    ol_site_t * site = NULL;
+    proc_id_t pid;
+    timespec_t tnow;
+    timespec_t gap;
+    uint64 now;
+
+    clock_gettime(CLOCK_REALTIME, &tnow);
+    now = ts_nsecs(tnow);
+    if (!ol_next_arrival) {
+        ol_next_arrival = now;
+    }
+
+    while (ol_next_arrival <= now) {
+        pid = get_random_pid();
+        site = &ol_sites[pid];
+
+        ol_stats.arrivals++;
+        if (site->os_count == OL_QUEUE_LEN) {
+            ol_stats.dropped++;
+        } else {
+            site->os_queue[(site->os_head + site->os_count) % OL_QUEUE_LEN] =
+                    ol_next_arrival;
+            site->os_count++;
+            if (!site->os_busy) {
+                open_loop_send(pid, now);
+            }
+        }
+
+        /* a 0 ns gap would never get past now */
+        gap = dist_sample(&arrival);
+        ol_next_arrival += ts_nsecs(gap) ? ts_nsecs(gap) : 1;
+    }
+
+    schedule_event(DME_SEV_ARRIVAL, (ol_next_arrival - now) / 1000000000,
+                   (ol_next_arrival - now) % 1000000000, NULL);
+    return 0;
+}
+
+/*
+ * Logs the statistics of the last interval and raises the rate.
+ */
+int open_loop_report(void * cookie) {
+    uint64 avg_queue = ol_stats.sent ? ol_stats.queue_nsecs / ol_stats.sent : 0;
+    uint64 avg_resp = ol_stats.entered ? ol_stats.resp_nsecs / ol_stats.entered : 0;
+    uint64 avg_sojourn = ol_stats.served ? ol_stats.sojourn_nsecs / ol_stats.served : 0;
+    uint64 avg_cs = ol_stats.served ? ol_stats.cs_nsecs / ol_stats.served : 0;
+    unsigned int backlog = 0;
+    double secs;
+    double offered;
+    double throughput;
+    bool_t saturated;
+    timespec_t tnow;
+    proc_id_t ix;
+
+    clock_gettime(CLOCK_REALTIME, &tnow);
+    for (ix = 1; ix <= nodes_count; ix++) {
+        backlog += ol_sites[ix].os_count + ol_sites[ix].os_busy;
+    }
+
+    secs = (ts_nsecs(tnow) - ol_interval_start) / 1e9;
+    throughput = ol_stats.served / secs;
+
+    if (test_number > 0 && load_rate == 0) {
+        log_msg("Load %2u: closed loop throughput=%.1f/s "
+                "avg_resp_time=%llu.%09llu avg_cs_time=%llu.%09llu",
+                test_number, throughput,
+                avg_resp / 1000000000, avg_resp % 1000000000,
+                avg_cs / 1000000000, avg_cs % 1000000000);
+        fflush(log_fh);
+    } else if (test_number > 0) {
+        offered = ol_stats.arrivals / secs;
+        saturated = OL_SATURATED(offered, throughput) && backlog > ol_backlog;
+
+        log_msg("Load %2u: rate=%.1f offered=%.1f/s throughput=%.1f/s "
+                "avg_queue_delay=%llu.%09llu avg_resp_time=%llu.%09llu "
+                "avg_sojourn_time=%llu.%09llu backlog=%u dropped=%llu%s",
+                test_number, load_rate, offered, throughput,
+                avg_queue / 1000000000, avg_queue % 1000000000,
+                avg_resp / 1000000000, avg_resp % 1000000000,
+                avg_sojourn / 1000000000, avg_sojourn % 1000000000,
+                backlog, ol_stats.dropped, saturated ? " SATURATED" : "");
+        if (saturated && !ol_saturated) {
+            log_msg("SATURATION at rate=%.1f: throughput=%.1f/s",
+                    load_rate, throughput);
+            ol_saturated = TRUE;
+        }
+        fflush(log_fh);
+
+        load_rate += load_step;
+        if (load_rate > LOAD_MAX_RATE) {
+            load_rate = LOAD_MAX_RATE;
+        }
+        arrival.d_mean = 1 / load_rate;
+    }
+
+    memset(&ol_stats, 0, sizeof(ol_stats));
+    ol_interval_start = ts_nsecs(tnow);
+    ol_backlog = backlog;
+    test_number++;
+
+    schedule_event(DME_SEV_PERIODIC_WORK,
+                   election_interval ? election_interval : 1, 0, NULL);
+    return 0;
 }
 
 /* Process incoming messages */
@@ -259,6 +588,13 @@ int process_messages(void * cookie)
     clock_gettime(CLOCK_REALTIME, &tnow);
     tprogdelta = timespec_delta(tstamp_supervisor_start, tnow);
 
+    /* In open or closed loop the requests are not in rounds */
+    if ((load_rate > 0 || local_load_active()) &&
+        (srcmsg.msg_type == DME_EV_ENTERED_CRITICAL_REG ||
+         srcmsg.msg_type == DME_EV_EXITED_CRITICAL_REG)) {
+        return open_loop_inform(&srcmsg, ts_nsecs(tnow));
+    }
+
     switch(srcmsg.msg_type) {
     case DME_EV_ENTERED_CRITICAL_REG:
         nodes[srcmsg.process_id].state = PS_EXECUTING;
@@ -296,6 +632,21 @@ int process_messages(void * cookie)
         dbg_msg("[%ld.%09lu] EXITED CS: process %llu stayed for %u.%09u seconds in it's CS",
         		tprogdelta.tv_sec, tprogdelta.tv_nsec,
                 srcmsg.process_id, srcmsg.sec_tdelta, srcmsg.nsec_tdelta);
+
+        /* Back to back tests: start the next one as soon as this one is over */
+        if (!election_interval && critical_region_is_idlle()) {
+            deliver_event(DME_SEV_PERIODIC_WORK, NULL);
+        }
+        break;
+
+    case DME_SEV_READY:
+        dbg_msg("Process %llu is ready", srcmsg.process_id);
+        startup_answer(srcmsg.process_id, SP_WAIT_READY);
+        break;
+
+    case DME_SEV_SYNCRO_ACK:
+        dbg_msg("Process %llu is synchronized", srcmsg.process_id);
+        startup_answer(srcmsg.process_id, SP_WAIT_SYNCRO_ACK);
         break;
 
     default:
@@ -312,7 +663,8 @@ int main(int argc, char *argv[])
     
     if (0 != (res = parse_sup_params(argc, argv, &fname, &logfname,
                                      &concurency_ratio, &max_concurrent_proc,
-                                     &election_interval))) {
+                                     &election_interval, &cs_duration,
+                                     &load_rate, &load_step, &arrival.d_kind))) {
         dbg_err("parse_args() returned nonzero status:%d", res);
         goto end;
     }
@@ -336,7 +688,7 @@ int main(int argc, char *argv[])
         fixed_concurent_num = FALSE;
     }
 
-    if (max_concurrent_proc < 2) {
+    if (max_concurrent_proc < 2 && load_rate == 0 && !local_load_active()) {
         dbg_err("concurrency ratio or number set too low. At least 2 processes must be concurrent.");
         goto end;
     } else if (max_concurrent_proc > nodes_count) {
@@ -351,6 +703,13 @@ int main(int argc, char *argv[])
     /* Allocate the statistics collection storage and open the log file */
     synchro_delays = calloc(nodes_count, sizeof(timespec_t));
     response_times = calloc(nodes_count, sizeof(timespec_t));
+    startup_acked = calloc(nodes_count + 1, sizeof(bool_t));
+    ol_sites = calloc(nodes_count + 1, sizeof(ol_site_t));
+    if (!synchro_delays || !response_times || !startup_acked || !ol_sites) {
+        dbg_err("Could not allocate the statistics storage");
+        res = ERR_MALLOC;
+        goto end;
+    }
 
     if (NULL == (log_fh = fopen(logfname, "w"))) {
         dbg_err("Could not open log file %s for writing", logfname);
@@ -375,26 +734,29 @@ int main(int argc, char *argv[])
         goto end;
     }
     
-    register_event_handler(DME_SEV_PERIODIC_WORK, do_work);
-    register_event_handler(DME_SEV_SYNCRO, syncro);
+    if (local_load_active()) {
+        /* the sites make their own requests */
+        load_rate = 0;
+        register_event_handler(DME_SEV_PERIODIC_WORK, open_loop_report);
+    } else if (load_rate > 0) {
+        arrival.d_mean = 1 / load_rate;
+        register_event_handler(DME_SEV_PERIODIC_WORK, open_loop_report);
+        register_event_handler(DME_SEV_ARRIVAL, open_loop_arrival);
+    } else {
+        register_event_handler(DME_SEV_PERIODIC_WORK, do_work);
+    }
+    register_event_handler(DME_SEV_STARTUP_TICK, startup_tick);
     register_event_handler(DME_SEV_MSG_IN, process_messages);
 
-    /* wait for peers processes to init, then kick start the supervisor */
-    sleep(5);
-    
-    /* Start working; mark time */
-    clock_gettime(CLOCK_REALTIME, &tstamp_supervisor_start);
-
-    deliver_event(DME_SEV_SYNCRO, &tstamp_supervisor_start);
-    sleep(1);
-
-    deliver_event(DME_SEV_PERIODIC_WORK, NULL);
+    /* Ask the sites if they are up; the tests start once they all are */
+    deliver_event(DME_SEV_STARTUP_TICK, NULL);
 
     /*
      * Main loop: just sit here and wait for interrups.
      * All work is done in interrupt handlers mapped to registered functions.
      */
     wait_events();
+    res = err_code;
     
 end:
     /*
@@ -414,6 +776,8 @@ end:
     safe_free(nodes);
     safe_free(synchro_delays);
     safe_free(response_times);
+    safe_free(startup_acked);
+    safe_free(ol_sites);
     
     return res;
 }
@@ -15,7 +15,9 @@
 #include "common/init.h"
 #include "common/fsm.h"
 #include "common/util.h"
+#include "common/localload.h"
 #include "common/net.h"
+#include "common/msgschema.h"
 
 /*
  * global vars, defined in each app
@@ -30,7 +32,7 @@ bool_t exit_request = FALSE;
 
 static char * fname = NULL;
 static struct timespec sup_tstamp;      /* used for performance measurements */
-static uint32 critical_region_simulated_duration = 0;
+static timespec_t critical_region_simulated_duration = { 0, 0 };
 
 /*
  * Suzuki specifics
@@ -60,20 +62,17 @@ struct token_s{						/*token structure*/
 	unsigned int pseudo_queue[50];
 };
 
-struct suzuki_message_s {
-	dme_message_hdr_t lm_hdr;
-    uint32            type;             /* REQUEST/REPLY/RELEASE */
-    proc_id_t         pid;              /* even though is redundant it's used to mirror the theory */
-    unsigned int 	  req_no;		/*request number*/
-    struct token_s 	  token; 		/*token */
-} PACKED;
+#define SUZUKI_MSG_FIELDS(F)                                            \
+    F(uint32,         type,   uint32)   /* REQUEST/REPLY/RELEASE */     \
+    F(proc_id_t,      pid,    uint64)   /* even though is redundant it's used to mirror the theory */ \
+    F(uint32,         req_no, uint32)   /* request number */            \
+    F(struct token_s, token,  uint32)   /* token */
+DME_MSG_SCHEMA(suzuki, MSGT_SUZUKI, SUZUKI_MSG_FIELDS)
 
 bool_t i_have_token = FALSE;
 
 struct token_s my_token;
 
-typedef struct suzuki_message_s suzuki_message_t;
-
 #define SUZUKI_MSG_LEN  (sizeof(suzuki_message_t))
 #define SUZUKI_DATA_LEN (SUZUKI_MSG_LEN - DME_MESSAGE_HEADER_LEN)
 
@@ -163,43 +162,17 @@ static int suzuki_msg_set(suzuki_message_t * const msg, unsigned int msgtype,
         return ERR_DME_HDR;
     }
 
-    /* first set the header */
-    dme_header_set(&msg->lm_hdr, MSGT_SUZUKI, SUZUKI_MSG_LEN, 0);
-
-    /* then the suzuki specific data */
-
-    msg->type = htonl(msgtype);
-    msg->pid = htonq(proc_id);
-    msg->req_no = htonl(suzuki_RN[proc_id]);
+    /* the suzuki specific data, in host order */
+    msg->type = msgtype;
+    msg->pid = proc_id;
+    msg->req_no = suzuki_RN[proc_id];
     msg->token = my_token;
 
-
     snprintf(msctext, msclen, "%s(pid=%llu, reqno=%u,tok: {%s})",
              msg_type_tostr(msgtype), proc_id, suzuki_RN[proc_id],
              token_tostr(&my_token, tokbuf, sizeof(tokbuf)));
 
-    return 0;
-}
-
-/*
- * Parse a received suzuki message. The space must be already allocated in 'msg'.
- */
-static int suzuki_msg_parse(buff_t buff, suzuki_message_t * msg) {
-    suzuki_message_t * src = (suzuki_message_t *)buff.data;
-
-    if (!msg || buff.data == NULL || buff.len < DME_MESSAGE_HEADER_LEN) {
-        return ERR_DME_HDR;
-    }
-
-    /* first parse the header */
-    dme_header_parse(buff, &msg->lm_hdr);
-
-    /* then the suzuki specific data */
-    msg->type = ntohl(src->type);
-    msg->pid = ntohq(src->pid);
-    msg->req_no = ntohl(src->req_no);
-    msg->token = src->token;
-    return 0;
+    return suzuki_msg_encode(msg);
 }
 
 /*
@@ -229,6 +202,14 @@ static int supervisor_send_inform_message(dme_ev_t ev) {
         sup_tstamp.tv_nsec = tnow.tv_nsec;
         break;
 
+    case DME_SEV_READY:
+    case DME_SEV_SYNCRO_ACK:
+        /* The startup handshake (see supervisor.c) */
+        sup_msg_set(&msg, ev, 0, 0, 0, msctext, sizeof(msctext));
+        err = dme_send_msg(SUPERVISOR_PID, (uint8*)&msg, SUPERVISOR_MESSAGE_LENGTH,
+                           msctext);
+        break;
+
     default:
         /* No need to send informs to the supervisor in other cases */
         break;
@@ -264,12 +245,19 @@ static int handle_supervisor_msg(void * cookie) {
         clock_gettime(CLOCK_REALTIME, &sup_tstamp);
         sup_msg_parse(*buff, &srcmsg);
 
-        if (srcmsg.msg_type == DME_SEV_SYNCRO) {
+        if (srcmsg.msg_type == DME_SEV_READY) {
+            ret = supervisor_send_inform_message(DME_SEV_READY);
+        }
+        else if (srcmsg.msg_type == DME_SEV_SYNCRO) {
             sup_syncro.tv_sec = srcmsg.sec_tdelta;
             sup_syncro.tv_nsec = srcmsg.nsec_tdelta;
+            ret = supervisor_send_inform_message(DME_SEV_SYNCRO_ACK);
+            local_load_start();
         }
-        else if (srcmsg.msg_type == DME_EV_WANT_CRITICAL_REG) {
-            critical_region_simulated_duration = srcmsg.sec_tdelta;
+        else if (srcmsg.msg_type == DME_EV_WANT_CRITICAL_REG &&
+                 !local_load_active()) {
+            critical_region_simulated_duration.tv_sec = srcmsg.sec_tdelta;
+            critical_region_simulated_duration.tv_nsec = srcmsg.nsec_tdelta;
             ret = handle_event(DME_EV_WANT_CRITICAL_REG, NULL);
         }
 
@@ -309,7 +297,10 @@ static int handle_peer_msg(void * cookie) {
         return ERR_RECV_MSG;
     }
 
-    suzuki_msg_parse(*buff, &srcmsg);
+    if (0 != (ret = suzuki_msg_decode(*buff, &srcmsg))) {
+        dbg_err("Recieved a malformed message. Ignoring it.");
+        return ret;
+    }
     dbg_msg("Recieved a %s from peer %llu (currently holding token=%d)",
     		srcmsg.type == MTYPE_REPLY ? "REPLY" : "REQUEST", srcmsg.pid, i_have_token);
     switch(fsm_state) {
@@ -328,12 +319,17 @@ static int handle_peer_msg(void * cookie) {
 
     			int final_element_in_queue = request_queue_final_idx();
 
-				dst_pid = my_token.pseudo_queue[final_element_in_queue];
-				request_queue_pop();
-				suzuki_msg_set(&dstmsg, MTYPE_REPLY, msctext, sizeof(msctext));
-				dme_send_msg(dst_pid, (uint8*)&dstmsg, SUZUKI_MSG_LEN, msctext);
-				i_have_token = FALSE;
-				memset(&my_token , 0 , sizeof(my_token));
+				/* A stale (e.g. retransmitted) request was already served: keep the token */
+				if (final_element_in_queue >= 0) {
+					dst_pid = my_token.pseudo_queue[final_element_in_queue];
+					request_queue_pop();
+					suzuki_msg_set(&dstmsg, MTYPE_REPLY, msctext, sizeof(msctext));
+					dme_send_msg(dst_pid, (uint8*)&dstmsg, SUZUKI_MSG_LEN, msctext);
+					i_have_token = FALSE;
+					memset(&my_token , 0 , sizeof(my_token));
+				} else {
+					dbg_msg("INFO: Stale request from %llu, keeping the token.", srcmsg.pid);
+				}
     		}else {
     			if ( suzuki_RN[srcmsg.pid] < srcmsg.req_no ){
     				suzuki_RN[srcmsg.pid] = srcmsg.req_no;
@@ -425,7 +421,8 @@ int process_ev_entered_cr(void * cookie)
 
     /* Finish our simulated work after the ammount of time specified by the supervisor */
     schedule_event(DME_EV_EXITED_CRITICAL_REG,
-                   critical_region_simulated_duration, 0, NULL);
+                   critical_region_simulated_duration.tv_sec,
+                   critical_region_simulated_duration.tv_nsec, NULL);
 
     dbg_msg("Exitting");
     return err;
@@ -451,6 +448,7 @@ int process_ev_exited_cr(void * cookie)
 
     /* inform the supervisor */
     supervisor_send_inform_message(DME_EV_EXITED_CRITICAL_REG);
+    local_load_think();
     my_token.suzuki_LN[proc_id]++;
     fsm_state = PS_IDLE;
 
@@ -477,6 +475,19 @@ int process_ev_exited_cr(void * cookie)
     return err;
 }
 
+/*
+ * A request of this site (see localload.c), handled as one from the
+ * supervisor.
+ */
+int process_ev_local_request(void * cookie)
+{
+    clock_gettime(CLOCK_REALTIME, &sup_tstamp);
+    critical_region_simulated_duration = local_load_cs_time();
+
+    return handle_event(DME_EV_WANT_CRITICAL_REG, NULL);
+}
+
+
 
 int main(int argc, char *argv[])
 {
@@ -517,10 +528,14 @@ int main(int argc, char *argv[])
     register_event_handler(DME_EV_WANT_CRITICAL_REG, process_ev_want_cr);
     register_event_handler(DME_EV_ENTERED_CRITICAL_REG, process_ev_entered_cr);
     register_event_handler(DME_EV_EXITED_CRITICAL_REG, process_ev_exited_cr);
+    register_event_handler(DME_EV_LOCAL_REQUEST, process_ev_local_request);
 
     memset(suzuki_RN, 0, sizeof(suzuki_RN));
     memset(&my_token, 0, sizeof(my_token));
 
+    /* Tell the supervisor we are up (it asks again if it starts after us) */
+    supervisor_send_inform_message(DME_SEV_READY);
+
     /*
      * Main loop: just sit here and wait for interrupts (triggered by the supervisor).
      * All work is done in interrupt handlers mapped to registered functions.
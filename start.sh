@@ -1,15 +1,16 @@
 #!/bin/bash
-NPROC=`head -n1 dme.conf | cut -d ' ' -f 1`
-
 ALGORITHM=lamport
-SUPDEF_ARGS="-f dme.conf -t 30 -r 70 -o supervisor.log"
+SUPDEF_ARGS="-t 30 -r 70 -o supervisor.log"
 
 USAGEMSG="Usage:\n"\
 "       start.sh   [algorithm]\n"\
-"                  [-f <config-file>] [-r <concurency ratio>] [-t <sec interval>]\n"\
+"                  [-r <concurency ratio>] [-t <sec interval>]\n"\
+"                  [-d <CS duration>] [-l <rate>[:<step>]] [-a <arrivals>]\n"\
 "                  [-o <out-logfile>]\n\n"\
 "By default the algorithm is lamport. See build/ for other algorithms.\n"\
-"Default parameter for supervisor are:\n\t'$SUPDEF_ARGS'\n"
+"Default parameter for supervisor are:\n\t'-f dme.conf $SUPDEF_ARGS'\n"\
+"The run lasts until ^C, or DURATION seconds if set. The output of process\n"\
+"i is in <algorithm>i.log (see build/dme-launch for more options).\n"
 
 
 [ "$1" == "-h" ] || [ "$1" == "--help" ] && {
@@ -24,20 +25,16 @@ USAGEMSG="Usage:\n"\
 
 [[ "$#" -gt 0 ]] && SUPERVISOR_ARGS="$@"
 
-for (( ix = 1; ix <= NPROC; ix++ )) ; do
-        echo "Starting process $ix ..."
-        xtermcmd="./build/$ALGORITHM -i $ix -f dme.conf | tee $ALGORITHM$ix.lgx;\
-                  read -p'----------Execution finished----------'"
-        xterm -geometry 140x20 -T "$ix: $ALGORITHM - Process $ix" -e "$xtermcmd" &
-        sleep 0.333
-done
+# All processes append binary MSC records here (see build/msctrace)
+export DME_TRACE=${ALGORITHM}.trace
+rm -f $DME_TRACE
 
-echo "Starting supervisor ..."
-xterm -geometry 140x20 -T "Supervisor" -e "./build/supervisor $SUPDEF_ARGS $SUPERVISOR_ARGS | tee ${ALGORITHM}0.lgx ; read -p'--exited--'" ;
+./build/dme-launch -f dme.conf -a $ALGORITHM -d ${DURATION:-0} \
+                   -- $SUPDEF_ARGS $SUPERVISOR_ARGS
 
 #Merge outputs
-cat ./${ALGORITHM}*\.lgx | sort -u | cut -d '#' -f 2 > ${ALGORITHM}.msc
-rm -f ./${ALGORITHM}*\.lgx
+./build/msctrace $DME_TRACE | sort -u | cut -d '#' -f 2 > ${ALGORITHM}.msc
+rm -f $DME_TRACE
 echo ------- contents of ${ALGORITHM}.msc ---------------------------
 cat ./${ALGORITHM}.msc
 echo ----  paste in http://www.websequencediagrams.com/  -----------------